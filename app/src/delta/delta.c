@@ -4,48 +4,314 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <stdlib.h>
 #include "delta.h"
+#ifdef CONFIG_DELTA_PIPELINE
+#include "delta_pipeline.h"
+#endif
+#ifdef CONFIG_DELTA_REVERSE
+#include "delta_reverse.h"
+#endif
+#ifdef CONFIG_DELTA_SIGNATURE
+#include "delta_signature.h"
+#endif
+#ifdef CONFIG_DELTA_ENCRYPTION
+#include "delta_crypt.h"
+#endif
+#if defined(CONFIG_DELTA_DRY_RUN) || defined(CONFIG_DELTA_BUNDLE)
+#include <mbedtls/sha256.h>
+#endif
+#ifdef CONFIG_DELTA_PATCH_CRC
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/byteorder.h>
+#endif
 
 LOG_MODULE_REGISTER(delta, LOG_LEVEL_DBG);
 
+static struct delta_stats stats;
+
+BUILD_ASSERT(sizeof(struct delta_wear) <= PAGE_SIZE,
+			 "The erase counters must fit in a page");
+
+static struct delta_wear wear;
+static off_t wear_next;
+static bool wear_loaded;
+static bool wear_dirty;
+
+/* MCUboot image header and TLV area, see bootutil/image.h */
+#define IMAGE_MAGIC 0x96f3b83d
+#define IMAGE_TLV_INFO_MAGIC 0x6907
+#define IMAGE_TLV_SHA256 0x10
+
+struct image_header {
+	uint32_t magic;
+	uint32_t load_addr;
+	uint16_t hdr_size;
+	uint16_t protect_tlv_size;
+	uint32_t img_size;
+	uint32_t flags;
+	uint8_t major;
+	uint8_t minor;
+	uint16_t revision;
+	uint32_t build_num;
+	uint32_t pad;
+};
+
+struct image_tlv_info {
+	uint16_t magic;
+	uint16_t tlv_tot;
+};
+
+struct image_tlv {
+	uint8_t type;
+	uint8_t pad;
+	uint16_t len;
+};
+
 /*
  *  IMAGE/FLASH MANAGEMENT
  */
 
-static int erase_page(struct flash_mem *flash, off_t offset)
+#ifdef CONFIG_DELTA_FLASH_TIMING_MODEL
+/* Sleep for the time the modelled flash would be busy. Sleeping (rather
+ * than busy waiting) leaves the CPU to other threads, like an external
+ * flash or a controller that does not stall on program/erase.
+ */
+static void flash_timing_model(size_t erased, size_t written)
+{
+	uint32_t us;
+
+	us = (erased / PAGE_SIZE) * CONFIG_DELTA_FLASH_ERASE_US;
+	us += (uint32_t)(((uint64_t)written * CONFIG_DELTA_FLASH_WRITE_US_PER_KB)
+			 / 1024);
+	if (us) {
+		k_usleep(us);
+	}
+}
+#else
+#define flash_timing_model(erased, written)
+#endif
+
+/* Fail if the page holds patch data in slot 1 that has not yet been read. */
+static int check_spill_overlap(struct flash_mem *flash, off_t offset)
+{
+	off_t unread;
+
+	if (flash->spill_end == 0) {
+		return DELTA_OK;
+	}
+
+	unread = flash->spill_start;
+	if (flash->patch_end == flash->spill_end) {
+		unread = flash->patch_current;
+	}
+
+	if (offset < flash->spill_end && offset + PAGE_SIZE > unread) {
+		return -DELTA_PATCH_OVERLAP_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+static void wear_count(struct flash_mem *flash, off_t offset);
+
+int delta_flash_erase_page(struct flash_mem *flash, off_t offset)
 {
+	uint32_t begin;
+
 	offset = offset - offset%PAGE_SIZE; /* find start of page */
 
+	if (check_spill_overlap(flash, offset)) {
+		return -DELTA_PATCH_OVERLAP_ERROR;
+	}
+
+	begin = k_cycle_get_32();
 	if (flash_erase(flash->device, offset, PAGE_SIZE)) {
 		return -DELTA_CLEARING_ERROR;
 	}
+	flash_timing_model(PAGE_SIZE, 0);
+	stats.flash_cycles += k_cycle_get_32() - begin;
+	delta_stats_count(DELTA_IO_ERASE, PAGE_SIZE);
+	wear_count(flash, offset);
+
+	return DELTA_OK;
+}
+
+/* Check if the data equals erased flash. */
+static bool is_erased(const uint8_t *buf_p, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (buf_p[i] != 0xff) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int delta_flash_program(struct flash_mem *flash, off_t offset,
+			const uint8_t *buf_p, size_t size)
+{
+	uint32_t begin;
+
+	if (is_erased(buf_p, size)) {
+		stats.skipped += size;
+		return DELTA_OK;
+	}
+
+	begin = k_cycle_get_32();
+	if (flash_write(flash->device, offset, buf_p, size)) {
+		return -DELTA_WRITING_ERROR;
+	}
+	flash_timing_model(0, size);
+	stats.flash_cycles += k_cycle_get_32() - begin;
+
+	return DELTA_OK;
+}
+
+
+#ifdef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+/* The slot 1 page being written. It is kept until it is complete, so
+ * that a page flash already holds is neither erased nor programmed.
+ */
+static struct {
+	off_t offset;
+	size_t size;
+	uint8_t buf[PAGE_SIZE];
+} page DELTA_ARENA;
+
+/* Check if flash holds the page, padded with erased bytes behind the
+ * data like a freshly erased and programmed page would be.
+ */
+static int page_unchanged(struct flash_mem *flash, bool *unchanged)
+{
+	uint8_t buf[64];
+	uint32_t begin;
+	size_t off;
+
+	*unchanged = false;
+	memset(&page.buf[page.size], 0xff, PAGE_SIZE - page.size);
+
+	for (off = 0; off < PAGE_SIZE; off += sizeof(buf)) {
+		begin = k_cycle_get_32();
+		if (flash_read(flash->device, page.offset + (off_t) off, buf,
+					   sizeof(buf))) {
+			return -DELTA_WRITING_ERROR;
+		}
+		stats.read_cycles += k_cycle_get_32() - begin;
+		if (memcmp(buf, &page.buf[off], sizeof(buf))) {
+			return DELTA_OK;
+		}
+	}
+	*unchanged = true;
+
+	return DELTA_OK;
+}
+
+static int delta_flash_page_flush(struct flash_mem *flash)
+{
+	bool unchanged;
+	int ret;
+
+	if (page.size == 0) {
+		return DELTA_OK;
+	}
+
+	ret = page_unchanged(flash, &unchanged);
+	if (ret) {
+		return ret;
+	}
+	if (unchanged) {
+		stats.unchanged_pages++;
+	} else {
+		ret = delta_flash_erase_page(flash, page.offset);
+		if (ret) {
+			return ret;
+		}
+		ret = delta_flash_program(flash, page.offset, page.buf, page.size);
+		if (ret) {
+			return ret;
+		}
+	}
+	page.size = 0;
+
+	return DELTA_OK;
+}
+
+int delta_flash_page_write(struct flash_mem *flash, off_t offset,
+			   const uint8_t *buf_p, size_t size)
+{
+	size_t len;
+	int ret;
+
+	while (size > 0) {
+		if (page.size == PAGE_SIZE ||
+			(page.size > 0 && offset != page.offset + (off_t) page.size)) {
+			ret = delta_flash_page_flush(flash);
+			if (ret) {
+				return ret;
+			}
+		}
+		/* data in front of the first write stays erased */
+		if (page.size == 0) {
+			page.offset = offset - offset%PAGE_SIZE;
+			page.size = (size_t) (offset - page.offset);
+			memset(page.buf, 0xff, page.size);
+		}
+
+		len = MIN(size, PAGE_SIZE - page.size);
+		memcpy(&page.buf[page.size], buf_p, len);
+		page.size += len;
+		offset += (off_t) len;
+		buf_p += len;
+		size -= len;
+	}
 
 	return DELTA_OK;
 }
+#endif
 
 static int delta_flash_write(void *arg_p,
 					const uint8_t *buf_p,
 					size_t size)
 {
 	struct flash_mem *flash;
+#ifdef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+	int ret;
+#endif
 
 	flash = (struct flash_mem *)arg_p;
+
+	if (!flash) {
+		return -DELTA_CASTING_ERROR;
+	}
+	delta_stats_count(DELTA_IO_WRITE, size);
+
+#ifdef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+	ret = delta_flash_page_write(flash, flash->to_current, buf_p, size);
+	if (ret) {
+		return ret;
+	}
+#else
 	flash->write_buf += size;
 
-	if (flash->write_buf >= PAGE_SIZE) {
-		if (erase_page(flash, flash->to_current + (off_t) size)) {
+	/* erase each page the write reaches into, keeping the part of the
+	 * write in the last one
+	 */
+	while (flash->write_buf > PAGE_SIZE) {
+		flash->write_buf -= PAGE_SIZE;
+		if (delta_flash_erase_page(flash, flash->to_current + (off_t) size -
+								   (off_t) flash->write_buf)) {
 			return -DELTA_CLEARING_ERROR;
 		}
-		flash->write_buf = 0;
-	}
-
-	if (!flash) {
-		return -DELTA_CASTING_ERROR;
 	}
 
-	if (flash_write(flash->device, flash->to_current, buf_p, size)) {
+	if (delta_flash_program(flash, flash->to_current, buf_p, size)) {
 		return -DELTA_WRITING_ERROR;
 	}
+#endif
 
 	flash->to_current += (off_t) size;
 	if (flash->to_current >= flash->to_end) {
@@ -60,6 +326,7 @@ static int delta_flash_from_read(void *arg_p,
 					size_t size)
 {
 	struct flash_mem *flash;
+	uint32_t begin;
 
 	flash = (struct flash_mem *)arg_p;
 
@@ -69,10 +336,13 @@ static int delta_flash_from_read(void *arg_p,
 	if (size <= 0) {
 		return -DELTA_INVALID_BUF_SIZE;
 	}
+	delta_stats_count(DELTA_IO_FROM_READ, size);
 
+	begin = k_cycle_get_32();
 	if (flash_read(flash->device, flash->from_current, buf_p, size)) {
 		return -DELTA_READING_SOURCE_ERROR;
 	}
+	stats.read_cycles += k_cycle_get_32() - begin;
 
 	flash->from_current += (off_t) size;
 	if (flash->from_current >= flash->from_end) {
@@ -87,6 +357,8 @@ static int delta_flash_patch_read(void *arg_p,
 					size_t size)
 {
 	struct flash_mem *flash;
+	uint32_t begin;
+	size_t len;
 
 	flash = (struct flash_mem *)arg_p;
 
@@ -96,14 +368,28 @@ static int delta_flash_patch_read(void *arg_p,
 	if (size <= 0) {
 		return -DELTA_INVALID_BUF_SIZE;
 	}
+	delta_stats_count(DELTA_IO_PATCH_READ, size);
 
-	if (flash_read(flash->device, flash->patch_current, buf_p, size)) {
-		return -DELTA_READING_PATCH_ERROR;
-	}
+	while (size > 0) {
+		/* continue in slot 1 when the patch partition part is read */
+		if (flash->patch_current >= flash->patch_end) {
+			if (flash->spill_end == 0 || flash->patch_end == flash->spill_end) {
+				return -DELTA_READING_PATCH_ERROR;
+			}
+			flash->patch_current = flash->spill_start;
+			flash->patch_end = flash->spill_end;
+		}
 
-	flash->patch_current += (off_t) size;
-	if (flash->patch_current >= flash->patch_end) {
-		return -DELTA_READING_PATCH_ERROR;
+		len = MIN(size, (size_t)(flash->patch_end - flash->patch_current));
+		begin = k_cycle_get_32();
+		if (flash_read(flash->device, flash->patch_current, buf_p, len)) {
+			return -DELTA_READING_PATCH_ERROR;
+		}
+		stats.read_cycles += k_cycle_get_32() - begin;
+
+		flash->patch_current += (off_t) len;
+		buf_p += len;
+		size -= len;
 	}
 
 	return DELTA_OK;
@@ -119,6 +405,7 @@ static int delta_flash_seek(void *arg_p, int offset)
 		return -DELTA_CASTING_ERROR;
 	}
 
+	delta_stats_count(DELTA_IO_SEEK, (size_t) abs(offset));
 	flash->from_current += offset;
 
 	if (flash->from_current >= flash->from_end) {
@@ -129,114 +416,1651 @@ static int delta_flash_seek(void *arg_p, int offset)
 }
 
 /*
- *  INIT
+ *  IN-PLACE MEMORY AND STEP LOG
  */
 
-static int delta_init_flash_mem(struct flash_mem *flash)
+/* Addresses from the in-place patcher are relative to IN_PLACE_OFFSET. */
+static int delta_mem_read(void *arg_p,
+					void *dst_p,
+					uintptr_t src,
+					size_t size)
 {
+	struct flash_mem *flash;
+	uint32_t begin;
+
+	flash = (struct flash_mem *)arg_p;
+
 	if (!flash) {
-		return -DELTA_NO_FLASH_FOUND;
+		return -DELTA_CASTING_ERROR;
+	}
+	if (src + size > IN_PLACE_SIZE) {
+		return -DELTA_READING_SOURCE_ERROR;
 	}
+	delta_stats_count(DELTA_IO_FROM_READ, size);
 
-	flash->from_current = PRIMARY_OFFSET;
-	flash->from_end = flash->from_current + PRIMARY_SIZE;
+	begin = k_cycle_get_32();
+	if (flash_read(flash->device, IN_PLACE_OFFSET + src, dst_p, size)) {
+		return -DELTA_READING_SOURCE_ERROR;
+	}
+	stats.read_cycles += k_cycle_get_32() - begin;
 
-	flash->to_current = SECONDARY_OFFSET;
-	flash->to_end = flash->to_current + SECONDARY_SIZE;
+	return DELTA_OK;
+}
 
-	flash->patch_current = STORAGE_OFFSET + HEADER_SIZE;
-	flash->patch_end = flash->patch_current + STORAGE_SIZE;
+static int delta_mem_write(void *arg_p,
+					uintptr_t dst,
+					void *src_p,
+					size_t size)
+{
+	struct flash_mem *flash;
 
-	flash->write_buf = 0;
+	flash = (struct flash_mem *)arg_p;
 
-	return DELTA_OK;
+	if (!flash) {
+		return -DELTA_CASTING_ERROR;
+	}
+	if (dst + size > IN_PLACE_SIZE) {
+		return -DELTA_SLOT1_OUT_OF_MEMORY;
+	}
+	delta_stats_count(DELTA_IO_WRITE, size);
+
+	return delta_flash_program(flash, IN_PLACE_OFFSET + dst, src_p, size);
 }
 
-static int delta_init(struct flash_mem *flash)
+static int delta_mem_erase(void *arg_p, uintptr_t addr, size_t size)
 {
+	struct flash_mem *flash;
+	uintptr_t end;
 	int ret;
 
-	ret = delta_init_flash_mem(flash);
-	if (ret) {
-		return ret;
+	flash = (struct flash_mem *)arg_p;
+
+	if (!flash) {
+		return -DELTA_CASTING_ERROR;
 	}
-	ret = erase_page(flash, flash->to_current);
-	if (ret) {
-		return ret;
+	/* segments are created page aligned, see create-patch-in-place */
+	if (addr % PAGE_SIZE != 0 || size % PAGE_SIZE != 0 ||
+		addr + size > IN_PLACE_SIZE) {
+		return -DELTA_CLEARING_ERROR;
+	}
+
+	for (end = addr + size; addr < end; addr += PAGE_SIZE) {
+		ret = delta_flash_erase_page(flash, IN_PLACE_OFFSET + addr);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return DELTA_OK;
+}
+
+/* STEP LOG: one word per completed step, appended to an erased page.
+ * The first word tags the log with the patch size so that a log left
+ * behind by an abandoned patch is not used to resume a new one.
+ */
+static int delta_step_get(void *arg_p, int *step_p)
+{
+	struct flash_mem *flash;
+	uint32_t word, tag;
+	off_t offset;
+
+	flash = (struct flash_mem *)arg_p;
+	tag = flash->patch_end - (STORAGE_OFFSET + HEADER_SIZE);
+	*step_p = 0;
+
+	if (flash_read(flash->device, STEP_LOG_OFFSET, &word, sizeof(word))) {
+		return -DELTA_STEP_LOG_ERROR;
+	}
+	if (word != tag) {
+		if (delta_flash_erase_page(flash, STEP_LOG_OFFSET) ||
+			delta_flash_program(flash, STEP_LOG_OFFSET,
+								(uint8_t *)&tag, sizeof(tag))) {
+			return -DELTA_STEP_LOG_ERROR;
+		}
+		flash->step_next = sizeof(tag);
+		return DELTA_OK;
+	}
+
+	for (offset = sizeof(tag); offset < STEP_LOG_SIZE; offset += sizeof(word)) {
+		if (flash_read(flash->device, STEP_LOG_OFFSET + offset,
+					   &word, sizeof(word))) {
+			return -DELTA_STEP_LOG_ERROR;
+		}
+		if (word == 0xFFFFFFFFU) {
+			break;
+		}
+		*step_p = (int)word;
+	}
+	flash->step_next = offset;
+
+	if (*step_p > 0) {
+		LOG_INF("Resuming in-place patch at step %d", *step_p);
+	}
+
+	return DELTA_OK;
+}
+
+static int delta_step_set(void *arg_p, int step)
+{
+	struct flash_mem *flash;
+	uint32_t word;
+
+	flash = (struct flash_mem *)arg_p;
+	word = (uint32_t)step;
+
+	/* A page holds far more steps than a slot has segments, so the
+	 * log is never erased (and its state never lost) mid-patch.
+	 */
+	if (flash->step_next + (off_t)sizeof(word) > STEP_LOG_SIZE) {
+		return -DELTA_STEP_LOG_ERROR;
+	}
+	if (delta_flash_program(flash, STEP_LOG_OFFSET + flash->step_next,
+							(uint8_t *)&word, sizeof(word))) {
+		return -DELTA_STEP_LOG_ERROR;
 	}
+	flash->step_next += sizeof(word);
 
 	return DELTA_OK;
 }
 
 /*
- *  PUBLIC FUNCTIONS
+ *  ERASE COUNTERS
  */
 
-int delta_check_and_apply(struct flash_mem *flash)
+/* Load the last valid record. Records that were not committed are
+ * passed over, so that a torn save is never used or written over.
+ */
+static int wear_load(struct flash_mem *flash)
 {
-	uint32_t patch_size = 0; 
-	int ret;
+	uint32_t magic, commit;
+	off_t offset;
 
-	ret = delta_read_patch_header(flash, &patch_size);
+	memset(&wear, 0, sizeof(wear));
+	wear_loaded = true;
 
-	if (ret < 0) {
-		return ret;
-	} else if (patch_size > 0) {
-		ret = delta_init(flash);
-		if (ret) {
-			return ret;
+	for (offset = 0; offset + (off_t)sizeof(wear) <= PAGE_SIZE;
+		 offset += sizeof(wear)) {
+		if (flash_read(flash->device, WEAR_OFFSET + offset,
+					   &magic, sizeof(magic)) ||
+			flash_read(flash->device,
+					   WEAR_OFFSET + offset + offsetof(struct delta_wear, commit),
+					   &commit, sizeof(commit))) {
+			wear_next = PAGE_SIZE;
+			return -DELTA_WEAR_ERROR;
 		}
-		ret = detools_apply_patch_callbacks(delta_flash_from_read,
-											delta_flash_seek,
-											delta_flash_patch_read,
-											(size_t) patch_size,
-											delta_flash_write,
-											flash);
-		if (ret <= 0) {
-			return ret;
+		if (magic == 0xFFFFFFFFU) {
+			break;
 		}
-		if (boot_request_upgrade(BOOT_UPGRADE_PERMANENT)) {
-			return -1;
+		if (magic != DELTA_WEAR_MAGIC || commit != DELTA_WEAR_COMMIT) {
+			continue;
+		}
+		if (flash_read(flash->device, WEAR_OFFSET + offset,
+					   &wear, sizeof(wear))) {
+			memset(&wear, 0, sizeof(wear));
+			wear_next = PAGE_SIZE;
+			return -DELTA_WEAR_ERROR;
 		}
-		sys_reboot(SYS_REBOOT_COLD);
 	}
+	wear_next = offset;
 
 	return DELTA_OK;
 }
 
-int delta_read_patch_header(struct flash_mem *flash, uint32_t *size_ptr)
+static void wear_count(struct flash_mem *flash, off_t offset)
 {
-	uint32_t new_patch, reset_msg, patch_header[2];
+	if (!wear_loaded) {
+		wear_load(flash);
+	}
 
-	new_patch = 0x5057454E; // ASCII for "NEWP" signaling new patch
-	reset_msg = 0x0U; // reset "NEWP"
+	if (offset >= SECONDARY_OFFSET &&
+		offset < SECONDARY_OFFSET + SECONDARY_SIZE) {
+		wear.slot1[(offset - SECONDARY_OFFSET) / PAGE_SIZE]++;
+	} else if (offset >= STORAGE_OFFSET &&
+			   offset < STORAGE_OFFSET + STORAGE_SIZE) {
+		wear.storage[(offset - STORAGE_OFFSET) / PAGE_SIZE]++;
+	} else {
+		return;
+	}
+	wear_dirty = true;
+}
 
-	if (flash_read(flash->device, STORAGE_OFFSET, patch_header, sizeof(patch_header))) {
-		return -DELTA_PATCH_HEADER_ERROR;
+int delta_wear_get(struct flash_mem *flash, struct delta_wear *out)
+{
+	int ret;
+
+	ret = DELTA_OK;
+	if (!wear_loaded) {
+		ret = wear_load(flash);
 	}
+	*out = wear;
 
-	if (new_patch!=patch_header[0]) {
-		LOG_INF("No new patch found");
+	return ret;
+}
+
+int delta_wear_save(struct flash_mem *flash)
+{
+	off_t offset;
+
+	if (!wear_dirty) {
 		return DELTA_OK;
 	}
 
-	*size_ptr = patch_header[1];
+	/* the erase is counted in the record written after it */
+	if (wear_next + (off_t)sizeof(wear) > PAGE_SIZE) {
+		if (delta_flash_erase_page(flash, WEAR_OFFSET)) {
+			return -DELTA_WEAR_ERROR;
+		}
+		wear_next = 0;
+	}
 
-	if (flash_write(flash->device, STORAGE_OFFSET, &reset_msg, sizeof(reset_msg))) {
-		return -DELTA_PATCH_HEADER_ERROR;
+	offset = WEAR_OFFSET + wear_next;
+	wear_next += sizeof(wear);
+	wear.magic = DELTA_WEAR_MAGIC;
+	wear.commit = DELTA_WEAR_COMMIT;
+
+	if (delta_flash_program(flash, offset, (uint8_t *)&wear,
+							offsetof(struct delta_wear, commit)) ||
+		delta_flash_program(flash, offset + offsetof(struct delta_wear, commit),
+							(uint8_t *)&wear.commit, sizeof(wear.commit))) {
+		return -DELTA_WEAR_ERROR;
 	}
-	
+	wear_dirty = false;
+
 	return DELTA_OK;
 }
 
-const char *delta_error_as_string(int error)
+/*
+ *  INIT
+ */
+
+static int delta_init_flash_mem(struct flash_mem *flash,
+								struct delta_patch_header *header)
 {
-	if (error < 28) {
-		return detools_error_as_string(error);
+	if (!flash) {
+		return -DELTA_NO_FLASH_FOUND;
 	}
 
-	if (error < 0) {
-		error *= -1;
+	flash->from_current = PRIMARY_OFFSET;
+	flash->from_end = flash->from_current + PRIMARY_SIZE;
+
+	flash->to_current = SECONDARY_OFFSET;
+	flash->to_end = flash->to_current + SECONDARY_SIZE;
+
+	flash->patch_current = STORAGE_OFFSET + HEADER_SIZE;
+	flash->patch_end = flash->patch_current + header->size - header->spill_size;
+
+	flash->spill_start = 0;
+	flash->spill_end = 0;
+	if (header->spill_size > 0) {
+		flash->spill_start = SECONDARY_OFFSET + header->spill_offset;
+		flash->spill_end = flash->spill_start + header->spill_size;
+	}
+
+	flash->step_next = 0;
+	flash->write_buf = 0;
+
+	return DELTA_OK;
+}
+
+static int delta_init(struct flash_mem *flash,
+					  struct delta_patch_header *header)
+{
+	int ret;
+
+	ret = delta_init_flash_mem(flash, header);
+	if (ret) {
+		return ret;
+	}
+#ifndef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+	ret = delta_flash_erase_page(flash, flash->to_current);
+	if (ret) {
+		return ret;
+	}
+#endif
+
+	return DELTA_OK;
+}
+
+/*
+ *  APPLY
+ */
+
+/* Size of the patch data, which the patcher is given. */
+static size_t delta_patch_data_size(struct delta_patch_header *header)
+{
+#ifdef CONFIG_DELTA_PATCH_CRC
+	return header->size - sizeof(uint32_t) *
+		DIV_ROUND_UP(header->size, PATCH_CRC_UNIT_SIZE);
+#else
+	return header->size;
+#endif
+}
+
+#ifdef CONFIG_DELTA_PATCH_CRC
+/* The checked chunk being served and the data not yet read. */
+static struct {
+	detools_read_t read;
+	size_t offset;
+	size_t size;
+	size_t served;
+	size_t remaining;
+} chunk;
+
+static uint8_t chunk_buf[PATCH_CRC_CHUNK_SIZE] DELTA_ARENA;
+
+static void chunk_crc_start(detools_read_t patch_read,
+							struct delta_patch_header *header)
+{
+	chunk.read = patch_read;
+	chunk.offset = 0;
+	chunk.size = 0;
+	chunk.served = 0;
+	chunk.remaining = delta_patch_data_size(header);
+}
+
+/* Read the next chunk and its CRC into the chunk buffer and check it. */
+static int chunk_crc_load(void *arg_p)
+{
+	uint32_t stored;
+	size_t size;
+	int ret;
+
+	if (chunk.remaining == 0) {
+		return -DELTA_READING_PATCH_ERROR;
+	}
+	chunk.offset += chunk.size;
+	chunk.size = 0;
+	chunk.served = 0;
+	size = MIN(chunk.remaining, PATCH_CRC_CHUNK_SIZE);
+
+	ret = chunk.read(arg_p, chunk_buf, size);
+	if (ret) {
+		return ret;
+	}
+	ret = chunk.read(arg_p, (uint8_t *)&stored, sizeof(stored));
+	if (ret) {
+		return ret;
+	}
+	if (sys_le32_to_cpu(stored) != crc32_ieee(chunk_buf, size)) {
+		LOG_ERR("Patch chunk at offset 0x%x is corrupt",
+				(uint32_t) chunk.offset);
+		chunk.remaining = 0;
+		return -DELTA_PATCH_CRC_ERROR;
+	}
+	chunk.size = size;
+	chunk.remaining -= size;
+
+	return DELTA_OK;
+}
+
+/* Serve the patch data from the chunk buffer, so that no byte of a
+ * chunk is decoded before its CRC is checked, and skip the CRCs.
+ */
+static int chunk_crc_patch_read(void *arg_p,
+					uint8_t *buf_p,
+					size_t size)
+{
+	size_t len;
+	int ret;
+
+	while (size > 0) {
+		if (chunk.served == chunk.size) {
+			ret = chunk_crc_load(arg_p);
+			if (ret) {
+				return ret;
+			}
+		}
+		len = MIN(size, chunk.size - chunk.served);
+		memcpy(buf_p, &chunk_buf[chunk.served], len);
+		chunk.served += len;
+		buf_p += len;
+		size -= len;
+	}
+
+	return DELTA_OK;
+}
+
+#ifdef CONFIG_DELTA_PATCH_CRC_PRESCAN
+/* Check the CRCs of the whole patch, read as fast as flash allows. */
+static int delta_patch_crc_scan(struct flash_mem *flash,
+								struct delta_patch_header *header)
+{
+	int ret;
+
+	ret = delta_init_flash_mem(flash, header);
+	if (ret) {
+		return ret;
+	}
+	chunk_crc_start(delta_flash_patch_read, header);
+
+	while (chunk.remaining > 0) {
+		ret = chunk_crc_load(flash);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return DELTA_OK;
+}
+#endif
+
+#define DELTA_PATCH_READ chunk_crc_patch_read
+#else
+#define DELTA_PATCH_READ delta_flash_patch_read
+#endif
+
+#ifdef CONFIG_DELTA_ENCRYPTION
+static detools_read_t encrypted_patch_read;
+
+static void delta_decrypt(uint8_t *buf_p, size_t size)
+{
+	uint32_t begin;
+
+	begin = k_cycle_get_32();
+	delta_crypt_apply(buf_p, size);
+	stats.decrypt_cycles += k_cycle_get_32() - begin;
+}
+
+/* Decrypt each chunk in place, in the buffer it was read to. */
+static int decrypt_patch_read(void *arg_p,
+					uint8_t *buf_p,
+					size_t size)
+{
+	int ret;
+
+	ret = encrypted_patch_read(arg_p, buf_p, size);
+	if (ret == DELTA_OK) {
+		delta_decrypt(buf_p, size);
+	}
+
+	return ret;
+}
+#endif
+
+#ifdef CONFIG_DELTA_REVERSE
+static detools_read_t reverse_patch_read;
+
+/* Pass the forward patch and the new image on to the reverse patch. */
+static int reverse_tee_patch_read(void *arg_p,
+					uint8_t *buf_p,
+					size_t size)
+{
+	int ret;
+
+	ret = reverse_patch_read(arg_p, buf_p, size);
+	if (ret == DELTA_OK) {
+		delta_reverse_patch(buf_p, size);
+	}
+
+	return ret;
+}
+
+static int reverse_tee_write(void *arg_p,
+					const uint8_t *buf_p,
+					size_t size)
+{
+	int ret;
+
+#ifdef CONFIG_DELTA_PIPELINE
+	ret = delta_pipeline_write(arg_p, buf_p, size);
+#else
+	ret = delta_flash_write(arg_p, buf_p, size);
+#endif
+	if (ret == DELTA_OK) {
+		delta_reverse_write(buf_p, size);
+	}
+
+	return ret;
+}
+
+#define DELTA_APPLY_WRITE reverse_tee_write
+#elif defined(CONFIG_DELTA_PIPELINE)
+#define DELTA_APPLY_WRITE delta_pipeline_write
+#else
+#define DELTA_APPLY_WRITE delta_flash_write
+#endif
+
+static int delta_apply_detools(struct flash_mem *flash,
+							   detools_read_t patch_read,
+							   size_t patch_size)
+{
+	return detools_apply_patch_callbacks(delta_flash_from_read,
+										 delta_flash_seek,
+										 patch_read,
+										 patch_size,
+										 DELTA_APPLY_WRITE,
+										 flash);
+}
+
+#ifdef CONFIG_DELTA_IMAGE_PATCH
+/* MCUboot header of the new image and the size of its TLV trailer, set
+ * for the next apply only, by an image patch.
+ */
+static struct {
+	bool active;
+	struct image_header header;
+	uint32_t trailer_size;
+} image_patch;
+
+static uint8_t image_buf[128] DELTA_ARENA;
+
+/* Read the image section and check it against the image in slot 0,
+ * which the payload is read from, behind its header.
+ */
+static int image_patch_begin(struct flash_mem *flash,
+							 detools_read_t patch_read,
+							 size_t *patch_size)
+{
+	struct delta_image_section section;
+	struct image_header from;
+	int ret;
+
+	ret = patch_read(flash, (uint8_t *)&section, sizeof(section));
+	if (ret) {
+		return ret;
+	}
+	if (section.hdr_size < sizeof(struct image_header) ||
+		*patch_size < sizeof(section) + section.trailer_size ||
+		(size_t) section.hdr_size + section.img_size + section.trailer_size >
+		SECONDARY_SIZE - SLOT1_TRAILER_SIZE) {
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+
+	if (flash_read(flash->device, PRIMARY_OFFSET, &from, sizeof(from))) {
+		return -DELTA_READING_SOURCE_ERROR;
+	}
+	if (from.magic != IMAGE_MAGIC ||
+		from.hdr_size != section.from_hdr_size ||
+		from.img_size != section.from_img_size) {
+		LOG_ERR("The image patch is not based on the image in slot 0");
+		return -DELTA_IMAGE_ERROR;
+	}
+
+	memset(&image_patch.header, 0, sizeof(image_patch.header));
+	image_patch.header.magic = IMAGE_MAGIC;
+	image_patch.header.load_addr = section.load_addr;
+	image_patch.header.hdr_size = section.hdr_size;
+	image_patch.header.protect_tlv_size = section.protect_tlv_size;
+	image_patch.header.img_size = section.img_size;
+	image_patch.header.flags = section.flags;
+	image_patch.header.major = section.major;
+	image_patch.header.minor = section.minor;
+	image_patch.header.revision = section.revision;
+	image_patch.header.build_num = section.build_num;
+	image_patch.trailer_size = section.trailer_size;
+	image_patch.active = true;
+
+	flash->from_current = PRIMARY_OFFSET + section.from_hdr_size;
+	*patch_size -= sizeof(section) + section.trailer_size;
+#ifdef CONFIG_DELTA_REVERSE
+	delta_reverse_size(section.hdr_size + section.img_size +
+					   section.trailer_size);
+#endif
+
+	return DELTA_OK;
+}
+
+/* The rebuilt header, padded with zeros up to the payload. */
+static int image_patch_write_header(struct flash_mem *flash)
+{
+	size_t size, len;
+	int ret;
+
+	ret = DELTA_APPLY_WRITE(flash, (const uint8_t *)&image_patch.header,
+							sizeof(image_patch.header));
+	memset(image_buf, 0, sizeof(image_buf));
+	size = image_patch.header.hdr_size - sizeof(image_patch.header);
+	for (; size > 0 && !ret; size -= len) {
+		len = MIN(size, sizeof(image_buf));
+		ret = DELTA_APPLY_WRITE(flash, image_buf, len);
+	}
+
+	return ret;
+}
+
+/* The TLV trailer, copied from behind the payload patch. */
+static int image_patch_write_trailer(struct flash_mem *flash,
+									 detools_read_t patch_read)
+{
+	size_t size, len;
+	int ret;
+
+	for (size = image_patch.trailer_size; size > 0; size -= len) {
+		len = MIN(size, sizeof(image_buf));
+		ret = patch_read(flash, image_buf, len);
+		if (!ret) {
+			ret = DELTA_APPLY_WRITE(flash, image_buf, len);
+		}
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return DELTA_OK;
+}
+
+/* Header, payload and trailer of an image patch, or a plain patch. */
+static int image_patch_apply(struct flash_mem *flash,
+							 detools_read_t patch_read,
+							 size_t patch_size)
+{
+	int ret, size;
+
+	if (!image_patch.active) {
+		return delta_apply_detools(flash, patch_read, patch_size);
+	}
+	image_patch.active = false;
+
+	ret = image_patch_write_header(flash);
+	if (ret) {
+		return ret;
+	}
+	size = delta_apply_detools(flash, patch_read, patch_size);
+	if (size < 0) {
+		return size;
+	}
+	if ((uint32_t) size != image_patch.header.img_size) {
+		return -DELTA_IMAGE_ERROR;
+	}
+	ret = image_patch_write_trailer(flash, patch_read);
+	if (ret) {
+		return ret;
+	}
+
+	return image_patch.header.hdr_size + size + image_patch.trailer_size;
+}
+
+#define DELTA_APPLY_PATCH image_patch_apply
+#else
+#define DELTA_APPLY_PATCH delta_apply_detools
+#endif
+
+static int delta_apply(struct flash_mem *flash,
+					   detools_read_t patch_read,
+					   size_t patch_size)
+{
+	int ret;
+#if defined(CONFIG_DELTA_PIPELINE) || defined(CONFIG_DELTA_SKIP_UNCHANGED_PAGES)
+	int finish;
+#endif
+
+#ifdef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+	page.size = 0;
+#endif
+#ifdef CONFIG_DELTA_PIPELINE
+	ret = delta_pipeline_start(flash);
+	if (ret) {
+		return ret;
+	}
+	ret = DELTA_APPLY_PATCH(flash, patch_read, patch_size);
+	finish = delta_pipeline_finish(flash);
+	if (finish && ret > 0) {
+		ret = finish;
+	}
+#else
+	ret = DELTA_APPLY_PATCH(flash, patch_read, patch_size);
+#endif
+#ifdef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+	/* the last page is written when the patch is done */
+	if (ret >= 0) {
+		finish = delta_flash_page_flush(flash);
+		if (finish) {
+			ret = finish;
+		}
+	}
+#endif
+
+	return ret;
+}
+
+static int delta_clear_patch_header(struct flash_mem *flash)
+{
+	uint32_t reset_msg;
+
+	reset_msg = 0x0U; // reset "NEWP"
+
+	if (flash_write(flash->device, STORAGE_OFFSET, &reset_msg, sizeof(reset_msg))) {
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+static int delta_read_patch_type(struct flash_mem *flash, int *type)
+{
+	uint8_t byte;
+#ifdef CONFIG_DELTA_ENCRYPTION
+	int ret;
+#endif
+
+	if (flash_read(flash->device, STORAGE_OFFSET + HEADER_SIZE,
+				   &byte, sizeof(byte))) {
+		return -DELTA_READING_PATCH_ERROR;
+	}
+#ifdef CONFIG_DELTA_ENCRYPTION
+	ret = delta_crypt_start_patch(flash);
+	if (ret) {
+		return ret;
+	}
+	delta_decrypt(&byte, sizeof(byte));
+#endif
+	*type = (byte >> 4) & 0x7;
+
+	return DELTA_OK;
+}
+
+/* Failures of the flash rather than of the patch. Slot 1 may be partly
+ * rewritten, and only the step log tells how far, so an in-place patch
+ * that fails with one of these is resumed instead of given up.
+ */
+static bool in_place_io_error(int ret)
+{
+	switch (-ret) {
+	case DETOOLS_IO_FAILED:
+	case DETOOLS_STEP_SET_FAILED:
+	case DETOOLS_STEP_GET_FAILED:
+	case DELTA_READING_PATCH_ERROR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* In-place patches rewrite slot 1 from the image already stored there.
+ * The header and the step log are kept until patching ends, or after an
+ * I/O error, so that an interrupted patch is resumed on the next boot.
+ * A patch found to be corrupt is cleared.
+ */
+static int delta_apply_in_place_and_reboot(struct flash_mem *flash,
+										   struct delta_patch_header *header)
+{
+	detools_read_t patch_read;
+	uint32_t begin;
+	int ret, clear;
+
+	patch_read = DELTA_PATCH_READ;
+
+	/* the spill would live in the memory being patched */
+	if (header->spill_size > 0) {
+		delta_clear_patch_header(flash);
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+
+	ret = delta_init_flash_mem(flash, header);
+	if (ret) {
+		return ret;
+	}
+#ifdef CONFIG_DELTA_PATCH_CRC
+	chunk_crc_start(delta_flash_patch_read, header);
+#endif
+#ifdef CONFIG_DELTA_ENCRYPTION
+	ret = delta_crypt_start_patch(flash);
+	if (ret) {
+		return ret;
+	}
+	encrypted_patch_read = patch_read;
+	patch_read = decrypt_patch_read;
+#endif
+	begin = k_cycle_get_32();
+	ret = detools_apply_patch_in_place_callbacks(delta_mem_read,
+												 delta_mem_write,
+												 delta_mem_erase,
+												 delta_step_set,
+												 delta_step_get,
+												 patch_read,
+												 delta_patch_data_size(header),
+												 flash);
+	stats.apply_cycles = k_cycle_get_32() - begin;
+	stats.applies++;
+
+	if (ret <= 0 && in_place_io_error(ret)) {
+		LOG_WRN("In-place patch interrupted, kept for resuming");
+		if (delta_wear_save(flash)) {
+			LOG_WRN("Could not save the erase counters");
+		}
+		return ret;
+	}
+	clear = delta_clear_patch_header(flash);
+	if (delta_flash_erase_page(flash, STEP_LOG_OFFSET) && !clear) {
+		clear = -DELTA_STEP_LOG_ERROR;
+	}
+	if (delta_wear_save(flash)) {
+		LOG_WRN("Could not save the erase counters");
+	}
+	if (ret <= 0) {
+		return ret;
+	}
+	if (clear) {
+		return clear;
+	}
+	if (boot_request_upgrade(BOOT_UPGRADE_PERMANENT)) {
+		return -1;
+	}
+	sys_reboot(SYS_REBOOT_COLD);
+
+	return DELTA_OK;
+}
+
+#ifdef CONFIG_DELTA_BUNDLE
+
+/*
+ *  BUNDLES
+ */
+
+#define BUNDLE_OFFSET (STORAGE_OFFSET + HEADER_SIZE)
+
+static uint8_t bundle_buf[256] DELTA_ARENA;
+
+static int bundle_read_entry(struct flash_mem *flash, uint32_t index,
+							 struct delta_bundle_entry *entry)
+{
+	if (flash_read(flash->device,
+				   BUNDLE_OFFSET + sizeof(uint32_t) + index * sizeof(*entry),
+				   entry, sizeof(*entry))) {
+		return -DELTA_READING_PATCH_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+/* Look up a flash area, which must be on the flash holding the bundle. */
+static int bundle_area(struct flash_mem *flash, uint8_t id,
+					   off_t *offset, size_t *size)
+{
+	const struct flash_area *fa;
+	int ret;
+
+	if (flash_area_open(id, &fa)) {
+		return -DELTA_BUNDLE_ERROR;
+	}
+
+	ret = DELTA_OK;
+	if (fa->fa_dev != flash->device) {
+		ret = -DELTA_BUNDLE_ERROR;
+	}
+	*offset = (off_t) fa->fa_off;
+	*size = fa->fa_size;
+	flash_area_close(fa);
+
+	return ret;
+}
+
+static bool overlaps(off_t a, size_t a_size, off_t b, size_t b_size)
+{
+	return a < b + (off_t) b_size && b < a + (off_t) a_size;
+}
+
+/* Check all entries before anything is erased. A target must not
+ * overlap the bundle, the running image, another target or any source.
+ */
+static int bundle_check(struct flash_mem *flash,
+						struct delta_patch_header *header, uint32_t *count)
+{
+	struct delta_bundle_entry entry, other;
+	off_t to_offset, offset;
+	size_t to_size, size;
+	uint32_t table_size, i, j;
+	uint8_t type;
+	int ret;
+
+	if (header->spill_size > 0 ||
+		flash_read(flash->device, BUNDLE_OFFSET, count, sizeof(*count)) ||
+		*count == 0 || *count > CONFIG_DELTA_BUNDLE_MAX_ENTRIES) {
+		return -DELTA_BUNDLE_ERROR;
+	}
+	table_size = sizeof(uint32_t) + *count * sizeof(entry);
+
+	for (i = 0; i < *count; i++) {
+		ret = bundle_read_entry(flash, i, &entry);
+		if (ret) {
+			return ret;
+		}
+		if (entry.offset < table_size || entry.size == 0 ||
+			entry.offset > header->size ||
+			entry.size > header->size - entry.offset) {
+			return -DELTA_BUNDLE_ERROR;
+		}
+
+		ret = bundle_area(flash, entry.to_area, &to_offset, &to_size);
+		if (ret) {
+			return ret;
+		}
+		if (entry.to_size >= to_size ||
+			overlaps(to_offset, to_size, STORAGE_OFFSET, STORAGE_SIZE) ||
+			overlaps(to_offset, to_size, PRIMARY_OFFSET, PRIMARY_SIZE)) {
+			return -DELTA_BUNDLE_ERROR;
+		}
+
+		for (j = 0; j < *count; j++) {
+			ret = bundle_read_entry(flash, j, &other);
+			if (ret) {
+				return ret;
+			}
+			ret = bundle_area(flash, other.from_area, &offset, &size);
+			if (ret) {
+				return ret;
+			}
+			if (overlaps(to_offset, to_size, offset, size)) {
+				return -DELTA_BUNDLE_ERROR;
+			}
+			if (j == i) {
+				continue;
+			}
+			ret = bundle_area(flash, other.to_area, &offset, &size);
+			if (ret) {
+				return ret;
+			}
+			if (overlaps(to_offset, to_size, offset, size)) {
+				return -DELTA_BUNDLE_ERROR;
+			}
+		}
+
+		/* an in-place sub-patch would rewrite its own source */
+		if (flash_read(flash->device, BUNDLE_OFFSET + entry.offset,
+					   &type, sizeof(type))) {
+			return -DELTA_READING_PATCH_ERROR;
+		}
+		if (((type >> 4) & 0x7) == DETOOLS_PATCH_TYPE_IN_PLACE) {
+			return -DELTA_BUNDLE_ERROR;
+		}
+	}
+
+	return DELTA_OK;
+}
+
+static int bundle_apply_entry(struct flash_mem *flash,
+							  struct delta_bundle_entry *entry)
+{
+	size_t size;
+	int ret;
+
+	ret = bundle_area(flash, entry->from_area, &flash->from_current, &size);
+	if (ret) {
+		return ret;
+	}
+	flash->from_end = flash->from_current + (off_t) size;
+
+	ret = bundle_area(flash, entry->to_area, &flash->to_current, &size);
+	if (ret) {
+		return ret;
+	}
+	flash->to_end = flash->to_current + (off_t) size;
+
+	flash->patch_current = BUNDLE_OFFSET + entry->offset;
+	flash->patch_end = flash->patch_current + entry->size;
+	flash->spill_start = 0;
+	flash->spill_end = 0;
+	flash->step_next = 0;
+	flash->write_buf = 0;
+
+#ifndef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+	ret = delta_flash_erase_page(flash, flash->to_current);
+	if (ret) {
+		return ret;
+	}
+#endif
+	ret = delta_apply(flash, delta_flash_patch_read, (size_t) entry->size);
+	if (ret >= 0 && ret != (int) entry->to_size) {
+		return -DELTA_VERIFY_ERROR;
+	}
+
+	return ret;
+}
+
+static int bundle_verify(struct flash_mem *flash,
+						 struct delta_bundle_entry *entry)
+{
+	mbedtls_sha256_context sha;
+	uint8_t digest[32];
+	off_t offset;
+	size_t size, done, len;
+	int ret;
+
+	ret = bundle_area(flash, entry->to_area, &offset, &size);
+	if (ret) {
+		return ret;
+	}
+
+	mbedtls_sha256_init(&sha);
+	mbedtls_sha256_starts(&sha, 0);
+
+	for (done = 0; done < entry->to_size && !ret; done += len) {
+		len = MIN(sizeof(bundle_buf), entry->to_size - done);
+		if (flash_read(flash->device, offset + (off_t) done,
+					   bundle_buf, len)) {
+			ret = -DELTA_READING_SOURCE_ERROR;
+		} else if (mbedtls_sha256_update(&sha, bundle_buf, len)) {
+			ret = -DELTA_VERIFY_ERROR;
+		}
+	}
+	if (!ret && (mbedtls_sha256_finish(&sha, digest) ||
+				 memcmp(digest, entry->digest, sizeof(digest)))) {
+		ret = -DELTA_VERIFY_ERROR;
+	}
+	mbedtls_sha256_free(&sha);
+
+	return ret;
+}
+
+/* All sub-patches are applied before any target is verified, and the
+ * upgrades of all MCUboot images are requested before the one reboot.
+ */
+static int delta_bundle_apply_and_reboot(struct flash_mem *flash,
+										 struct delta_patch_header *header)
+{
+	struct delta_bundle_entry entry;
+	uint32_t count, i, begin;
+	int ret;
+
+	ret = bundle_check(flash, header, &count);
+	if (ret) {
+		delta_clear_patch_header(flash);
+		return ret;
+	}
+	ret = delta_clear_patch_header(flash);
+	if (ret) {
+		return ret;
+	}
+
+	begin = k_cycle_get_32();
+	for (i = 0; i < count && ret >= 0; i++) {
+		ret = bundle_read_entry(flash, i, &entry);
+		if (!ret) {
+			ret = bundle_apply_entry(flash, &entry);
+		}
+	}
+	stats.apply_cycles = k_cycle_get_32() - begin;
+	stats.applies++;
+	if (delta_wear_save(flash)) {
+		LOG_WRN("Could not save the erase counters");
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (i = 0; i < count; i++) {
+		ret = bundle_read_entry(flash, i, &entry);
+		if (!ret) {
+			ret = bundle_verify(flash, &entry);
+		}
+		if (ret) {
+			return ret;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		ret = bundle_read_entry(flash, i, &entry);
+		if (ret) {
+			return ret;
+		}
+		if (entry.image != DELTA_BUNDLE_NO_IMAGE &&
+			boot_request_upgrade_multi(entry.image, BOOT_UPGRADE_PERMANENT)) {
+			return -1;
+		}
+	}
+	sys_reboot(SYS_REBOOT_COLD);
+
+	return DELTA_OK;
+}
+
+#endif /* CONFIG_DELTA_BUNDLE */
+
+#ifdef CONFIG_DELTA_DRY_RUN
+
+/*
+ *  DRY RUN
+ */
+
+/* The target image is hashed instead of written. Reads are timed so
+ * that decoding can be told apart from flash access.
+ */
+struct dry_run {
+	struct flash_mem *flash;
+	mbedtls_sha256_context sha;
+	uint32_t read_cycles;
+};
+
+static int dry_run_from_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+	struct dry_run *dry;
+	uint32_t begin;
+	int ret;
+
+	dry = (struct dry_run *)arg_p;
+	begin = k_cycle_get_32();
+	ret = delta_flash_from_read(dry->flash, buf_p, size);
+	dry->read_cycles += k_cycle_get_32() - begin;
+
+	return ret;
+}
+
+static int dry_run_seek(void *arg_p, int offset)
+{
+	struct dry_run *dry;
+
+	dry = (struct dry_run *)arg_p;
+
+	return delta_flash_seek(dry->flash, offset);
+}
+
+static int dry_run_patch_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+	struct dry_run *dry;
+	uint32_t begin;
+	int ret;
+
+	dry = (struct dry_run *)arg_p;
+	begin = k_cycle_get_32();
+	ret = DELTA_PATCH_READ(dry->flash, buf_p, size);
+	dry->read_cycles += k_cycle_get_32() - begin;
+#ifdef CONFIG_DELTA_ENCRYPTION
+	if (ret == DELTA_OK) {
+		delta_decrypt(buf_p, size);
+	}
+#endif
+
+	return ret;
+}
+
+static int dry_run_write(void *arg_p, const uint8_t *buf_p, size_t size)
+{
+	struct dry_run *dry;
+
+	dry = (struct dry_run *)arg_p;
+	delta_stats_count(DELTA_IO_WRITE, size);
+
+	dry->flash->to_current += (off_t) size;
+	if (dry->flash->to_current >= dry->flash->to_end) {
+		return -DELTA_SLOT1_OUT_OF_MEMORY;
+	}
+	if (mbedtls_sha256_update(&dry->sha, buf_p, size)) {
+		return -DELTA_WRITING_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+int delta_dry_run(struct flash_mem *flash,
+				  struct delta_dry_run_stats *dry_stats)
+{
+	struct delta_patch_header header;
+	struct dry_run dry;
+	uint32_t begin;
+	int ret, type;
+
+	memset(dry_stats, 0, sizeof(*dry_stats));
+
+	ret = delta_read_patch_header(flash, &header);
+	if (ret < 0 || header.size == 0) {
+		return ret;
+	}
+	if (header.magic == DELTA_NEW_BUNDLE_MAGIC ||
+		header.magic == DELTA_NEW_IMAGE_MAGIC) {
+		return -DELTA_DRY_RUN_UNSUPPORTED;
+	}
+#ifdef CONFIG_DELTA_SIGNATURE
+	ret = delta_signature_check(flash, &header);
+	if (ret) {
+		return ret;
+	}
+#endif
+
+	/* in-place patches rewrite the source, which a dry run cannot */
+	ret = delta_read_patch_type(flash, &type);
+	if (ret) {
+		return ret;
+	}
+	if (type == DETOOLS_PATCH_TYPE_IN_PLACE) {
+		return -DELTA_DRY_RUN_UNSUPPORTED;
+	}
+
+	ret = delta_init_flash_mem(flash, &header);
+	if (ret) {
+		return ret;
+	}
+#ifdef CONFIG_DELTA_PATCH_CRC
+	chunk_crc_start(delta_flash_patch_read, &header);
+#endif
+#ifdef CONFIG_DELTA_ENCRYPTION
+	ret = delta_crypt_start_patch(flash);
+	if (ret) {
+		return ret;
+	}
+#endif
+
+	dry.flash = flash;
+	dry.read_cycles = 0;
+	mbedtls_sha256_init(&dry.sha);
+	mbedtls_sha256_starts(&dry.sha, 0);
+
+	begin = k_cycle_get_32();
+	ret = detools_apply_patch_callbacks(dry_run_from_read,
+										dry_run_seek,
+										dry_run_patch_read,
+										delta_patch_data_size(&header),
+										dry_run_write,
+										&dry);
+	stats.apply_cycles = k_cycle_get_32() - begin;
+	stats.applies++;
+	dry_stats->total_us = k_cyc_to_us_floor32(stats.apply_cycles);
+	dry_stats->read_us = k_cyc_to_us_floor32(dry.read_cycles);
+
+	if (ret > 0) {
+		dry_stats->patch_size = header.size;
+		dry_stats->to_size = (uint32_t) ret;
+		if (mbedtls_sha256_finish(&dry.sha, dry_stats->digest)) {
+			ret = -DELTA_WRITING_ERROR;
+		} else {
+			ret = DELTA_OK;
+		}
+	}
+	mbedtls_sha256_free(&dry.sha);
+
+	return ret;
+}
+
+#endif
+
+/*
+ *  PUBLIC FUNCTIONS
+ */
+
+int delta_check_and_apply(struct flash_mem *flash)
+{
+	struct delta_patch_header header;
+	int ret, type;
+
+	ret = delta_read_patch_header(flash, &header);
+
+	if (ret < 0) {
+		return ret;
+	} else if (header.size == 0) {
+		return DELTA_OK;
+	}
+
+#ifdef CONFIG_DELTA_SIGNATURE
+	/* before anything is erased */
+	ret = delta_signature_check(flash, &header);
+	if (ret) {
+		return ret;
+	}
+#endif
+
+#ifdef CONFIG_DELTA_BUNDLE
+	if (header.magic == DELTA_NEW_BUNDLE_MAGIC) {
+		return delta_bundle_apply_and_reboot(flash, &header);
+	}
+#endif
+
+#ifdef CONFIG_DELTA_PATCH_CRC_PRESCAN
+	/* before anything is erased */
+	ret = delta_patch_crc_scan(flash, &header);
+	if (ret) {
+		return ret;
+	}
+#endif
+
+	/* image patches are sequential, the type is behind the image section */
+	if (header.magic == DELTA_NEW_PATCH_MAGIC) {
+		ret = delta_read_patch_type(flash, &type);
+		if (ret) {
+			return ret;
+		}
+		if (type == DETOOLS_PATCH_TYPE_IN_PLACE) {
+			return delta_apply_in_place_and_reboot(flash, &header);
+		}
+	}
+
+	ret = delta_clear_patch_header(flash);
+	if (ret) {
+		return ret;
+	}
+#ifdef CONFIG_DELTA_ENCRYPTION
+	ret = delta_crypt_start_patch(flash);
+	if (ret) {
+		return ret;
+	}
+#endif
+
+	return delta_apply_and_reboot(flash,
+								  delta_flash_patch_read,
+								  &header);
+}
+
+int delta_apply_and_reboot(struct flash_mem *flash,
+						   detools_read_t patch_read,
+						   struct delta_patch_header *header)
+{
+	size_t patch_size;
+	uint32_t begin;
+	int ret;
+
+	ret = delta_init(flash, header);
+	if (ret) {
+		return ret;
+	}
+	patch_size = delta_patch_data_size(header);
+#ifdef CONFIG_DELTA_PATCH_CRC
+	chunk_crc_start(patch_read, header);
+	patch_read = chunk_crc_patch_read;
+#endif
+#ifdef CONFIG_DELTA_ENCRYPTION
+	/* decrypted before anything else sees the patch */
+	encrypted_patch_read = patch_read;
+	patch_read = decrypt_patch_read;
+#endif
+#ifdef CONFIG_DELTA_REVERSE
+	delta_reverse_begin(flash);
+#endif
+#ifdef CONFIG_DELTA_IMAGE_PATCH
+	image_patch.active = false;
+	if (header->magic == DELTA_NEW_IMAGE_MAGIC) {
+		ret = image_patch_begin(flash, patch_read, &patch_size);
+		if (ret) {
+			return ret;
+		}
+	}
+#endif
+#ifdef CONFIG_DELTA_REVERSE
+	reverse_patch_read = patch_read;
+	patch_read = reverse_tee_patch_read;
+#endif
+	begin = k_cycle_get_32();
+	ret = delta_apply(flash, patch_read, patch_size);
+	stats.apply_cycles = k_cycle_get_32() - begin;
+#ifdef CONFIG_DELTA_SIGNATURE
+	/* patches read only once are verified before the upgrade */
+	if (delta_signature_finish() && ret > 0) {
+		ret = -DELTA_SIGNATURE_ERROR;
+	}
+#endif
+#ifdef CONFIG_DELTA_REVERSE
+	delta_reverse_end(ret);
+#endif
+	stats.applies++;
+	if (delta_wear_save(flash)) {
+		LOG_WRN("Could not save the erase counters");
+	}
+	if (ret <= 0) {
+		return ret;
+	}
+	if (boot_request_upgrade(BOOT_UPGRADE_PERMANENT)) {
+		return -1;
+	}
+	sys_reboot(SYS_REBOOT_COLD);
+
+	return DELTA_OK;
+}
+
+#ifdef CONFIG_DELTA_REVERSE
+static int delta_request_upgrade_and_reboot(void)
+{
+	if (boot_request_upgrade(BOOT_UPGRADE_PERMANENT)) {
+		return -1;
+	}
+	sys_reboot(SYS_REBOOT_COLD);
+
+	return DELTA_OK;
+}
+
+static int delta_apply_reverse(struct flash_mem *flash,
+							   struct delta_reverse_header *reverse)
+{
+	struct delta_patch_header header;
+	uint32_t crc;
+	int ret;
+
+	header.magic = DELTA_NEW_PATCH_MAGIC;
+	header.size = reverse->size;
+	header.spill_offset = 0;
+	header.spill_size = 0;
+	ret = delta_init(flash, &header);
+	if (ret) {
+		return ret;
+	}
+	flash->patch_current = REVERSE_OFFSET + sizeof(*reverse);
+	flash->patch_end = flash->patch_current + reverse->size;
+
+	ret = delta_apply(flash, delta_flash_patch_read, (size_t) reverse->size);
+	stats.applies++;
+	if (delta_wear_save(flash)) {
+		LOG_WRN("Could not save the erase counters");
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	if ((uint32_t) ret != reverse->to_size) {
+		return -DELTA_VERIFY_ERROR;
+	}
+
+	ret = delta_reverse_crc(flash, SECONDARY_OFFSET, reverse->to_size, &crc);
+	if (ret) {
+		return ret;
+	}
+	if (crc != reverse->to_crc) {
+		return -DELTA_VERIFY_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+int delta_rollback(struct flash_mem *flash)
+{
+	struct delta_reverse_header reverse;
+	struct delta_slot_info info;
+	uint32_t crc;
+	int ret;
+
+	ret = delta_reverse_read_header(flash, &reverse);
+	if (ret) {
+		return ret;
+	}
+
+	if (reverse.size > 0) {
+		ret = delta_reverse_crc(flash, SECONDARY_OFFSET, reverse.to_size, &crc);
+		if (ret) {
+			return ret;
+		}
+		if (crc == reverse.to_crc) {
+			LOG_INF("Slot 1 holds the previous image");
+			return delta_request_upgrade_and_reboot();
+		}
+
+		ret = delta_reverse_crc(flash, PRIMARY_OFFSET, reverse.from_size, &crc);
+		if (ret) {
+			return ret;
+		}
+		if (crc == reverse.from_crc) {
+			LOG_INF("Applying the reverse patch");
+			ret = delta_apply_reverse(flash, &reverse);
+			if (ret) {
+				return ret;
+			}
+			return delta_request_upgrade_and_reboot();
+		}
+		LOG_WRN("The reverse patch does not match slot 0");
+	}
+
+	ret = delta_read_slot_info(flash, 1, &info);
+	if (ret) {
+		return ret;
+	}
+	if (!info.valid) {
+		return -DELTA_ROLLBACK_ERROR;
+	}
+	LOG_INF("Swapping back the image in slot 1");
+
+	return delta_request_upgrade_and_reboot();
+}
+#endif
+
+int delta_resume_in_place(struct flash_mem *flash)
+{
+	struct delta_patch_header header;
+	uint32_t tag;
+	int ret, type;
+
+	ret = delta_read_patch_header(flash, &header);
+	if (ret < 0 || header.size == 0 ||
+		header.magic != DELTA_NEW_PATCH_MAGIC) {
+		return ret;
+	}
+	ret = delta_read_patch_type(flash, &type);
+	if (ret || type != DETOOLS_PATCH_TYPE_IN_PLACE) {
+		return ret;
+	}
+
+	/* the step log is tagged with the size of the patch it belongs to */
+	if (flash_read(flash->device, STEP_LOG_OFFSET, &tag, sizeof(tag))) {
+		return -DELTA_STEP_LOG_ERROR;
+	}
+	if (tag != header.size - header.spill_size) {
+		return DELTA_OK;
+	}
+	LOG_INF("Resuming an interrupted in-place patch");
+
+	return delta_check_and_apply(flash);
+}
+
+int delta_read_patch_header(struct flash_mem *flash,
+							struct delta_patch_header *header)
+{
+	if (flash_read(flash->device, STORAGE_OFFSET, header, sizeof(*header))) {
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+
+	if (header->magic != DELTA_NEW_PATCH_MAGIC && // "NEWP" signaling new patch
+		(!IS_ENABLED(CONFIG_DELTA_BUNDLE) ||
+		 header->magic != DELTA_NEW_BUNDLE_MAGIC) &&
+		(!IS_ENABLED(CONFIG_DELTA_IMAGE_PATCH) ||
+		 header->magic != DELTA_NEW_IMAGE_MAGIC)) {
+		LOG_INF("No new patch found");
+		header->size = 0;
+		return DELTA_OK;
+	}
+
+	/* the spill must fit between the target image and the image trailer.
+	 * The limits are compared by subtracting, as the sizes come from
+	 * flash and sums of them can wrap.
+	 */
+	if (header->spill_size > header->size ||
+		header->size - header->spill_size >
+		(WEAR_OFFSET - STORAGE_OFFSET) - HEADER_SIZE) {
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+#ifdef CONFIG_DELTA_PATCH_CRC
+	/* each chunk, the last one too, holds data and its CRC */
+	if (header->magic != DELTA_NEW_BUNDLE_MAGIC &&
+		header->size % PATCH_CRC_UNIT_SIZE != 0 &&
+		header->size % PATCH_CRC_UNIT_SIZE <= sizeof(uint32_t)) {
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+#endif
+	if (header->spill_size > 0 &&
+		(header->spill_offset % PAGE_SIZE != 0 ||
+		 header->spill_size > SECONDARY_SIZE - SLOT1_TRAILER_SIZE ||
+		 header->spill_offset >
+		 SECONDARY_SIZE - SLOT1_TRAILER_SIZE - header->spill_size)) {
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+int delta_read_slot_info(struct flash_mem *flash, int slot,
+						 struct delta_slot_info *info)
+{
+	struct image_header header;
+	struct image_tlv_info tlv_info;
+	struct image_tlv tlv;
+	off_t offset, start, end;
+
+	memset(info, 0, sizeof(*info));
+	start = slot == 0 ? PRIMARY_OFFSET : SECONDARY_OFFSET;
+	end = start + (slot == 0 ? PRIMARY_SIZE : SECONDARY_SIZE);
+
+	if (flash_read(flash->device, start, &header, sizeof(header))) {
+		return -DELTA_READING_SOURCE_ERROR;
+	}
+	if (header.magic != IMAGE_MAGIC ||
+		start + header.hdr_size + header.img_size >= end) {
+		return DELTA_OK;
+	}
+
+	info->valid = true;
+	info->major = header.major;
+	info->minor = header.minor;
+	info->revision = header.revision;
+	info->build_num = header.build_num;
+	info->size = header.hdr_size + header.img_size;
+
+	/* the digest is in the unprotected TLVs behind the protected ones */
+	offset = start + header.hdr_size + header.img_size + header.protect_tlv_size;
+	if (flash_read(flash->device, offset, &tlv_info, sizeof(tlv_info))) {
+		return -DELTA_READING_SOURCE_ERROR;
+	}
+	if (tlv_info.magic != IMAGE_TLV_INFO_MAGIC) {
+		return DELTA_OK;
+	}
+	info->size += header.protect_tlv_size + tlv_info.tlv_tot;
+
+	end = MIN(end, offset + tlv_info.tlv_tot);
+	offset += sizeof(tlv_info);
+	while (offset + (off_t) sizeof(tlv) <= end) {
+		if (flash_read(flash->device, offset, &tlv, sizeof(tlv))) {
+			return -DELTA_READING_SOURCE_ERROR;
+		}
+		offset += sizeof(tlv);
+		if (tlv.type == IMAGE_TLV_SHA256 &&
+			tlv.len == sizeof(info->digest)) {
+			if (flash_read(flash->device, offset, info->digest,
+						   sizeof(info->digest))) {
+				return -DELTA_READING_SOURCE_ERROR;
+			}
+			info->has_digest = true;
+			break;
+		}
+		offset += tlv.len;
+	}
+
+	return DELTA_OK;
+}
+
+void delta_stats_get(struct delta_stats *out)
+{
+	*out = stats;
+}
+
+void delta_stats_reset(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+void delta_stats_count(enum delta_io io, size_t size)
+{
+	struct delta_io_stats *io_stats;
+	int bucket;
+
+	io_stats = &stats.io[io];
+	io_stats->calls++;
+	io_stats->bytes += size;
+
+	bucket = 0;
+	if (size > 0) {
+		bucket = MIN(31 - __builtin_clz((uint32_t) size),
+					 DELTA_IO_HIST_SIZE - 1);
+	}
+	io_stats->hist[bucket]++;
+}
+
+const char *delta_error_as_string(int error)
+{
+	if (error < 0) {
+		error *= -1;
+	}
+
+	if (error < 28) {
+		return detools_error_as_string(error);
 	}
 
 	switch (error) {
@@ -260,6 +2084,36 @@ const char *delta_error_as_string(int error)
 		return "No flash found.";
 	case DELTA_PATCH_HEADER_ERROR:
 		return "Error reading patch header.";
+	case DELTA_STREAM_TIMEOUT:
+		return "Timeout waiting for patch data.";
+	case DELTA_STREAM_OVERFLOW:
+		return "Patch stream overflowed the receive buffer.";
+	case DELTA_STREAM_NO_DEVICE:
+		return "No patch stream device found.";
+	case DELTA_PATCH_OVERLAP_ERROR:
+		return "Target image overlaps unread patch data in slot 1.";
+	case DELTA_STEP_LOG_ERROR:
+		return "Error accessing the in-place step log.";
+	case DELTA_DRY_RUN_UNSUPPORTED:
+		return "Dry run not supported for in-place patches, bundles and image patches.";
+	case DELTA_WEAR_ERROR:
+		return "Error accessing the erase counters.";
+	case DELTA_BUNDLE_ERROR:
+		return "Invalid bundle.";
+	case DELTA_VERIFY_ERROR:
+		return "Target image does not match its digest or CRC.";
+	case DELTA_JOURNAL_ERROR:
+		return "Error accessing the page journal.";
+	case DELTA_ROLLBACK_ERROR:
+		return "No previous image to roll back to.";
+	case DELTA_SIGNATURE_ERROR:
+		return "Patch signature is invalid.";
+	case DELTA_KEY_ERROR:
+		return "No valid patch decryption key.";
+	case DELTA_PATCH_CRC_ERROR:
+		return "Patch chunk CRC mismatch, the patch is corrupt.";
+	case DELTA_IMAGE_ERROR:
+		return "Image patch does not match slot 0 or its own image sizes.";
 	default:
 		return "Unknown error.";
 	}
@@ -25,11 +25,56 @@
 #define STORAGE_OFFSET FIXED_PARTITION_OFFSET(storage_partition)
 #define STORAGE_SIZE FIXED_PARTITION_SIZE(storage_partition)
 
-/* PATCH HEADER SIZE */
-#define HEADER_SIZE 0x8
+/* BUFFERS PLACED IN THE STATIC ARENA, SEE CONFIG_DELTA_STATIC_ARENA */
+#ifdef CONFIG_DELTA_STATIC_ARENA
+#define DELTA_ARENA Z_GENERIC_SECTION(.delta_arena)
+#else
+#define DELTA_ARENA
+#endif
+
+/* PATCH HEADER SIZE, INCLUDING THE SIGNATURE OF SIGNED PATCHES AND THE
+ * NONCE OF ENCRYPTED PATCHES, WHICH ENDS THE HEADER
+ */
+#define DELTA_SIGNATURE_SIZE 64
+#define DELTA_NONCE_SIZE 16
+#ifdef CONFIG_DELTA_SIGNATURE
+#define HEADER_SIGNATURE_SIZE DELTA_SIGNATURE_SIZE
+#else
+#define HEADER_SIGNATURE_SIZE 0
+#endif
+#ifdef CONFIG_DELTA_ENCRYPTION
+#define HEADER_NONCE_SIZE DELTA_NONCE_SIZE
+#else
+#define HEADER_NONCE_SIZE 0
+#endif
+#define HEADER_SIZE (sizeof(struct delta_patch_header) + \
+					 HEADER_SIGNATURE_SIZE + HEADER_NONCE_SIZE)
+#define NONCE_OFFSET (STORAGE_OFFSET + HEADER_SIZE - DELTA_NONCE_SIZE)
+
+/* PATCH CHUNK CRCS. With CONFIG_DELTA_PATCH_CRC each chunk of patch
+ * data, the last one possibly shorter, is followed by its CRC-32 (IEEE),
+ * little-endian, so corruption is found before the chunk is decoded.
+ */
+#ifdef CONFIG_DELTA_PATCH_CRC
+#define PATCH_CRC_CHUNK_SIZE CONFIG_DELTA_PATCH_CRC_CHUNK_SIZE
+#define PATCH_CRC_UNIT_SIZE (PATCH_CRC_CHUNK_SIZE + sizeof(uint32_t))
+#endif
+
+/* SPACE KEPT FREE AT THE END OF SLOT 1 FOR THE MCUBOOT IMAGE TRAILER */
+#define SLOT1_TRAILER_SIZE 0x1000
+
+/* AREA PATCHED BY IN-PLACE PATCHES. THE RUNNING IMAGE CANNOT BE
+ * OVERWRITTEN, SO THE IN-PLACE SOURCE IS THE IMAGE IN SLOT 1.
+ */
+#define IN_PLACE_OFFSET SECONDARY_OFFSET
+#define IN_PLACE_SIZE (SECONDARY_SIZE - SLOT1_TRAILER_SIZE)
+
+/* IN-PLACE STEP LOG, LAST PAGE OF THE STORAGE PARTITION */
+#define STEP_LOG_OFFSET (STORAGE_OFFSET + STORAGE_SIZE - PAGE_SIZE)
+#define STEP_LOG_SIZE PAGE_SIZE
 
 /* PAGE SIZE */
-#define PAGE_SIZE 0x1000
+#define PAGE_SIZE CONFIG_DELTA_PAGE_SIZE
 
 /* Error codes. */
 #define DELTA_OK                                          0
@@ -43,11 +88,103 @@
 #define DELTA_CLEARING_ERROR							 35
 #define DELTA_NO_FLASH_FOUND							 36
 #define DELTA_PATCH_HEADER_ERROR                         37
+#define DELTA_STREAM_TIMEOUT                             38
+#define DELTA_STREAM_OVERFLOW                            39
+#define DELTA_STREAM_NO_DEVICE                           40
+#define DELTA_PATCH_OVERLAP_ERROR                        41
+#define DELTA_STEP_LOG_ERROR                             42
+#define DELTA_DRY_RUN_UNSUPPORTED                        43
+#define DELTA_WEAR_ERROR                                 44
+#define DELTA_BUNDLE_ERROR                               45
+#define DELTA_VERIFY_ERROR                               46
+#define DELTA_JOURNAL_ERROR                              47
+#define DELTA_ROLLBACK_ERROR                             48
+#define DELTA_SIGNATURE_ERROR                            49
+#define DELTA_KEY_ERROR                                  50
+#define DELTA_PATCH_CRC_ERROR                            51
+#define DELTA_IMAGE_ERROR                                52
+
+/* PATCH HEADER MAGIC, ASCII FOR "NEWP" */
+#define DELTA_NEW_PATCH_MAGIC 0x5057454E
+
+/* PATCH HEADER, STORED IN FRONT OF THE PATCH.
+ * - "Size" is the size of the whole patch, with its chunk CRCs.
+ * - "Spill" is the part of the patch that did not fit in the storage
+ *   partition. It is placed at a page aligned offset in slot 1, behind
+ *   the space needed by the target image. A spill size of zero means
+ *   the whole patch is in the storage partition.
+ * - With CONFIG_DELTA_SIGNATURE the header is followed by the patch
+ *   signature, see delta_signature.h.
+ * - With CONFIG_DELTA_ENCRYPTION the header is followed by the nonce
+ *   the patch is encrypted with, see delta_crypt.h.
+ */
+struct delta_patch_header {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t spill_offset;
+	uint32_t spill_size;
+};
+
+/* BUNDLE HEADER MAGIC, ASCII FOR "NEWB" */
+#define DELTA_NEW_BUNDLE_MAGIC 0x4257454E
+
+/* BUNDLE OF SUB-PATCHES, STORED BEHIND A PATCH HEADER WITH THE BUNDLE
+ * MAGIC. The bundle starts with a 32-bit number of entries, followed
+ * by the entries and then the sub-patches. Bundles do not spill.
+ * - "From" and "to" are flash area IDs, as given by FIXED_PARTITION_ID().
+ * - "Image" is the MCUboot image whose upgrade is requested once all
+ *   targets are verified, or DELTA_BUNDLE_NO_IMAGE for a data area.
+ * - "Offset" of the sub-patch is counted from the start of the bundle.
+ * - "Digest" is the SHA-256 of the first "to size" bytes of the target.
+ */
+#define DELTA_BUNDLE_NO_IMAGE 0xff
+
+struct delta_bundle_entry {
+	uint8_t from_area;
+	uint8_t to_area;
+	uint8_t image;
+	uint8_t reserved;
+	uint32_t offset;
+	uint32_t size;
+	uint32_t to_size;
+	uint8_t digest[32];
+};
+
+/* IMAGE PATCH HEADER MAGIC, ASCII FOR "NEWI" */
+#define DELTA_NEW_IMAGE_MAGIC 0x4957454E
+
+/* IMAGE SECTION, STARTING THE PATCH DATA OF A PATCH WITH THE IMAGE
+ * MAGIC. The sequential patch behind it covers only the image payload,
+ * without the MCUboot header and TLVs, and is followed by the TLV
+ * trailer of the new image, stored as it is.
+ * - "From" header and image sizes are those of the image in slot 0 the
+ *   payload was diffed from.
+ * - The other fields are those of the MCUboot header of the new image,
+ *   which is rebuilt from them and padded with zeros to "hdr size".
+ * - "Trailer size" covers the protected and unprotected TLVs.
+ */
+struct delta_image_section {
+	uint32_t from_img_size;
+	uint16_t from_hdr_size;
+	uint16_t hdr_size;
+	uint32_t load_addr;
+	uint32_t img_size;
+	uint32_t flags;
+	uint16_t protect_tlv_size;
+	uint16_t revision;
+	uint8_t major;
+	uint8_t minor;
+	uint16_t reserved;
+	uint32_t build_num;
+	uint32_t trailer_size;
+};
 
 /* FLASH MEMORY AND POINTERS TO CURRENT LOCATION OF BUFFERS AND END OF IMAGE AREAS.
  * - "Patch" refers to the area containing the patch image.
  * - "From" refers to the area containing the source image.
  * - "To" refers to the area where the target image is to be placed.
+ * - "Spill" refers to the part of the patch stored in slot 1, read
+ *   after the part in the patch partition.
  */
 struct flash_mem {
 	const struct device *device;
@@ -57,9 +194,101 @@ struct flash_mem {
 	off_t from_end;
 	off_t to_current;
 	off_t to_end;
+	off_t spill_start;
+	off_t spill_end;
+	off_t step_next;
 	size_t write_buf;
 };
 
+/* IMAGE IN A SLOT, FROM ITS MCUBOOT HEADER AND TLVS.
+ * - "Valid" is false if the slot holds no MCUboot image.
+ * - "Size" includes the header and the TLVs, if found.
+ * - "Digest" is the SHA-256 that MCUboot validates the image with. It
+ *   identifies the image a patch may be created from.
+ */
+struct delta_slot_info {
+	bool valid;
+	bool has_digest;
+	uint8_t major;
+	uint8_t minor;
+	uint16_t revision;
+	uint32_t build_num;
+	uint32_t size;
+	uint8_t digest[32];
+};
+
+/* DRY RUN RESULTS.
+ * - "Total" is the time of the whole dry run, and "read" the part of
+ *   it spent reading the patch and the source image. The rest is
+ *   decoding.
+ * - "Digest" is the SHA-256 of the target image.
+ */
+struct delta_dry_run_stats {
+	uint32_t patch_size;
+	uint32_t to_size;
+	uint32_t total_us;
+	uint32_t read_us;
+	uint8_t digest[32];
+};
+
+/* FLASH AND APPLY STATISTICS, COUNTED SINCE BOOT OR THE LAST RESET.
+ * - Each patcher callback and page erase counts its calls and bytes,
+ *   and the calls in a histogram by the base two logarithm of the
+ *   size. Seeks count the size of the offset. The last histogram
+ *   bucket also holds all larger sizes.
+ * - "Skipped" counts bytes that were not programmed as they equal
+ *   erased flash.
+ * - Cycles are hardware cycles. "Apply" is the duration of the last
+ *   apply or dry run, "read" and "flash" the total time spent in
+ *   flash reads and in programming and erasing, and "decrypt" the
+ *   time spent decrypting encrypted patches.
+ */
+#define DELTA_IO_HIST_SIZE 14
+
+enum delta_io {
+	DELTA_IO_PATCH_READ,
+	DELTA_IO_FROM_READ,
+	DELTA_IO_WRITE,
+	DELTA_IO_SEEK,
+	DELTA_IO_ERASE,
+	DELTA_IO_COUNT
+};
+
+struct delta_io_stats {
+	uint32_t calls;
+	uint32_t bytes;
+	uint32_t hist[DELTA_IO_HIST_SIZE];
+};
+
+struct delta_stats {
+	uint32_t applies;
+	struct delta_io_stats io[DELTA_IO_COUNT];
+	uint32_t skipped;
+	uint32_t unchanged_pages;
+	uint32_t apply_cycles;
+	uint32_t read_cycles;
+	uint32_t flash_cycles;
+	uint32_t decrypt_cycles;
+};
+
+/* PERSISTENT ERASE COUNTERS, ONE PER PAGE OF SLOT 1 AND THE STORAGE
+ * PARTITION. Appended as records to an erased page in front of the
+ * step log, which is only erased when full. A record is valid when
+ * its commit word is written, which is done last.
+ */
+#define WEAR_OFFSET (STEP_LOG_OFFSET - PAGE_SIZE)
+#define WEAR_SLOT1_PAGES (SECONDARY_SIZE / PAGE_SIZE)
+#define WEAR_STORAGE_PAGES (STORAGE_SIZE / PAGE_SIZE)
+#define DELTA_WEAR_MAGIC 0x52414557 /* "WEAR" */
+#define DELTA_WEAR_COMMIT 0x0
+
+struct delta_wear {
+	uint32_t magic;
+	uint32_t slot1[WEAR_SLOT1_PAGES];
+	uint32_t storage[WEAR_STORAGE_PAGES];
+	uint32_t commit;
+};
+
 /* FUNCTION DECLARATIONS */
 
 /**
@@ -75,17 +304,157 @@ struct flash_mem {
 int delta_check_and_apply(struct flash_mem *flash);
 
 /**
- * Functiong for reading the metadata from the patch and
- * changing the header to mark that the patch has been
- * applied.
+ * Applies the in-place patch in the patch partition if an earlier
+ * apply of it was interrupted, as told by its step log. Called at
+ * boot, so that slot 1 is not left partly rewritten until the next
+ * check for patches.
+ *
+ * @param[in] flash the devices flash memory.
+ *
+ * @return zero(0) if there is nothing to resume or a negative error
+ * code. Does not return if the patch is applied.
+ */
+int delta_resume_in_place(struct flash_mem *flash);
+
+/**
+ * Applies a patch read through the given callback to slot 1,
+ * then requests an upgrade and restarts the device.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[in] patch_read callback reading the next part of the
+ * patch (without the patch header), called with flash as argument.
+ * With CONFIG_DELTA_ENCRYPTION it is decrypted as it is read, from
+ * the nonce given to delta_crypt_start().
+ * @param[in] header the patch header.
+ *
+ * @return a negative error code. Does not return on success.
+ */
+int delta_apply_and_reboot(struct flash_mem *flash,
+						   detools_read_t patch_read,
+						   struct delta_patch_header *header);
+
+/**
+ * Decodes the patch in the patch partition without erasing or
+ * writing any flash, and without marking the patch as applied.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[out] dry_stats target size and digest, and timing. The patch
+ * size is zero(0) if there is no new patch.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_dry_run(struct flash_mem *flash,
+				  struct delta_dry_run_stats *dry_stats);
+
+/**
+ * Functiong for reading the metadata from the patch. The
+ * header is marked as applied when patching starts, or when
+ * it ends for in-place patches which may be resumed.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[out] header the patch header. The size is set
+ * to zero(0) if there is no new patch.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_read_patch_header(struct flash_mem *flash,
+							struct delta_patch_header *header);
+
+/**
+ * Reads the version and digest of the image in a slot. Sequential
+ * patches are created from the image in slot 0, in-place patches from
+ * the image in slot 1.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[in] slot zero(0) or one(1).
+ * @param[out] info the image version, size and digest.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_read_slot_info(struct flash_mem *flash, int slot,
+						 struct delta_slot_info *info);
+
+/**
+ * Erase the flash page containing the given offset.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[in] offset any offset within the page.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_flash_erase_page(struct flash_mem *flash, off_t offset);
+
+/**
+ * Program already erased flash. Data that is all erased bytes (0xff)
+ * is not programmed, as the flash already holds it.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[in] offset flash offset to write to.
+ * @param[in] buf_p data to write.
+ * @param[in] size number of bytes to write.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_flash_program(struct flash_mem *flash, off_t offset,
+			const uint8_t *buf_p, size_t size);
+
+#ifdef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+/**
+ * Write the new image through a page buffer. Each complete page is
+ * compared with flash, and only erased and programmed if it differs.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[in] offset flash offset to write to, following the previous
+ *                   write.
+ * @param[in] buf_p data to write.
+ * @param[in] size number of bytes to write.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_flash_page_write(struct flash_mem *flash, off_t offset,
+			   const uint8_t *buf_p, size_t size);
+#endif
+
+/**
+ * Get a copy of the flash and apply statistics.
+ *
+ * @param[out] out the statistics.
+ */
+void delta_stats_get(struct delta_stats *out);
+
+/**
+ * Reset the flash and apply statistics.
+ */
+void delta_stats_reset(void);
+
+/**
+ * Count a call of given kind and size in the flash and apply
+ * statistics.
+ *
+ * @param[in] io kind of call.
+ * @param[in] size size of the call.
+ */
+void delta_stats_count(enum delta_io io, size_t size);
+
+/**
+ * Get the erase counters, as saved after the last apply plus the
+ * erases since.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[out] out the erase counters.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_wear_get(struct flash_mem *flash, struct delta_wear *out);
+
+/**
+ * Save the erase counters to flash. Done after each apply.
  *
  * @param[in] flash the devices flash memory.
  *
- * @return zero(0) if not patch, a negative value (0>)
- * representing an error, or a positive value (0<)
- * representing the patch size.
+ * @return zero(0) or a negative error code.
  */
-int delta_read_patch_header(struct flash_mem *flash, uint32_t *size_ptr);
+int delta_wear_save(struct flash_mem *flash);
 
 /**
  * Get the error string for given error code.
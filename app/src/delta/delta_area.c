@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <zephyr/sys/crc.h>
+#include "delta_area.h"
+
+/* JOURNAL, THE FIRST PAGE OF THE JOURNAL AREA.
+ * - The header identifies the patch and the areas it is applied to.
+ * - "Done" is written with the target size when all pages are committed.
+ * - One commit word per target page follows the header. It is
+ *   programmed to zero once the page holds its new data.
+ */
+#define JOURNAL_MAGIC 0x4C4E524A /* "JRNL" */
+#define JOURNAL_COMMITTED 0x0U
+#define JOURNAL_PAGES ((PAGE_SIZE - sizeof(struct journal)) / sizeof(uint32_t))
+
+struct journal {
+	uint32_t magic;
+	uint32_t patch_crc;
+	uint32_t patch_size;
+	uint8_t from_area;
+	uint8_t to_area;
+	uint16_t reserved;
+	uint32_t done;
+};
+
+struct area_apply {
+	const struct flash_area *patch;
+	const struct flash_area *from;
+	const struct flash_area *to;
+	const struct flash_area *journal;
+	off_t patch_current;
+	off_t patch_end;
+	off_t from_current;
+	off_t to_current;
+	bool page_done;
+};
+
+static uint8_t area_buf[256] DELTA_ARENA;
+
+/*
+ *  JOURNAL
+ */
+
+static off_t commit_offset(off_t to_offset)
+{
+	return sizeof(struct journal) + (to_offset / PAGE_SIZE) * sizeof(uint32_t);
+}
+
+/* Prepare the target page starting at the current offset. */
+static int page_begin(struct area_apply *apply)
+{
+	uint32_t commit;
+
+	if ((size_t)(apply->to_current / PAGE_SIZE) >= JOURNAL_PAGES) {
+		return -DELTA_SLOT1_OUT_OF_MEMORY;
+	}
+	if (flash_area_read(apply->journal, commit_offset(apply->to_current),
+			    &commit, sizeof(commit))) {
+		return -DELTA_JOURNAL_ERROR;
+	}
+
+	apply->page_done = (commit == JOURNAL_COMMITTED);
+	if (apply->page_done) {
+		return DELTA_OK;
+	}
+
+	delta_stats_count(DELTA_IO_ERASE, PAGE_SIZE);
+	if (flash_area_erase(apply->to, apply->to_current, PAGE_SIZE)) {
+		return -DELTA_CLEARING_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+/* Commit the target page holding the byte before the current offset. */
+static int page_commit(struct area_apply *apply)
+{
+	uint32_t commit;
+
+	if (apply->page_done) {
+		return DELTA_OK;
+	}
+
+	commit = JOURNAL_COMMITTED;
+	if (flash_area_write(apply->journal, commit_offset(apply->to_current - 1),
+			     &commit, sizeof(commit))) {
+		return -DELTA_JOURNAL_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+static int patch_crc(struct area_apply *apply, uint32_t *crc)
+{
+	off_t offset;
+	size_t len;
+
+	*crc = 0;
+	for (offset = apply->patch_current; offset < apply->patch_end;
+	     offset += (off_t) len) {
+		len = MIN(sizeof(area_buf), (size_t)(apply->patch_end - offset));
+		if (flash_area_read(apply->patch, offset, area_buf, len)) {
+			return -DELTA_READING_PATCH_ERROR;
+		}
+		*crc = crc32_ieee_update(*crc, area_buf, len);
+	}
+
+	return DELTA_OK;
+}
+
+/* Resume the journal of the same patch, or start a new one. */
+static int journal_open(struct area_apply *apply, uint32_t *done)
+{
+	struct journal journal, current;
+	int ret;
+
+	memset(&journal, 0xff, sizeof(journal));
+	journal.magic = JOURNAL_MAGIC;
+	journal.patch_size = (uint32_t)(apply->patch_end - apply->patch_current);
+	journal.from_area = apply->from->fa_id;
+	journal.to_area = apply->to->fa_id;
+	ret = patch_crc(apply, &journal.patch_crc);
+	if (ret) {
+		return ret;
+	}
+
+	if (flash_area_read(apply->journal, 0, &current, sizeof(current))) {
+		return -DELTA_JOURNAL_ERROR;
+	}
+	current.done = journal.done;
+	if (!memcmp(&current, &journal, sizeof(journal))) {
+		if (flash_area_read(apply->journal, offsetof(struct journal, done),
+				    done, sizeof(*done))) {
+			return -DELTA_JOURNAL_ERROR;
+		}
+		return DELTA_OK;
+	}
+
+	*done = journal.done;
+	delta_stats_count(DELTA_IO_ERASE, PAGE_SIZE);
+	if (flash_area_erase(apply->journal, 0, PAGE_SIZE) ||
+	    flash_area_write(apply->journal, 0, &journal, sizeof(journal))) {
+		return -DELTA_JOURNAL_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+/*
+ *  PATCHER CALLBACKS
+ */
+
+static int area_from_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+	struct area_apply *apply;
+
+	apply = (struct area_apply *)arg_p;
+	delta_stats_count(DELTA_IO_FROM_READ, size);
+
+	if (apply->from_current + (off_t) size > (off_t) apply->from->fa_size ||
+	    flash_area_read(apply->from, apply->from_current, buf_p, size)) {
+		return -DELTA_READING_SOURCE_ERROR;
+	}
+	apply->from_current += (off_t) size;
+
+	return DELTA_OK;
+}
+
+static int area_from_seek(void *arg_p, int offset)
+{
+	struct area_apply *apply;
+
+	apply = (struct area_apply *)arg_p;
+	delta_stats_count(DELTA_IO_SEEK, (size_t) abs(offset));
+
+	apply->from_current += offset;
+	if (apply->from_current < 0 ||
+	    apply->from_current > (off_t) apply->from->fa_size) {
+		return -DELTA_SEEKING_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+static int area_patch_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+	struct area_apply *apply;
+
+	apply = (struct area_apply *)arg_p;
+	delta_stats_count(DELTA_IO_PATCH_READ, size);
+
+	if (apply->patch_current + (off_t) size > apply->patch_end ||
+	    flash_area_read(apply->patch, apply->patch_current, buf_p, size)) {
+		return -DELTA_READING_PATCH_ERROR;
+	}
+	apply->patch_current += (off_t) size;
+
+	return DELTA_OK;
+}
+
+static int area_to_write(void *arg_p, const uint8_t *buf_p, size_t size)
+{
+	struct area_apply *apply;
+	size_t len;
+	int ret;
+
+	apply = (struct area_apply *)arg_p;
+	delta_stats_count(DELTA_IO_WRITE, size);
+
+	if (apply->to_current + (off_t) size > (off_t) apply->to->fa_size) {
+		return -DELTA_SLOT1_OUT_OF_MEMORY;
+	}
+
+	while (size > 0) {
+		if (apply->to_current % PAGE_SIZE == 0) {
+			ret = page_begin(apply);
+			if (ret) {
+				return ret;
+			}
+		}
+
+		len = MIN(size, (size_t)(PAGE_SIZE - apply->to_current % PAGE_SIZE));
+		if (!apply->page_done &&
+		    flash_area_write(apply->to, apply->to_current, buf_p, len)) {
+			return -DELTA_WRITING_ERROR;
+		}
+		apply->to_current += (off_t) len;
+		buf_p += len;
+		size -= len;
+
+		if (apply->to_current % PAGE_SIZE == 0) {
+			ret = page_commit(apply);
+			if (ret) {
+				return ret;
+			}
+		}
+	}
+
+	return DELTA_OK;
+}
+
+/*
+ *  APPLY
+ */
+
+static bool overlaps(const struct flash_area *a, const struct flash_area *b)
+{
+	return a->fa_dev == b->fa_dev &&
+	       a->fa_off < b->fa_off + (off_t) b->fa_size &&
+	       b->fa_off < a->fa_off + (off_t) a->fa_size;
+}
+
+static int area_apply(struct area_apply *apply)
+{
+	uint32_t done;
+	int ret;
+
+	/* the source must stay intact for a resumed apply to decode alike */
+	if (overlaps(apply->to, apply->from) ||
+	    overlaps(apply->to, apply->patch) ||
+	    overlaps(apply->to, apply->journal) ||
+	    overlaps(apply->journal, apply->from) ||
+	    overlaps(apply->journal, apply->patch)) {
+		return -DELTA_PATCH_OVERLAP_ERROR;
+	}
+	if (apply->patch_current < 0 ||
+	    apply->patch_end > (off_t) apply->patch->fa_size) {
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+
+	ret = journal_open(apply, &done);
+	if (ret) {
+		return ret;
+	}
+	if (done != 0xFFFFFFFFU) {
+		return (int) done;
+	}
+
+	ret = detools_apply_patch_callbacks(area_from_read,
+					    area_from_seek,
+					    area_patch_read,
+					    (size_t)(apply->patch_end - apply->patch_current),
+					    area_to_write,
+					    apply);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	if (apply->to_current % PAGE_SIZE != 0) {
+		ret = page_commit(apply);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	done = (uint32_t) apply->to_current;
+	if (flash_area_write(apply->journal, offsetof(struct journal, done),
+			     &done, sizeof(done))) {
+		return -DELTA_JOURNAL_ERROR;
+	}
+
+	return (int) done;
+}
+
+int delta_area_apply(uint8_t patch_id, off_t patch_offset, size_t patch_size,
+		     uint8_t from_id, uint8_t to_id, uint8_t journal_id)
+{
+	struct area_apply apply;
+	int ret;
+
+	memset(&apply, 0, sizeof(apply));
+	apply.patch_current = patch_offset;
+	apply.patch_end = patch_offset + (off_t) patch_size;
+
+	ret = -DELTA_NO_FLASH_FOUND;
+	if (!flash_area_open(patch_id, &apply.patch) &&
+	    !flash_area_open(from_id, &apply.from) &&
+	    !flash_area_open(to_id, &apply.to) &&
+	    !flash_area_open(journal_id, &apply.journal)) {
+		ret = area_apply(&apply);
+	}
+
+	if (apply.journal) {
+		flash_area_close(apply.journal);
+	}
+	if (apply.to) {
+		flash_area_close(apply.to);
+	}
+	if (apply.from) {
+		flash_area_close(apply.from);
+	}
+	if (apply.patch) {
+		flash_area_close(apply.patch);
+	}
+
+	return ret;
+}
+
+int delta_area_done(uint8_t journal_id)
+{
+	const struct flash_area *fa;
+	struct journal journal;
+	int ret;
+
+	if (flash_area_open(journal_id, &fa)) {
+		return -DELTA_NO_FLASH_FOUND;
+	}
+
+	ret = DELTA_OK;
+	if (flash_area_read(fa, 0, &journal, sizeof(journal))) {
+		ret = -DELTA_JOURNAL_ERROR;
+	} else if (journal.magic == JOURNAL_MAGIC &&
+		   journal.done != 0xFFFFFFFFU) {
+		ret = (int) journal.done;
+	}
+	flash_area_close(fa);
+
+	return ret;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef DELTA_AREA_H
+#define DELTA_AREA_H
+
+#include "delta.h"
+
+/* PATCHING BETWEEN ARBITRARY FLASH AREAS.
+ * - Source, target, patch and journal are flash areas by ID, as given
+ *   by FIXED_PARTITION_ID(), and may be on different flash devices.
+ * - The first page of the journal area identifies the patch by its
+ *   CRC-32 and commits each target page once it is programmed. An
+ *   interrupted apply is resumed by calling delta_area_apply() with
+ *   the same arguments. The patch is decoded again from the start,
+ *   and committed pages are neither erased nor written, so each
+ *   target page holds either its new data or is rewritten.
+ */
+
+/**
+ * Applies a sequential patch from one flash area to another.
+ *
+ * @param[in] patch_id flash area holding the patch.
+ * @param[in] patch_offset offset of the patch in its area.
+ * @param[in] patch_size size of the patch.
+ * @param[in] from_id flash area holding the source data.
+ * @param[in] to_id flash area the target data is written to.
+ * @param[in] journal_id flash area whose first page is the journal.
+ *
+ * @return the size of the target data or a negative error code.
+ */
+int delta_area_apply(uint8_t patch_id, off_t patch_offset, size_t patch_size,
+		     uint8_t from_id, uint8_t to_id, uint8_t journal_id);
+
+/**
+ * Reads whether the journal records a completed apply.
+ *
+ * @param[in] journal_id flash area whose first page is the journal.
+ *
+ * @return the size of the target data of the completed apply, zero(0)
+ * if none completed or a negative error code.
+ */
+int delta_area_done(uint8_t journal_id);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/toolchain.h>
+#include <mbedtls/aes.h>
+#include <mbedtls/platform_util.h>
+#include "delta_crypt.h"
+
+LOG_MODULE_REGISTER(delta_crypt, LOG_LEVEL_DBG);
+
+#define BLOCK_SIZE 16
+
+BUILD_ASSERT(DELTA_NONCE_SIZE == BLOCK_SIZE,
+	     "The nonce is the initial AES counter block");
+
+/* Counter and the unused part of its key stream block. */
+static struct {
+	mbedtls_aes_context aes;
+	uint8_t counter[BLOCK_SIZE];
+	uint8_t stream[BLOCK_SIZE];
+	size_t used;
+} patch_crypt;
+
+/* A store that was never provisioned reads as erased flash. */
+static bool key_is_blank(const uint8_t *key)
+{
+	size_t i;
+
+	for (i = 0; i < DELTA_KEY_SIZE; i++) {
+		if (key[i] != 0xff) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void next_block(void)
+{
+	int i;
+
+	mbedtls_aes_crypt_ecb(&patch_crypt.aes, MBEDTLS_AES_ENCRYPT,
+			      patch_crypt.counter, patch_crypt.stream);
+	for (i = BLOCK_SIZE - 1; i >= 0; i--) {
+		if (++patch_crypt.counter[i] != 0) {
+			break;
+		}
+	}
+	patch_crypt.used = 0;
+}
+
+/*
+ *  PUBLIC FUNCTIONS
+ */
+
+__weak int delta_crypt_key(uint8_t *key)
+{
+	memcpy(key, (const void *)CONFIG_DELTA_ENCRYPTION_KEY_ADDRESS,
+	       DELTA_KEY_SIZE);
+	if (key_is_blank(key)) {
+		LOG_ERR("No patch decryption key provisioned");
+		return -DELTA_KEY_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+int delta_crypt_start_key(const uint8_t *key, const uint8_t *nonce)
+{
+	mbedtls_aes_free(&patch_crypt.aes);
+	mbedtls_aes_init(&patch_crypt.aes);
+	if (mbedtls_aes_setkey_enc(&patch_crypt.aes, key, DELTA_KEY_SIZE * 8)) {
+		return -DELTA_KEY_ERROR;
+	}
+	memcpy(patch_crypt.counter, nonce, sizeof(patch_crypt.counter));
+	patch_crypt.used = BLOCK_SIZE;
+
+	return DELTA_OK;
+}
+
+int delta_crypt_start(const uint8_t *nonce)
+{
+	uint8_t key[DELTA_KEY_SIZE];
+	int ret;
+
+	ret = delta_crypt_key(key);
+	if (!ret) {
+		ret = delta_crypt_start_key(key, nonce);
+	}
+	mbedtls_platform_zeroize(key, sizeof(key));
+
+	return ret;
+}
+
+int delta_crypt_start_patch(struct flash_mem *flash)
+{
+	uint8_t nonce[DELTA_NONCE_SIZE];
+
+	if (flash_read(flash->device, NONCE_OFFSET, nonce, sizeof(nonce))) {
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+
+	return delta_crypt_start(nonce);
+}
+
+void delta_crypt_apply(uint8_t *buf_p, size_t size)
+{
+	size_t len, i;
+
+	while (size > 0) {
+		if (patch_crypt.used == BLOCK_SIZE) {
+			next_block();
+		}
+		len = MIN(size, BLOCK_SIZE - patch_crypt.used);
+		for (i = 0; i < len; i++) {
+			buf_p[i] ^= patch_crypt.stream[patch_crypt.used + i];
+		}
+		patch_crypt.used += len;
+		buf_p += len;
+		size -= len;
+	}
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef DELTA_CRYPT_H
+#define DELTA_CRYPT_H
+
+#include "delta.h"
+
+/* AES-128 KEY SIZE */
+#define DELTA_KEY_SIZE 16
+
+/* ENCRYPTED PATCHES.
+ * - With CONFIG_DELTA_ENCRYPTION the patch is AES-128-CTR encrypted, and
+ *   the header is followed by the initial counter block, the nonce. The
+ *   counter is incremented as a 128-bit big-endian number per block.
+ * - Patch data is decrypted in place in the buffer it is read to, before
+ *   it is decoded, so it is stored and read once, encrypted.
+ * - The signature of signed patches covers the nonce and the encrypted
+ *   patch, so it is verified without the key.
+ */
+
+/**
+ * Reads the patch decryption key from the provisioning store. The
+ * default reads it from CONFIG_DELTA_ENCRYPTION_KEY_ADDRESS, and is
+ * weak so that boards keeping their keys elsewhere can replace it.
+ *
+ * @param[out] key the key, DELTA_KEY_SIZE bytes.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_crypt_key(uint8_t *key);
+
+/**
+ * Starts decrypting a patch from its start with the provisioned key.
+ *
+ * @param[in] nonce the nonce from the patch header, DELTA_NONCE_SIZE bytes.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_crypt_start(const uint8_t *nonce);
+
+/**
+ * Starts decrypting with the given key, like delta_crypt_start().
+ *
+ * @param[in] key the key, DELTA_KEY_SIZE bytes.
+ * @param[in] nonce the nonce, DELTA_NONCE_SIZE bytes.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_crypt_start_key(const uint8_t *key, const uint8_t *nonce);
+
+/**
+ * Starts decrypting the patch in the patch partition, with the nonce
+ * read from behind its header.
+ *
+ * @param[in] flash the devices flash memory.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_crypt_start_patch(struct flash_mem *flash);
+
+/**
+ * Decrypts the next part of the patch in place. Encrypts as well, as
+ * CTR mode only XORs the data with the key stream.
+ *
+ * @param[in,out] buf_p patch data.
+ * @param[in] size number of bytes.
+ */
+void delta_crypt_apply(uint8_t *buf_p, size_t size);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include "delta_pipeline.h"
+
+LOG_MODULE_DECLARE(delta, LOG_LEVEL_DBG);
+
+#define BUF_SIZE CONFIG_DELTA_PIPELINE_BUF_SIZE
+#define BUF_COUNT CONFIG_DELTA_PIPELINE_BUF_COUNT
+
+BUILD_ASSERT((PAGE_SIZE % BUF_SIZE) == 0,
+	     "Pipeline buffers must not straddle flash pages");
+
+/* RING OF BUFFERS BETWEEN THE DECODER AND THE WRITER.
+ * - "free" counts buffers the decoder may fill.
+ * - "full" counts buffers waiting to be programmed. A buffer with
+ *   length zero tells the writer to stop.
+ */
+struct pipeline {
+	uint8_t buf[BUF_COUNT][BUF_SIZE];
+	size_t len[BUF_COUNT];
+	off_t offset[BUF_COUNT];
+	struct k_sem free;
+	struct k_sem full;
+	int head;
+	int tail;
+	off_t erased_end;
+	atomic_t error;
+	uint32_t start;
+	uint32_t decode_wait;
+	uint32_t flash_busy;
+};
+
+static struct pipeline pipe DELTA_ARENA;
+static struct k_thread writer_thread;
+static K_THREAD_STACK_DEFINE(writer_stack, CONFIG_DELTA_PIPELINE_STACK_SIZE);
+
+/*
+ *  WRITER
+ */
+
+static int write_buffer(struct flash_mem *flash, int index)
+{
+	off_t offset;
+	size_t len;
+#ifndef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+	int ret;
+#endif
+
+	offset = pipe.offset[index];
+	len = pipe.len[index];
+
+#ifdef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+	/* pages are erased by the page buffer, if they changed */
+	return delta_flash_page_write(flash, offset, pipe.buf[index], len);
+#else
+	while (offset + (off_t) len > pipe.erased_end) {
+		ret = delta_flash_erase_page(flash, pipe.erased_end);
+		if (ret) {
+			return ret;
+		}
+		pipe.erased_end += PAGE_SIZE;
+	}
+
+	return delta_flash_program(flash, offset, pipe.buf[index], len);
+#endif
+}
+
+static void writer(void *p1, void *p2, void *p3)
+{
+	struct flash_mem *flash;
+	uint32_t begin;
+	int ret;
+
+	flash = (struct flash_mem *)p1;
+
+	while (1) {
+		k_sem_take(&pipe.full, K_FOREVER);
+
+		if (pipe.len[pipe.tail] == 0) {
+			break;
+		}
+
+		/* Keep draining after an error so the decoder never blocks. */
+		if (!atomic_get(&pipe.error)) {
+			begin = k_cycle_get_32();
+			ret = write_buffer(flash, pipe.tail);
+			pipe.flash_busy += k_cycle_get_32() - begin;
+			if (ret) {
+				atomic_set(&pipe.error, ret);
+			}
+		}
+
+		pipe.tail = (pipe.tail + 1) % BUF_COUNT;
+		k_sem_give(&pipe.free);
+	}
+}
+
+/*
+ *  DECODER SIDE
+ */
+
+static void submit(size_t len)
+{
+	uint32_t begin;
+
+	pipe.len[pipe.head] = len;
+	k_sem_give(&pipe.full);
+	pipe.head = (pipe.head + 1) % BUF_COUNT;
+
+	begin = k_cycle_get_32();
+	k_sem_take(&pipe.free, K_FOREVER);
+	pipe.decode_wait += k_cycle_get_32() - begin;
+	pipe.len[pipe.head] = 0;
+}
+
+int delta_pipeline_start(struct flash_mem *flash)
+{
+	k_sem_init(&pipe.full, 0, BUF_COUNT);
+	/* One buffer is always owned by the decoder. */
+	k_sem_init(&pipe.free, BUF_COUNT - 1, BUF_COUNT);
+
+	pipe.head = 0;
+	pipe.tail = 0;
+	pipe.len[0] = 0;
+	pipe.offset[0] = flash->to_current;
+	pipe.erased_end = flash->to_current - flash->to_current % PAGE_SIZE
+			  + PAGE_SIZE;
+	atomic_set(&pipe.error, DELTA_OK);
+	pipe.decode_wait = 0;
+	pipe.flash_busy = 0;
+	pipe.start = k_cycle_get_32();
+
+	k_thread_create(&writer_thread, writer_stack,
+			K_THREAD_STACK_SIZEOF(writer_stack),
+			writer, flash, NULL, NULL,
+			CONFIG_DELTA_PIPELINE_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(&writer_thread, "delta_writer");
+
+	return DELTA_OK;
+}
+
+int delta_pipeline_write(void *arg_p, const uint8_t *buf_p, size_t size)
+{
+	struct flash_mem *flash;
+	size_t len;
+	int ret;
+
+	flash = (struct flash_mem *)arg_p;
+
+	if (!flash) {
+		return -DELTA_CASTING_ERROR;
+	}
+	delta_stats_count(DELTA_IO_WRITE, size);
+
+	ret = (int)atomic_get(&pipe.error);
+	if (ret) {
+		return ret;
+	}
+
+	if (flash->to_current + (off_t) size >= flash->to_end) {
+		return -DELTA_SLOT1_OUT_OF_MEMORY;
+	}
+
+	while (size > 0) {
+		len = MIN(size, BUF_SIZE - pipe.len[pipe.head]);
+		memcpy(&pipe.buf[pipe.head][pipe.len[pipe.head]], buf_p, len);
+		pipe.len[pipe.head] += len;
+		flash->to_current += (off_t) len;
+		buf_p += len;
+		size -= len;
+
+		if (pipe.len[pipe.head] == BUF_SIZE) {
+			submit(BUF_SIZE);
+			pipe.offset[pipe.head] = flash->to_current;
+		}
+	}
+
+	return DELTA_OK;
+}
+
+int delta_pipeline_finish(struct flash_mem *flash)
+{
+	uint32_t elapsed, decode_busy, overlap, shorter;
+	uint32_t begin;
+
+	if (pipe.len[pipe.head] > 0) {
+		submit(pipe.len[pipe.head]);
+	}
+
+	/* Stop marker. */
+	pipe.len[pipe.head] = 0;
+	k_sem_give(&pipe.full);
+
+	begin = k_cycle_get_32();
+	k_thread_join(&writer_thread, K_FOREVER);
+	pipe.decode_wait += k_cycle_get_32() - begin;
+
+	elapsed = k_cycle_get_32() - pipe.start;
+	decode_busy = elapsed - pipe.decode_wait;
+	overlap = 0;
+	if (decode_busy + pipe.flash_busy > elapsed) {
+		overlap = decode_busy + pipe.flash_busy - elapsed;
+	}
+	shorter = MIN(decode_busy, pipe.flash_busy);
+
+	LOG_INF("Pipeline: %u ms total, decode %u ms, flash %u ms, "
+		"overlap %u ms (%u%% of shorter stage)",
+		k_cyc_to_ms_floor32(elapsed),
+		k_cyc_to_ms_floor32(decode_busy),
+		k_cyc_to_ms_floor32(pipe.flash_busy),
+		k_cyc_to_ms_floor32(overlap),
+		shorter ? (uint32_t)(((uint64_t)overlap * 100) / shorter) : 0);
+
+	return (int)atomic_get(&pipe.error);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef DELTA_PIPELINE_H
+#define DELTA_PIPELINE_H
+
+#include "delta.h"
+
+/* TWO-STAGE DECODE/PROGRAM PIPELINE.
+ * - The thread applying the patch decodes into a ring of buffers
+ *   through delta_pipeline_write().
+ * - A writer thread drains full buffers to flash, erasing pages
+ *   ahead of the data as needed.
+ */
+
+/**
+ * Start the writer thread. The first page of the target area
+ * must already be erased.
+ *
+ * @param[in] flash the devices flash memory.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_pipeline_start(struct flash_mem *flash);
+
+/**
+ * Write callback handing decoded data to the writer thread.
+ * Matches detools_write_t.
+ *
+ * @param[in] arg_p the devices flash memory.
+ * @param[in] buf_p buffer to write.
+ * @param[in] size number of bytes to write.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_pipeline_write(void *arg_p, const uint8_t *buf_p, size_t size);
+
+/**
+ * Flush the last partial buffer, wait for the writer thread to
+ * finish and log the achieved overlap between the stages.
+ *
+ * @param[in] flash the devices flash memory.
+ *
+ * @return zero(0) or the first error hit by the writer thread.
+ */
+int delta_pipeline_finish(struct flash_mem *flash);
+
+#endif
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/sys/crc.h>
+#include "delta_reverse.h"
+
+LOG_MODULE_REGISTER(delta_reverse, LOG_LEVEL_DBG);
+
+/* REVERSE PATCH FORMAT.
+ * - A detools sequential patch header with CRLE compression, the size
+ *   of the old image and an empty data format patch.
+ * - One diff record per REVERSE_RECORD_SIZE bytes of the part common
+ *   to both images, holding old minus new bytes, with no extra data
+ *   and no adjustment. Unchanged bytes diff to zero, which CRLE stores
+ *   as runs.
+ * - If the old image is larger, a last record holds the rest of it as
+ *   extra data.
+ */
+#define REVERSE_COMPRESSION_CRLE 2
+#define REVERSE_RECORD_SIZE 0x8000
+#define REVERSE_MIN_ZEROS 6
+#define REVERSE_PATCH_OFFSET (REVERSE_OFFSET + sizeof(struct delta_reverse_header))
+#define REVERSE_MAX_SIZE MIN(CONFIG_DELTA_REVERSE_MAX_SIZE, \
+			     REVERSE_SIZE - sizeof(struct delta_reverse_header))
+
+BUILD_ASSERT(REVERSE_SIZE >= PAGE_SIZE,
+	     "The reverse partition must hold at least one page");
+
+/* REVERSE PATCH CREATION STATE.
+ * - "Header" counts the bytes of the forward patch header parsed, and
+ *   "from size" is the new image size read from it.
+ * - "Offset" counts the bytes of the new image diffed so far.
+ * - "Size" counts the bytes of the reverse patch programmed, "out"
+ *   holds the next ones. Scattered CRLE bytes are kept in "pending"
+ *   and a run of zeros is counted in "zeros" until it ends.
+ */
+struct reverse {
+	struct flash_mem *flash;
+	bool parsed;
+	bool crle;
+	size_t header;
+	size_t from_size;
+	size_t to_size;
+	size_t common;
+	size_t offset;
+	uint32_t from_crc;
+	uint32_t to_crc;
+	off_t erased_end;
+	size_t size;
+	size_t out_size;
+	size_t pending_size;
+	size_t zeros;
+	uint8_t out[128];
+	uint8_t pending[64];
+	uint8_t old[64];
+};
+
+static struct reverse reverse DELTA_ARENA;
+static bool reverse_active;
+
+static void reverse_give_up(const char *reason)
+{
+	if (reverse_active) {
+		LOG_WRN("No reverse patch, rollback will swap slots: %s", reason);
+	}
+	reverse_active = false;
+}
+
+/*
+ *  OUTPUT
+ */
+
+static void reverse_flush_out(void)
+{
+	off_t offset;
+
+	if (!reverse_active || reverse.out_size == 0) {
+		return;
+	}
+	if (reverse.size + reverse.out_size > REVERSE_MAX_SIZE) {
+		reverse_give_up("too large");
+		return;
+	}
+
+	offset = REVERSE_PATCH_OFFSET + (off_t) reverse.size;
+	while (reverse.erased_end < offset + (off_t) reverse.out_size) {
+		if (delta_flash_erase_page(reverse.flash, reverse.erased_end)) {
+			reverse_give_up("erase failed");
+			return;
+		}
+		reverse.erased_end += PAGE_SIZE;
+	}
+	if (delta_flash_program(reverse.flash, offset, reverse.out,
+				reverse.out_size)) {
+		reverse_give_up("write failed");
+		return;
+	}
+
+	reverse.size += reverse.out_size;
+	reverse.out_size = 0;
+}
+
+static void reverse_out(uint8_t byte)
+{
+	if (!reverse_active) {
+		return;
+	}
+	reverse.out[reverse.out_size++] = byte;
+	if (reverse.out_size == sizeof(reverse.out)) {
+		reverse_flush_out();
+	}
+}
+
+static void reverse_out_usize(size_t value)
+{
+	uint8_t byte;
+
+	do {
+		byte = value & 0x7f;
+		value >>= 7;
+		if (value > 0) {
+			byte |= 0x80;
+		}
+		reverse_out(byte);
+	} while (value > 0);
+}
+
+/*
+ *  CRLE ENCODING
+ */
+
+static void reverse_flush_pending(void)
+{
+	size_t i;
+
+	if (reverse.pending_size == 0) {
+		return;
+	}
+
+	reverse_out(0);
+	reverse_out_usize(reverse.pending_size);
+	for (i = 0; i < reverse.pending_size; i++) {
+		reverse_out(reverse.pending[i]);
+	}
+	reverse.pending_size = 0;
+}
+
+static void reverse_put_scattered(uint8_t byte)
+{
+	reverse.pending[reverse.pending_size++] = byte;
+	if (reverse.pending_size == sizeof(reverse.pending)) {
+		reverse_flush_pending();
+	}
+}
+
+/* Runs of zeros shorter than a repeated record are kept scattered. */
+static void reverse_end_zeros(void)
+{
+	if (reverse.zeros >= REVERSE_MIN_ZEROS) {
+		reverse_flush_pending();
+		reverse_out(1);
+		reverse_out_usize(reverse.zeros);
+		reverse_out(0);
+	} else {
+		while (reverse.zeros > 0) {
+			reverse_put_scattered(0);
+			reverse.zeros--;
+		}
+	}
+	reverse.zeros = 0;
+}
+
+static void reverse_put(uint8_t byte)
+{
+	if (!reverse.crle) {
+		reverse_out(byte);
+	} else if (byte == 0) {
+		reverse.zeros++;
+	} else {
+		reverse_end_zeros();
+		reverse_put_scattered(byte);
+	}
+}
+
+static void reverse_put_size(size_t value)
+{
+	uint8_t byte;
+
+	byte = value & 0x3f;
+	value >>= 6;
+	if (value > 0) {
+		byte |= 0x80;
+	}
+	reverse_put(byte);
+
+	while (value > 0) {
+		byte = value & 0x7f;
+		value >>= 7;
+		if (value > 0) {
+			byte |= 0x80;
+		}
+		reverse_put(byte);
+	}
+}
+
+/*
+ *  OLD IMAGE
+ */
+
+/* Read old image bytes into the old buffer and add them to its CRC. */
+static int reverse_read_old(size_t offset, size_t size)
+{
+	if (flash_read(reverse.flash->device, PRIMARY_OFFSET + (off_t) offset,
+		       reverse.old, size)) {
+		reverse_give_up("read failed");
+		return -DELTA_READING_SOURCE_ERROR;
+	}
+	reverse.to_crc = crc32_ieee_update(reverse.to_crc, reverse.old, size);
+
+	return DELTA_OK;
+}
+
+/* Diff new bytes against the old image, record by record. */
+static void reverse_diff(const uint8_t *buf_p, size_t size)
+{
+	size_t len, i;
+
+	while (size > 0 && reverse.offset < reverse.common && reverse_active) {
+		if (reverse.offset % REVERSE_RECORD_SIZE == 0) {
+			reverse_put_size(MIN(REVERSE_RECORD_SIZE,
+					     reverse.common - reverse.offset));
+		}
+
+		len = MIN(size, sizeof(reverse.old));
+		len = MIN(len, reverse.common - reverse.offset);
+		len = MIN(len, REVERSE_RECORD_SIZE -
+			  reverse.offset % REVERSE_RECORD_SIZE);
+		if (reverse_read_old(reverse.offset, len)) {
+			return;
+		}
+		for (i = 0; i < len; i++) {
+			reverse_put((uint8_t)(reverse.old[i] - buf_p[i]));
+		}
+
+		reverse.offset += len;
+		buf_p += len;
+		size -= len;
+
+		/* no extra data and no adjustment */
+		if (reverse.offset % REVERSE_RECORD_SIZE == 0 ||
+		    reverse.offset == reverse.common) {
+			reverse_put_size(0);
+			reverse_put_size(0);
+		}
+	}
+}
+
+/* Add the part of the old image behind the new one as extra data. */
+static void reverse_extra(void)
+{
+	size_t offset, len, i;
+
+	if (reverse.to_size == reverse.common) {
+		return;
+	}
+
+	reverse_put_size(0);
+	reverse_put_size(reverse.to_size - reverse.common);
+	for (offset = reverse.common; offset < reverse.to_size && reverse_active;
+	     offset += len) {
+		len = MIN(sizeof(reverse.old), reverse.to_size - offset);
+		if (reverse_read_old(offset, len)) {
+			return;
+		}
+		for (i = 0; i < len; i++) {
+			reverse_put(reverse.old[i]);
+		}
+	}
+	reverse_put_size(0);
+}
+
+/*
+ *  PUBLIC FUNCTIONS
+ */
+
+void delta_reverse_begin(struct flash_mem *flash)
+{
+	struct delta_slot_info info;
+
+	reverse_active = false;
+	memset(&reverse, 0, sizeof(reverse));
+	reverse.flash = flash;
+
+	/* the previous reverse patch does not apply to the new image */
+	if (delta_flash_erase_page(flash, REVERSE_OFFSET)) {
+		LOG_WRN("Could not erase the reverse partition");
+		return;
+	}
+	reverse.erased_end = REVERSE_OFFSET + PAGE_SIZE;
+
+	if (delta_read_slot_info(flash, 0, &info) || !info.valid) {
+		LOG_INF("No image in slot 0, no reverse patch");
+		return;
+	}
+	reverse.to_size = info.size;
+	reverse_active = true;
+
+	reverse_out((DETOOLS_PATCH_TYPE_SEQUENTIAL << 4) | REVERSE_COMPRESSION_CRLE);
+	reverse_put_size(reverse.to_size);
+	reverse.crle = true;
+	reverse_put_size(0);
+}
+
+void delta_reverse_patch(const uint8_t *buf_p, size_t size)
+{
+	size_t i;
+
+	if (!reverse_active) {
+		return;
+	}
+
+	/* type and compression, then the new image size */
+	for (i = 0; i < size && !reverse.parsed; i++, reverse.header++) {
+		if (reverse.header == 0) {
+			if ((buf_p[i] >> 4) != DETOOLS_PATCH_TYPE_SEQUENTIAL) {
+				reverse_give_up("not a sequential patch");
+				return;
+			}
+		} else if (reverse.header == 1) {
+			if (buf_p[i] & 0x40) {
+				reverse_give_up("bad patch header");
+				return;
+			}
+			reverse.from_size = buf_p[i] & 0x3f;
+			reverse.parsed = !(buf_p[i] & 0x80);
+		} else if (reverse.header < 6) {
+			reverse.from_size |= (size_t)(buf_p[i] & 0x7f)
+					     << (6 + 7 * (reverse.header - 2));
+			reverse.parsed = !(buf_p[i] & 0x80);
+		} else {
+			reverse_give_up("bad patch header");
+			return;
+		}
+	}
+
+	if (reverse.parsed) {
+		reverse.common = MIN(reverse.from_size, reverse.to_size);
+	}
+}
+
+void delta_reverse_size(size_t size)
+{
+	if (!reverse_active) {
+		return;
+	}
+
+	reverse.from_size = size;
+	reverse.parsed = true;
+	reverse.common = MIN(reverse.from_size, reverse.to_size);
+}
+
+void delta_reverse_write(const uint8_t *buf_p, size_t size)
+{
+	if (!reverse_active) {
+		return;
+	}
+	if (!reverse.parsed) {
+		reverse_give_up("no patch header");
+		return;
+	}
+
+	reverse.from_crc = crc32_ieee_update(reverse.from_crc, buf_p, size);
+	reverse_diff(buf_p, size);
+}
+
+void delta_reverse_end(int result)
+{
+	struct delta_reverse_header header;
+
+	if (!reverse_active) {
+		return;
+	}
+	if (result < 0 || (size_t) result != reverse.from_size) {
+		reverse_give_up("apply failed");
+		return;
+	}
+
+	reverse_extra();
+	reverse_end_zeros();
+	reverse_flush_pending();
+	reverse_flush_out();
+	if (!reverse_active) {
+		return;
+	}
+
+	header.magic = DELTA_REVERSE_MAGIC;
+	header.size = (uint32_t) reverse.size;
+	header.from_size = (uint32_t) reverse.from_size;
+	header.from_crc = reverse.from_crc;
+	header.to_size = (uint32_t) reverse.to_size;
+	header.to_crc = reverse.to_crc;
+	if (delta_flash_program(reverse.flash, REVERSE_OFFSET,
+				(const uint8_t *) &header, sizeof(header))) {
+		reverse_give_up("write failed");
+		return;
+	}
+
+	LOG_INF("Reverse patch of %u bytes created", header.size);
+	reverse_active = false;
+}
+
+int delta_reverse_read_header(struct flash_mem *flash,
+			      struct delta_reverse_header *header)
+{
+	if (flash_read(flash->device, REVERSE_OFFSET, header, sizeof(*header))) {
+		return -DELTA_READING_PATCH_ERROR;
+	}
+
+	if (header->magic != DELTA_REVERSE_MAGIC ||
+	    header->size > REVERSE_SIZE - sizeof(*header) ||
+	    header->to_size > SECONDARY_SIZE - SLOT1_TRAILER_SIZE ||
+	    header->from_size > PRIMARY_SIZE) {
+		header->size = 0;
+	}
+
+	return DELTA_OK;
+}
+
+int delta_reverse_crc(struct flash_mem *flash, off_t offset, size_t size,
+		      uint32_t *crc)
+{
+	uint8_t buf[64];
+	size_t len;
+
+	*crc = 0;
+	while (size > 0) {
+		len = MIN(sizeof(buf), size);
+		if (flash_read(flash->device, offset, buf, len)) {
+			return -DELTA_READING_SOURCE_ERROR;
+		}
+		*crc = crc32_ieee_update(*crc, buf, len);
+		offset += (off_t) len;
+		size -= len;
+	}
+
+	return DELTA_OK;
+}
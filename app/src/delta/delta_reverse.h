@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef DELTA_REVERSE_H
+#define DELTA_REVERSE_H
+
+#include "delta.h"
+
+/* REVERSE PARTITION OFFSET AND SIZE */
+#define REVERSE_OFFSET FIXED_PARTITION_OFFSET(reverse_partition)
+#define REVERSE_SIZE FIXED_PARTITION_SIZE(reverse_partition)
+
+/* REVERSE PATCH HEADER MAGIC, ASCII FOR "REVP" */
+#define DELTA_REVERSE_MAGIC 0x50564552
+
+/* REVERSE PATCH, CREATED WHILE A SEQUENTIAL PATCH IS APPLIED AND STORED
+ * BEHIND THIS HEADER IN THE REVERSE PARTITION. It is a CRLE compressed
+ * sequential patch from the new image back to the image in slot 0 it
+ * replaces. The header is programmed last, so a reverse partition
+ * without a header holds an incomplete or abandoned reverse patch.
+ * - "From" is the new image, in slot 0 after the upgrade.
+ * - "To" is the replaced image, in slot 1 after the upgrade.
+ * - The CRCs are CRC-32 (IEEE) of the first "size" bytes of the images.
+ */
+struct delta_reverse_header {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t from_size;
+	uint32_t from_crc;
+	uint32_t to_size;
+	uint32_t to_crc;
+};
+
+/* REVERSE PATCH CREATION.
+ * - delta_reverse_begin() invalidates the previous reverse patch.
+ * - The patch read and write callbacks of the forward apply pass their
+ *   data to delta_reverse_patch() and delta_reverse_write(). The size
+ *   of the new image is taken from the forward patch header, unless
+ *   given by delta_reverse_size(), and each new chunk is diffed
+ *   against the old image at the same offset, so only small fixed
+ *   buffers are needed.
+ * - Creation is given up, and rollback falls back to the MCUboot swap,
+ *   if the reverse patch grows beyond CONFIG_DELTA_REVERSE_MAX_SIZE.
+ */
+
+/**
+ * Starts a reverse patch from the image about to be written to slot 1
+ * back to the image in slot 0.
+ *
+ * @param[in] flash the devices flash memory.
+ */
+void delta_reverse_begin(struct flash_mem *flash);
+
+/**
+ * Passes forward patch data, read from its start, to the reverse patch.
+ *
+ * @param[in] buf_p patch data.
+ * @param[in] size number of bytes.
+ */
+void delta_reverse_patch(const uint8_t *buf_p, size_t size);
+
+/**
+ * Sets the size of the new image, for forward patches whose header
+ * does not give it, such as the payload patch of an image patch.
+ * Called before any forward patch data is passed on.
+ *
+ * @param[in] size size of the new image.
+ */
+void delta_reverse_size(size_t size);
+
+/**
+ * Passes the next part of the new image to the reverse patch.
+ *
+ * @param[in] buf_p image data.
+ * @param[in] size number of bytes.
+ */
+void delta_reverse_write(const uint8_t *buf_p, size_t size);
+
+/**
+ * Completes the reverse patch and programs its header.
+ *
+ * @param[in] result result of the forward apply, the size of the new
+ * image or a negative error code.
+ */
+void delta_reverse_end(int result);
+
+/**
+ * Reads the header of the reverse patch.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[out] header the reverse patch header. The size is set to
+ * zero(0) if there is no complete reverse patch.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_reverse_read_header(struct flash_mem *flash,
+			      struct delta_reverse_header *header);
+
+/**
+ * Computes the CRC-32 of the start of a flash region.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[in] offset flash offset of the region.
+ * @param[in] size number of bytes.
+ * @param[out] crc the CRC-32.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_reverse_crc(struct flash_mem *flash, off_t offset, size_t size,
+		      uint32_t *crc);
+
+/**
+ * Restores the image replaced by the last update and reboots into it.
+ * - If slot 1 still holds the replaced image, its upgrade is requested.
+ * - Otherwise the reverse patch is applied from slot 0 to slot 1 first.
+ * - Without a reverse patch matching slot 0, the image in slot 1 is
+ *   swapped back if it is a valid MCUboot image.
+ *
+ * @param[in] flash the devices flash memory.
+ *
+ * @return a negative error code. Does not return on success.
+ */
+int delta_rollback(struct flash_mem *flash);
+
+#endif
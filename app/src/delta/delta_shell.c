@@ -0,0 +1,761 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+#include "delta.h"
+#ifdef CONFIG_DELTA_REVERSE
+#include "delta_reverse.h"
+#endif
+#ifdef CONFIG_DELTA_ENCRYPTION
+#include "delta_crypt.h"
+#endif
+
+static const struct device *shell_flash_device =
+	DEVICE_DT_GET_OR_NULL(DT_CHOSEN(zephyr_flash_controller));
+
+static struct flash_mem shell_flash;
+
+static int shell_flash_init(const struct shell *sh)
+{
+	shell_flash.device = shell_flash_device;
+
+	if (!shell_flash.device) {
+		shell_error(sh, "%s", delta_error_as_string(-DELTA_NO_FLASH_FOUND));
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+/*
+ *  STATUS
+ */
+
+/* Names of the compressions in the low nibble of the patch type byte. */
+static const char *const compression_names[16] = {
+	[0] = "none",
+	[1] = "lzma",
+	[2] = "crle",
+	[4] = "heatshrink",
+	[7] = "lz4",
+};
+
+#ifdef CONFIG_DELTA_BUNDLE
+static int bundle_status(const struct shell *sh,
+			 struct delta_patch_header *header)
+{
+	struct delta_bundle_entry entry;
+	uint32_t count, i;
+	off_t offset;
+
+	offset = STORAGE_OFFSET + HEADER_SIZE;
+	if (flash_read(shell_flash.device, offset, &count, sizeof(count))) {
+		shell_error(sh, "%s",
+			    delta_error_as_string(-DELTA_READING_PATCH_ERROR));
+		return -ENOEXEC;
+	}
+	shell_print(sh, "bundle:  %u bytes, %u patches", header->size, count);
+
+	offset += sizeof(count);
+	for (i = 0; i < MIN(count, CONFIG_DELTA_BUNDLE_MAX_ENTRIES); i++) {
+		if (flash_read(shell_flash.device, offset + i * sizeof(entry),
+			       &entry, sizeof(entry))) {
+			shell_error(sh, "%s", delta_error_as_string(
+					    -DELTA_READING_PATCH_ERROR));
+			return -ENOEXEC;
+		}
+		if (entry.image == DELTA_BUNDLE_NO_IMAGE) {
+			shell_print(sh, "  area %u -> %u: %u bytes, target %u bytes",
+				    entry.from_area, entry.to_area, entry.size,
+				    entry.to_size);
+		} else {
+			shell_print(sh, "  area %u -> %u: %u bytes, target %u bytes,"
+				    " image %u", entry.from_area, entry.to_area,
+				    entry.size, entry.to_size, entry.image);
+		}
+	}
+
+	return 0;
+}
+#endif
+
+static int spill_status(const struct shell *sh,
+			struct delta_patch_header *header)
+{
+	if (header->spill_size > 0) {
+		shell_print(sh, "spill:   %u bytes at slot1 + 0x%x",
+			    header->spill_size, header->spill_offset);
+	}
+
+	return 0;
+}
+
+static int cmd_status(const struct shell *sh, size_t argc, char **argv)
+{
+	struct delta_patch_header header;
+	const char *compression;
+	uint8_t byte;
+	int ret;
+
+	ret = shell_flash_init(sh);
+	if (ret) {
+		return ret;
+	}
+
+	shell_print(sh, "slot0:   0x%06x, %u bytes",
+		    (uint32_t)PRIMARY_OFFSET, (uint32_t)PRIMARY_SIZE);
+	shell_print(sh, "slot1:   0x%06x, %u bytes",
+		    (uint32_t)SECONDARY_OFFSET, (uint32_t)SECONDARY_SIZE);
+	shell_print(sh, "storage: 0x%06x, %u bytes",
+		    (uint32_t)STORAGE_OFFSET, (uint32_t)STORAGE_SIZE);
+
+	ret = delta_read_patch_header(&shell_flash, &header);
+	if (ret) {
+		shell_error(sh, "%s", delta_error_as_string(ret));
+		return -ENOEXEC;
+	}
+	if (header.size == 0) {
+		shell_print(sh, "patch:   none");
+		return 0;
+	}
+#ifdef CONFIG_DELTA_BUNDLE
+	if (header.magic == DELTA_NEW_BUNDLE_MAGIC) {
+		return bundle_status(sh, &header);
+	}
+#endif
+
+	/* the type of image patches is behind the image section */
+	if (header.magic == DELTA_NEW_IMAGE_MAGIC) {
+		shell_print(sh, "patch:   %u bytes, sequential, MCUboot image",
+			    header.size);
+		return spill_status(sh, &header);
+	}
+
+	if (flash_read(shell_flash.device, STORAGE_OFFSET + HEADER_SIZE,
+		       &byte, sizeof(byte))) {
+		shell_error(sh, "%s",
+			    delta_error_as_string(-DELTA_READING_PATCH_ERROR));
+		return -ENOEXEC;
+	}
+#ifdef CONFIG_DELTA_ENCRYPTION
+	ret = delta_crypt_start_patch(&shell_flash);
+	if (ret) {
+		shell_error(sh, "%s", delta_error_as_string(ret));
+		return -ENOEXEC;
+	}
+	delta_crypt_apply(&byte, sizeof(byte));
+#endif
+	compression = compression_names[byte & 0xf];
+	if (!compression) {
+		compression = "unknown";
+	}
+
+	shell_print(sh, "patch:   %u bytes, %s, %s", header.size,
+		    ((byte >> 4) & 0x7) == DETOOLS_PATCH_TYPE_IN_PLACE ?
+		    "in-place" : "sequential", compression);
+
+	return spill_status(sh, &header);
+}
+
+/* Sequential patches are based on slot 0 and in-place patches on
+ * slot 1, so the digests tell the server what it can build against.
+ */
+static int cmd_slots(const struct shell *sh, size_t argc, char **argv)
+{
+	struct delta_slot_info info;
+	char digest[2 * sizeof(info.digest) + 1];
+	int ret, slot;
+
+	ret = shell_flash_init(sh);
+	if (ret) {
+		return ret;
+	}
+
+	for (slot = 0; slot < 2; slot++) {
+		ret = delta_read_slot_info(&shell_flash, slot, &info);
+		if (ret) {
+			shell_error(sh, "%s", delta_error_as_string(ret));
+			return -ENOEXEC;
+		}
+		if (!info.valid) {
+			shell_print(sh, "slot%d: no image", slot);
+			continue;
+		}
+
+		shell_print(sh, "slot%d: %u.%u.%u+%u, %u bytes, base of %s patches",
+			    slot, info.major, info.minor, info.revision,
+			    info.build_num, info.size,
+			    slot == 0 ? "sequential" : "in-place");
+		if (info.has_digest) {
+			bin2hex(info.digest, sizeof(info.digest),
+				digest, sizeof(digest));
+			shell_print(sh, "  sha256: %s", digest);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *  APPLY
+ */
+
+#ifdef CONFIG_DELTA_DRY_RUN
+static int dry_run(const struct shell *sh)
+{
+	struct delta_dry_run_stats dry_stats;
+	char digest[2 * sizeof(dry_stats.digest) + 1];
+	int ret;
+
+	ret = delta_dry_run(&shell_flash, &dry_stats);
+	if (ret) {
+		shell_error(sh, "%s", delta_error_as_string(ret));
+		return -ENOEXEC;
+	}
+	if (dry_stats.patch_size == 0) {
+		shell_print(sh, "No new patch found");
+		return 0;
+	}
+
+	bin2hex(dry_stats.digest, sizeof(dry_stats.digest),
+		digest, sizeof(digest));
+
+	shell_print(sh, "patch:  %u bytes", dry_stats.patch_size);
+	shell_print(sh, "target: %u bytes", dry_stats.to_size);
+	shell_print(sh, "sha256: %s", digest);
+	shell_print(sh, "time:   %u us (%u us decoding, %u us reading)",
+		    dry_stats.total_us, dry_stats.total_us - dry_stats.read_us,
+		    dry_stats.read_us);
+
+	return 0;
+}
+#endif
+
+static int cmd_apply(const struct shell *sh, size_t argc, char **argv)
+{
+	int ret;
+
+	ret = shell_flash_init(sh);
+	if (ret) {
+		return ret;
+	}
+
+	if (argc > 1) {
+#ifdef CONFIG_DELTA_DRY_RUN
+		if (strcmp(argv[1], "--dry-run") == 0) {
+			return dry_run(sh);
+		}
+#endif
+		shell_error(sh, "Unknown option %s", argv[1]);
+		return -EINVAL;
+	}
+
+	/* does not return if a patch is applied */
+	ret = delta_check_and_apply(&shell_flash);
+	if (ret) {
+		shell_error(sh, "%s", delta_error_as_string(ret));
+		return -ENOEXEC;
+	}
+	shell_print(sh, "No new patch found");
+
+	return 0;
+}
+
+#ifdef CONFIG_DELTA_REVERSE
+static int cmd_rollback(const struct shell *sh, size_t argc, char **argv)
+{
+	struct delta_reverse_header reverse;
+	int ret;
+
+	ret = shell_flash_init(sh);
+	if (ret) {
+		return ret;
+	}
+
+	ret = delta_reverse_read_header(&shell_flash, &reverse);
+	if (ret) {
+		shell_error(sh, "%s", delta_error_as_string(ret));
+		return -ENOEXEC;
+	}
+	if (reverse.size > 0) {
+		shell_print(sh, "reverse patch: %u bytes, to a %u byte image",
+			    reverse.size, reverse.to_size);
+	} else {
+		shell_print(sh, "No reverse patch, swapping back slot 1");
+	}
+
+	/* does not return if the previous image is restored */
+	ret = delta_rollback(&shell_flash);
+	shell_error(sh, "%s", delta_error_as_string(ret));
+
+	return -ENOEXEC;
+}
+#endif
+
+/*
+ *  STATS
+ */
+
+static uint32_t percent(uint32_t part, uint32_t whole)
+{
+	if (whole == 0) {
+		return 0;
+	}
+
+	return (uint32_t)((100ULL * part) / whole);
+}
+
+static const char *const io_names[DELTA_IO_COUNT] = {
+	[DELTA_IO_PATCH_READ] = "patch read",
+	[DELTA_IO_FROM_READ] = "source read",
+	[DELTA_IO_WRITE] = "write",
+	[DELTA_IO_SEEK] = "seek",
+	[DELTA_IO_ERASE] = "erase",
+};
+
+static void print_hist(const struct shell *sh, const struct delta_io_stats *io)
+{
+	int i;
+
+	for (i = 0; i < DELTA_IO_HIST_SIZE; i++) {
+		if (io->hist[i] == 0) {
+			continue;
+		}
+		shell_print(sh, "  %s%6u: %u", i == DELTA_IO_HIST_SIZE - 1 ? ">=" : "  ",
+			    1U << i, io->hist[i]);
+	}
+}
+
+static int cmd_stats(const struct shell *sh, size_t argc, char **argv)
+{
+	struct delta_stats stats;
+	bool hist;
+	int i;
+
+	hist = false;
+	if (argc > 1) {
+		if (strcmp(argv[1], "reset") == 0) {
+			delta_stats_reset();
+			return 0;
+		} else if (strcmp(argv[1], "hist") == 0) {
+			hist = true;
+		} else {
+			shell_error(sh, "Unknown option %s", argv[1]);
+			return -EINVAL;
+		}
+	}
+
+	delta_stats_get(&stats);
+
+	shell_print(sh, "applies:      %u", stats.applies);
+	shell_print(sh, "last apply:   %u cycles, %u us", stats.apply_cycles,
+		    k_cyc_to_us_floor32(stats.apply_cycles));
+	shell_print(sh, "flash reads:  %u cycles, %u us", stats.read_cycles,
+		    k_cyc_to_us_floor32(stats.read_cycles));
+	shell_print(sh, "flash writes: %u cycles, %u us", stats.flash_cycles,
+		    k_cyc_to_us_floor32(stats.flash_cycles));
+#ifdef CONFIG_DELTA_ENCRYPTION
+	shell_print(sh, "decrypt:      %u cycles, %u us", stats.decrypt_cycles,
+		    k_cyc_to_us_floor32(stats.decrypt_cycles));
+#endif
+	shell_print(sh, "skipped:      %u bytes (%u%% of writes, already erased)",
+		    stats.skipped,
+		    percent(stats.skipped, stats.io[DELTA_IO_WRITE].bytes));
+#ifdef CONFIG_DELTA_SKIP_UNCHANGED_PAGES
+	shell_print(sh, "unchanged:    %u pages (neither erased nor programmed)",
+		    stats.unchanged_pages);
+#endif
+
+	for (i = 0; i < DELTA_IO_COUNT; i++) {
+		shell_print(sh, "%-12s  %u calls, %u bytes", io_names[i],
+			    stats.io[i].calls, stats.io[i].bytes);
+		if (hist) {
+			print_hist(sh, &stats.io[i]);
+		}
+	}
+
+	return 0;
+}
+
+static void print_wear(const struct shell *sh, const char *name,
+		       const uint32_t *counts, size_t pages)
+{
+	uint32_t total, max;
+	size_t i;
+
+	total = 0;
+	max = 0;
+	for (i = 0; i < pages; i++) {
+		total += counts[i];
+		max = MAX(max, counts[i]);
+	}
+	shell_print(sh, "%s: %u erases, at most %u of a page", name, total, max);
+
+	for (i = 0; i < pages; i++) {
+		if (counts[i] > 0) {
+			shell_print(sh, "  page %3u: %u", (uint32_t)i, counts[i]);
+		}
+	}
+}
+
+static int cmd_wear(const struct shell *sh, size_t argc, char **argv)
+{
+	static struct delta_wear wear;
+	int ret;
+
+	ret = shell_flash_init(sh);
+	if (ret) {
+		return ret;
+	}
+
+	ret = delta_wear_get(&shell_flash, &wear);
+	if (ret) {
+		shell_error(sh, "%s", delta_error_as_string(ret));
+		return -ENOEXEC;
+	}
+
+	print_wear(sh, "slot1", wear.slot1, ARRAY_SIZE(wear.slot1));
+	print_wear(sh, "storage", wear.storage, ARRAY_SIZE(wear.storage));
+
+	return 0;
+}
+
+/*
+ *  BENCH
+ */
+
+/* The built-in vector is a source image and a target image with a few
+ * bytes changed in every record, like code that only moved. Patches
+ * are created in RAM for the compressions that are cheap to encode,
+ * and applied from RAM, so only decoding is timed. With
+ * CONFIG_DELTA_ENCRYPTION each patch is also applied encrypted with a
+ * fixed bench key, so the difference is the decryption cost.
+ */
+#define BENCH_SIZE CONFIG_DELTA_SHELL_BENCH_SIZE
+#define BENCH_RECORD_SIZE 256
+#define BENCH_RECORDS (BENCH_SIZE / BENCH_RECORD_SIZE)
+#define BENCH_PATCH_SIZE (BENCH_SIZE + 8 * BENCH_RECORDS + 16)
+
+BUILD_ASSERT(BENCH_SIZE % BENCH_RECORD_SIZE == 0,
+	     "The bench size must be a multiple of the record size");
+
+#define BENCH_COMPRESSION_NONE 0
+#define BENCH_COMPRESSION_CRLE 2
+
+struct bench {
+	uint8_t from[BENCH_SIZE];
+	uint8_t to[BENCH_SIZE];
+	uint8_t patch[BENCH_PATCH_SIZE];
+	size_t patch_size;
+	size_t from_offset;
+	size_t to_offset;
+	size_t patch_offset;
+	int compression;
+	bool encrypted;
+	uint8_t pending[16];
+	size_t pending_size;
+};
+
+static struct bench bench;
+
+static void bench_put_usize(size_t value)
+{
+	uint8_t byte;
+
+	do {
+		byte = value & 0x7f;
+		value >>= 7;
+		if (value > 0) {
+			byte |= 0x80;
+		}
+		bench.patch[bench.patch_size++] = byte;
+	} while (value > 0);
+}
+
+/* CRLE keeps scattered bytes until a run of zeros ends them. */
+static void bench_flush(void)
+{
+	if (bench.pending_size == 0) {
+		return;
+	}
+
+	bench.patch[bench.patch_size++] = 0;
+	bench_put_usize(bench.pending_size);
+	memcpy(&bench.patch[bench.patch_size], bench.pending, bench.pending_size);
+	bench.patch_size += bench.pending_size;
+	bench.pending_size = 0;
+}
+
+static void bench_put(uint8_t byte)
+{
+	if (bench.compression == BENCH_COMPRESSION_CRLE) {
+		bench.pending[bench.pending_size++] = byte;
+	} else {
+		bench.patch[bench.patch_size++] = byte;
+	}
+}
+
+static void bench_put_zeros(size_t size)
+{
+	if (bench.compression == BENCH_COMPRESSION_CRLE) {
+		bench_flush();
+		bench.patch[bench.patch_size++] = 1;
+		bench_put_usize(size);
+		bench.patch[bench.patch_size++] = 0;
+	} else {
+		memset(&bench.patch[bench.patch_size], 0, size);
+		bench.patch_size += size;
+	}
+}
+
+static void bench_put_size(int value)
+{
+	uint8_t byte;
+
+	byte = value & 0x3f;
+	value >>= 6;
+	if (value > 0) {
+		byte |= 0x80;
+	}
+	bench_put(byte);
+
+	while (value > 0) {
+		byte = value & 0x7f;
+		value >>= 7;
+		if (value > 0) {
+			byte |= 0x80;
+		}
+		bench_put(byte);
+	}
+}
+
+static void bench_create_images(void)
+{
+	uint32_t seed;
+	size_t i;
+
+	seed = 1;
+	for (i = 0; i < BENCH_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		bench.from[i] = (uint8_t)(seed >> 16);
+		bench.to[i] = bench.from[i];
+		if (i % BENCH_RECORD_SIZE < 4) {
+			bench.to[i] ^= 0x5a;
+		}
+	}
+}
+
+/* One record per BENCH_RECORD_SIZE bytes, with diff data only. The
+ * header is written as is, and the rest is stored as is or CRLE
+ * encoded.
+ */
+static void bench_create_patch(int compression)
+{
+	size_t record, i, base;
+
+	bench.patch_size = 0;
+	bench.pending_size = 0;
+	bench.compression = BENCH_COMPRESSION_NONE;
+	bench_put(compression);
+	bench_put_size(BENCH_SIZE);
+	bench.compression = compression;
+
+	bench_put_size(0);
+
+	for (record = 0; record < BENCH_RECORDS; record++) {
+		base = record * BENCH_RECORD_SIZE;
+		bench_put_size(BENCH_RECORD_SIZE);
+		for (i = 0; i < 4; i++) {
+			bench_put(bench.to[base + i] - bench.from[base + i]);
+		}
+		bench_put_zeros(BENCH_RECORD_SIZE - 4);
+		bench_put_size(0);
+		bench_put_size(0);
+	}
+
+	bench_flush();
+}
+
+static int bench_from_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+	if (bench.from_offset + size > BENCH_SIZE) {
+		return -DELTA_READING_SOURCE_ERROR;
+	}
+	memcpy(buf_p, &bench.from[bench.from_offset], size);
+	bench.from_offset += size;
+
+	return DELTA_OK;
+}
+
+static int bench_seek(void *arg_p, int offset)
+{
+	bench.from_offset += offset;
+
+	return DELTA_OK;
+}
+
+static int bench_patch_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+	if (bench.patch_offset + size > bench.patch_size) {
+		return -DELTA_READING_PATCH_ERROR;
+	}
+	memcpy(buf_p, &bench.patch[bench.patch_offset], size);
+	bench.patch_offset += size;
+#ifdef CONFIG_DELTA_ENCRYPTION
+	if (bench.encrypted) {
+		delta_crypt_apply(buf_p, size);
+	}
+#endif
+
+	return DELTA_OK;
+}
+
+static int bench_to_write(void *arg_p, const uint8_t *buf_p, size_t size)
+{
+	if (bench.to_offset + size > BENCH_SIZE ||
+		memcmp(buf_p, &bench.to[bench.to_offset], size) != 0) {
+		return -DELTA_WRITING_ERROR;
+	}
+	bench.to_offset += size;
+
+	return DELTA_OK;
+}
+
+#ifdef CONFIG_DELTA_ENCRYPTION
+static const uint8_t bench_key[DELTA_KEY_SIZE] = {
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+	0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+};
+
+static const uint8_t bench_nonce[DELTA_NONCE_SIZE] = {
+	0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+	0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+#endif
+
+static int bench_run(const struct shell *sh, const char *name,
+		     int compression, bool encrypted, int runs)
+{
+	uint32_t begin, cycles, best;
+	int i, ret;
+
+	bench_create_patch(compression);
+	bench.encrypted = encrypted;
+#ifdef CONFIG_DELTA_ENCRYPTION
+	if (encrypted) {
+		delta_crypt_start_key(bench_key, bench_nonce);
+		delta_crypt_apply(bench.patch, bench.patch_size);
+	}
+#endif
+	best = UINT32_MAX;
+
+	for (i = 0; i < runs; i++) {
+		bench.from_offset = 0;
+		bench.to_offset = 0;
+		bench.patch_offset = 0;
+
+		begin = k_cycle_get_32();
+#ifdef CONFIG_DELTA_ENCRYPTION
+		if (encrypted) {
+			delta_crypt_start_key(bench_key, bench_nonce);
+		}
+#endif
+		ret = detools_apply_patch_callbacks(bench_from_read,
+						    bench_seek,
+						    bench_patch_read,
+						    bench.patch_size,
+						    bench_to_write,
+						    NULL);
+		cycles = k_cycle_get_32() - begin;
+
+		if (ret != BENCH_SIZE) {
+			shell_error(sh, "%s: %s", name, delta_error_as_string(ret));
+			return -ENOEXEC;
+		}
+		best = MIN(best, cycles);
+	}
+
+	shell_print(sh, "%-10s %6u bytes %8u us %6u KiB/s", name,
+		    (uint32_t)bench.patch_size, k_cyc_to_us_floor32(best),
+		    (uint32_t)(((uint64_t)BENCH_SIZE * 1000000 / 1024)
+			       / MAX(k_cyc_to_us_floor32(best), 1)));
+
+	return 0;
+}
+
+static int cmd_bench(const struct shell *sh, size_t argc, char **argv)
+{
+	int runs, ret;
+
+	runs = 10;
+	if (argc > 1) {
+		runs = (int)strtol(argv[1], NULL, 0);
+		if (runs <= 0) {
+			shell_error(sh, "Bad number of runs %s", argv[1]);
+			return -EINVAL;
+		}
+	}
+
+	bench_create_images();
+	shell_print(sh, "%u byte target, best of %d runs",
+		    (uint32_t)BENCH_SIZE, runs);
+
+	ret = 0;
+#if DETOOLS_CONFIG_COMPRESSION_NONE == 1
+	ret = bench_run(sh, "none", BENCH_COMPRESSION_NONE, false, runs);
+#ifdef CONFIG_DELTA_ENCRYPTION
+	if (!ret) {
+		ret = bench_run(sh, "none+aes", BENCH_COMPRESSION_NONE, true, runs);
+	}
+#endif
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_CRLE == 1
+	if (!ret) {
+		ret = bench_run(sh, "crle", BENCH_COMPRESSION_CRLE, false, runs);
+	}
+#ifdef CONFIG_DELTA_ENCRYPTION
+	if (!ret) {
+		ret = bench_run(sh, "crle+aes", BENCH_COMPRESSION_CRLE, true, runs);
+	}
+#endif
+#endif
+
+	return ret;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(delta_cmds,
+	SHELL_CMD(status, NULL, "Show the partitions and the patch header",
+		  cmd_status),
+	SHELL_CMD(slots, NULL, "Show the version and digest of both slots",
+		  cmd_slots),
+#ifdef CONFIG_DELTA_DRY_RUN
+	SHELL_CMD_ARG(apply, NULL,
+		      "Apply the patch and reboot, or with --dry-run decode it "
+		      "and hash the target without writing flash",
+		      cmd_apply, 1, 1),
+#else
+	SHELL_CMD_ARG(apply, NULL, "Apply the patch and reboot",
+		      cmd_apply, 1, 1),
+#endif
+#ifdef CONFIG_DELTA_REVERSE
+	SHELL_CMD(rollback, NULL,
+		  "Restore the previous image from the reverse patch and reboot",
+		  cmd_rollback),
+#endif
+	SHELL_CMD_ARG(stats, NULL,
+		      "Show flash and apply statistics [hist|reset]",
+		      cmd_stats, 1, 1),
+	SHELL_CMD(wear, NULL, "Show the erase counters of each page",
+		  cmd_wear),
+	SHELL_CMD_ARG(bench, NULL,
+		      "Time decoding of a built-in patch [runs]",
+		      cmd_bench, 1, 1),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(delta, &delta_cmds, "Delta update commands", NULL);
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <mbedtls/sha256.h>
+#include <mbedtls/ecdsa.h>
+#include "delta_signature.h"
+
+LOG_MODULE_REGISTER(delta_signature, LOG_LEVEL_DBG);
+
+/* PUBLIC KEY, AN UNCOMPRESSED P-256 POINT: 0x04, X AND Y */
+static const uint8_t signature_key[] = {
+#include "delta_key.inc"
+};
+
+BUILD_ASSERT(sizeof(signature_key) == 65,
+	     "The patch signing key must be an uncompressed P-256 point");
+
+/* Hash of a patch read once, verified at the end. */
+static struct {
+	mbedtls_sha256_context sha;
+	uint8_t signature[DELTA_SIGNATURE_SIZE];
+	bool pending;
+} stream_hash;
+
+static uint8_t signature_buf[256] DELTA_ARENA;
+
+static void hash_start(mbedtls_sha256_context *sha,
+		       struct delta_patch_header *header)
+{
+	mbedtls_sha256_init(sha);
+	mbedtls_sha256_starts(sha, 0);
+	mbedtls_sha256_update(sha, (const uint8_t *)&header->magic,
+			      sizeof(header->magic));
+	mbedtls_sha256_update(sha, (const uint8_t *)&header->size,
+			      sizeof(header->size));
+}
+
+static int hash_flash(struct flash_mem *flash, mbedtls_sha256_context *sha,
+		      off_t offset, size_t size)
+{
+	size_t len;
+
+	while (size > 0) {
+		len = MIN(sizeof(signature_buf), size);
+		if (flash_read(flash->device, offset, signature_buf, len)) {
+			return -DELTA_READING_PATCH_ERROR;
+		}
+		if (mbedtls_sha256_update(sha, signature_buf, len)) {
+			return -DELTA_SIGNATURE_ERROR;
+		}
+		offset += (off_t) len;
+		size -= len;
+	}
+
+	return DELTA_OK;
+}
+
+/* Finish the hash and verify the signature of it. */
+static int verify(mbedtls_sha256_context *sha, const uint8_t *signature)
+{
+	mbedtls_ecp_group group;
+	mbedtls_ecp_point key;
+	mbedtls_mpi r, s;
+	uint8_t digest[32];
+	int ret;
+
+	ret = mbedtls_sha256_finish(sha, digest);
+	mbedtls_sha256_free(sha);
+	if (ret) {
+		return -DELTA_SIGNATURE_ERROR;
+	}
+
+	mbedtls_ecp_group_init(&group);
+	mbedtls_ecp_point_init(&key);
+	mbedtls_mpi_init(&r);
+	mbedtls_mpi_init(&s);
+
+	ret = mbedtls_ecp_group_load(&group, MBEDTLS_ECP_DP_SECP256R1);
+	if (!ret) {
+		ret = mbedtls_ecp_point_read_binary(&group, &key, signature_key,
+						    sizeof(signature_key));
+	}
+	if (!ret) {
+		ret = mbedtls_mpi_read_binary(&r, signature, DELTA_SIGNATURE_SIZE / 2);
+	}
+	if (!ret) {
+		ret = mbedtls_mpi_read_binary(&s, signature + DELTA_SIGNATURE_SIZE / 2,
+					      DELTA_SIGNATURE_SIZE / 2);
+	}
+	if (!ret) {
+		ret = mbedtls_ecdsa_verify(&group, digest, sizeof(digest),
+					   &key, &r, &s);
+	}
+
+	mbedtls_mpi_free(&s);
+	mbedtls_mpi_free(&r);
+	mbedtls_ecp_point_free(&key);
+	mbedtls_ecp_group_free(&group);
+
+	if (ret) {
+		LOG_ERR("Invalid patch signature");
+		return -DELTA_SIGNATURE_ERROR;
+	}
+
+	return DELTA_OK;
+}
+
+/*
+ *  PUBLIC FUNCTIONS
+ */
+
+int delta_signature_check(struct flash_mem *flash,
+			  struct delta_patch_header *header)
+{
+	mbedtls_sha256_context sha;
+	uint8_t signature[DELTA_SIGNATURE_SIZE];
+	int ret;
+
+	if (flash_read(flash->device, STORAGE_OFFSET + sizeof(*header),
+		       signature, sizeof(signature))) {
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+
+	/* the nonce of encrypted patches is signed with the patch */
+	hash_start(&sha, header);
+	ret = hash_flash(flash, &sha,
+			 STORAGE_OFFSET + HEADER_SIZE - HEADER_NONCE_SIZE,
+			 HEADER_NONCE_SIZE + header->size - header->spill_size);
+	if (!ret && header->spill_size > 0) {
+		ret = hash_flash(flash, &sha,
+				 SECONDARY_OFFSET + header->spill_offset,
+				 header->spill_size);
+	}
+	if (ret) {
+		mbedtls_sha256_free(&sha);
+		return ret;
+	}
+
+	return verify(&sha, signature);
+}
+
+void delta_signature_start(struct delta_patch_header *header,
+			   const uint8_t *signature)
+{
+	hash_start(&stream_hash.sha, header);
+	memcpy(stream_hash.signature, signature, sizeof(stream_hash.signature));
+	stream_hash.pending = true;
+}
+
+void delta_signature_update(const uint8_t *buf_p, size_t size)
+{
+	if (stream_hash.pending) {
+		mbedtls_sha256_update(&stream_hash.sha, buf_p, size);
+	}
+}
+
+int delta_signature_finish(void)
+{
+	if (!stream_hash.pending) {
+		return DELTA_OK;
+	}
+	stream_hash.pending = false;
+
+	return verify(&stream_hash.sha, stream_hash.signature);
+}
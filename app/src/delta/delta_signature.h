@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef DELTA_SIGNATURE_H
+#define DELTA_SIGNATURE_H
+
+#include "delta.h"
+
+/* PATCH SIGNATURES.
+ * - With CONFIG_DELTA_SIGNATURE the patch header is followed by an
+ *   ECDSA P-256 signature, r and s as 32-byte big-endian numbers, of
+ *   the SHA-256 of the header magic, the patch size and the patch,
+ *   with the nonce and encrypted data of encrypted patches. The spill
+ *   fields are not signed, as the stream has no spill.
+ * - The public key is built in from CONFIG_DELTA_SIGNATURE_KEY_FILE.
+ */
+
+/**
+ * Verifies the signature of the patch in the patch partition and its
+ * spill in one read pass, before anything is erased.
+ *
+ * @param[in] flash the devices flash memory.
+ * @param[in] header the patch header.
+ *
+ * @return zero(0) or a negative error code.
+ */
+int delta_signature_check(struct flash_mem *flash,
+			  struct delta_patch_header *header);
+
+/**
+ * Starts hashing a patch that is read only once, such as a stream.
+ * The hash is verified by delta_signature_finish().
+ *
+ * @param[in] header the patch header.
+ * @param[in] signature the signature following the header.
+ */
+void delta_signature_start(struct delta_patch_header *header,
+			   const uint8_t *signature);
+
+/**
+ * Adds patch data to the hash started by delta_signature_start().
+ *
+ * @param[in] buf_p patch data.
+ * @param[in] size number of bytes.
+ */
+void delta_signature_update(const uint8_t *buf_p, size_t size);
+
+/**
+ * Verifies the hash started by delta_signature_start(). Called before
+ * the upgrade is requested.
+ *
+ * @return zero(0) if no hash was started or the signature is valid, or
+ * a negative error code.
+ */
+int delta_signature_finish(void);
+
+#endif
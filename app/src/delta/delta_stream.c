@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/sys/ring_buf.h>
+#include "delta_stream.h"
+#ifdef CONFIG_DELTA_SIGNATURE
+#include "delta_signature.h"
+#endif
+#ifdef CONFIG_DELTA_ENCRYPTION
+#include "delta_crypt.h"
+#endif
+
+LOG_MODULE_DECLARE(delta, LOG_LEVEL_DBG);
+
+#define CREDIT_SIZE CONFIG_DELTA_STREAM_CREDIT_SIZE
+#define RX_BUF_SIZE CONFIG_DELTA_STREAM_RX_BUF_SIZE
+
+BUILD_ASSERT(RX_BUF_SIZE >= CREDIT_SIZE,
+	     "The receive buffer must hold at least one credit");
+
+static const struct device *stream_device =
+	DEVICE_DT_GET_OR_NULL(DT_CHOSEN(delta_uart));
+
+RING_BUF_DECLARE(rx_ring, RX_BUF_SIZE);
+static K_SEM_DEFINE(rx_sem, 0, 1);
+static bool rx_overflow;
+static size_t rx_consumed;
+
+/*
+ *  RECEIVE
+ */
+
+static void stream_isr(const struct device *dev, void *user_data)
+{
+	uint8_t buf[32];
+	int len;
+
+	while (uart_irq_update(dev) && uart_irq_rx_ready(dev)) {
+		len = uart_fifo_read(dev, buf, sizeof(buf));
+		if (len <= 0) {
+			break;
+		}
+		/* The host sent more than it had credits for. */
+		if (ring_buf_put(&rx_ring, buf, len) < (uint32_t)len) {
+			rx_overflow = true;
+		}
+		k_sem_give(&rx_sem);
+	}
+}
+
+static void grant_credits(size_t count)
+{
+	while (count--) {
+		uart_poll_out(stream_device, DELTA_STREAM_CREDIT);
+	}
+}
+
+/* Blocking read from the receive buffer. Matches detools_read_t. */
+static int delta_stream_read(void *arg_p,
+					uint8_t *buf_p,
+					size_t size)
+{
+	uint32_t len;
+
+	if (size <= 0) {
+		return -DELTA_INVALID_BUF_SIZE;
+	}
+	delta_stats_count(DELTA_IO_PATCH_READ, size);
+
+	while (size > 0) {
+		if (rx_overflow) {
+			return -DELTA_STREAM_OVERFLOW;
+		}
+
+		len = ring_buf_get(&rx_ring, buf_p, size);
+		if (len == 0) {
+			if (k_sem_take(&rx_sem,
+				       K_MSEC(CONFIG_DELTA_STREAM_TIMEOUT_MS))) {
+				return -DELTA_STREAM_TIMEOUT;
+			}
+			continue;
+		}
+
+		buf_p += len;
+		size -= len;
+
+		/* Backpressure: only free space the patcher has consumed. */
+		rx_consumed += len;
+		grant_credits(rx_consumed / CREDIT_SIZE);
+		rx_consumed %= CREDIT_SIZE;
+	}
+
+	return DELTA_OK;
+}
+
+#ifdef CONFIG_DELTA_SIGNATURE
+/* Hash the patch as it arrives, verified once it is applied. */
+static int delta_stream_signed_read(void *arg_p,
+					uint8_t *buf_p,
+					size_t size)
+{
+	int ret;
+
+	ret = delta_stream_read(arg_p, buf_p, size);
+	if (ret == DELTA_OK) {
+		delta_signature_update(buf_p, size);
+	}
+
+	return ret;
+}
+
+#define STREAM_PATCH_READ delta_stream_signed_read
+#else
+#define STREAM_PATCH_READ delta_stream_read
+#endif
+
+static void stream_stop(int ret)
+{
+	if (ret < 0) {
+		uart_poll_out(stream_device, DELTA_STREAM_ABORT);
+	}
+	uart_irq_rx_disable(stream_device);
+}
+
+/*
+ *  PUBLIC FUNCTIONS
+ */
+
+int delta_stream_check_and_apply(struct flash_mem *flash)
+{
+	struct delta_patch_header header;
+#ifdef CONFIG_DELTA_SIGNATURE
+	uint8_t signature[DELTA_SIGNATURE_SIZE];
+#endif
+#ifdef CONFIG_DELTA_ENCRYPTION
+	uint8_t nonce[DELTA_NONCE_SIZE];
+#endif
+	int ret;
+
+	if (!stream_device || !device_is_ready(stream_device)) {
+		return -DELTA_STREAM_NO_DEVICE;
+	}
+
+	ring_buf_reset(&rx_ring);
+	k_sem_reset(&rx_sem);
+	rx_overflow = false;
+	rx_consumed = 0;
+
+	uart_irq_callback_user_data_set(stream_device, stream_isr, NULL);
+	uart_irq_rx_enable(stream_device);
+	grant_credits(RX_BUF_SIZE / CREDIT_SIZE);
+
+	ret = delta_stream_read(flash, (uint8_t *)&header, sizeof(header));
+	if (ret == -DELTA_STREAM_TIMEOUT) {
+		LOG_INF("No patch stream");
+		stream_stop(DELTA_OK);
+		return DELTA_OK;
+	} else if (ret) {
+		stream_stop(ret);
+		return ret;
+	}
+
+	/* Everything arrives over the stream, there is no spill. */
+	if ((header.magic != DELTA_NEW_PATCH_MAGIC &&
+	     (!IS_ENABLED(CONFIG_DELTA_IMAGE_PATCH) ||
+	      header.magic != DELTA_NEW_IMAGE_MAGIC)) || header.size == 0 ||
+	    header.spill_size != 0) {
+		stream_stop(-DELTA_PATCH_HEADER_ERROR);
+		return -DELTA_PATCH_HEADER_ERROR;
+	}
+
+#ifdef CONFIG_DELTA_SIGNATURE
+	ret = delta_stream_read(flash, signature, sizeof(signature));
+	if (ret) {
+		stream_stop(ret);
+		return ret;
+	}
+	delta_signature_start(&header, signature);
+#endif
+#ifdef CONFIG_DELTA_ENCRYPTION
+	/* the nonce is signed with the patch */
+	ret = STREAM_PATCH_READ(flash, nonce, sizeof(nonce));
+	if (!ret) {
+		ret = delta_crypt_start(nonce);
+	}
+	if (ret) {
+		stream_stop(ret);
+		return ret;
+	}
+#endif
+
+	LOG_INF("Streaming patch of %u bytes", header.size);
+
+	ret = delta_apply_and_reboot(flash, STREAM_PATCH_READ, &header);
+	stream_stop(ret);
+
+	return ret;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef DELTA_STREAM_H
+#define DELTA_STREAM_H
+
+#include "delta.h"
+
+/* STREAMING APPLY OVER A UART.
+ * The host sends the patch header followed by the patch. It may only
+ * send as many bytes as it has credits for. The device grants one
+ * credit (DELTA_STREAM_CREDIT) for every CONFIG_DELTA_STREAM_CREDIT_SIZE
+ * bytes, initially filling its receive buffer and then whenever that
+ * many bytes have been consumed by the patcher. On failure the device
+ * sends DELTA_STREAM_ABORT.
+ */
+#define DELTA_STREAM_CREDIT 0x06
+#define DELTA_STREAM_ABORT 0x15
+
+/**
+ * Waits for a patch on the stream UART and applies it while it is
+ * being received. Restarts the device into the new image on success.
+ *
+ * @param[in] flash the devices flash memory.
+ *
+ * @return zero(0) if no patch arrived within the timeout or a
+ * negative error code.
+ */
+int delta_stream_check_and_apply(struct flash_mem *flash);
+
+#endif
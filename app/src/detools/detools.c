@@ -35,14 +35,26 @@
 
 /* Patch types. */
 #define PATCH_TYPE_SEQUENTIAL                               0
+#define PATCH_TYPE_IN_PLACE                                 1
 
-/* Compressions. */
+/* Compressions. LZ4 has its own number as detools' lz4 (6) uses
+   linked frame blocks, which need a 64 kB window. */
+#define COMPRESSION_NONE                                    0
+#define COMPRESSION_LZMA                                    1
+#define COMPRESSION_CRLE                                    2
 #define COMPRESSION_HEATSHRINK                              4
+#define COMPRESSION_LZ4                                     7
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define DIV_CEIL(n, d) (((n) + (d) - 1) / (d))
 
+#ifdef DETOOLS_CONFIG_ARENA_SECTION
+#    define ARENA __attribute__((section(DETOOLS_CONFIG_ARENA_SECTION)))
+#else
+#    define ARENA
+#endif
+
 /*
  * Utility functions.
  */
@@ -118,6 +130,93 @@ static int chunk_unpack_header_size(struct detools_apply_patch_chunk_t *self_p,
     return (0);
 }
 
+static int chunk_unpack_usize(struct detools_apply_patch_chunk_t *self_p,
+                              struct detools_unpack_usize_t *state_p,
+                              int *size_p)
+{
+    uint8_t byte;
+
+    do {
+        if (chunk_get(self_p, &byte) != 0) {
+            return (1);
+        }
+
+        switch (state_p->state) {
+
+        case detools_unpack_usize_state_first_t:
+            state_p->value = (byte & 0x7f);
+            state_p->offset = 7;
+            state_p->state = detools_unpack_usize_state_consecutive_t;
+            break;
+
+        case detools_unpack_usize_state_consecutive_t:
+            if (is_overflow(state_p->offset)) {
+                return (-DETOOLS_CORRUPT_PATCH_OVERFLOW);
+            }
+
+            state_p->value |= ((byte & 0x7f) << state_p->offset);
+            state_p->offset += 7;
+            break;
+
+        default:
+            return (-DETOOLS_INTERNAL_ERROR);
+        }
+    } while ((byte & 0x80) != 0);
+
+    state_p->state = detools_unpack_usize_state_first_t;
+    *size_p = state_p->value;
+
+    return (0);
+}
+
+#if DETOOLS_CONFIG_COMPRESSION_NONE == 1
+
+/*
+ * None patch reader, for raw patches.
+ */
+
+static int patch_reader_none_decompress(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    uint8_t *buf_p,
+    size_t *size_p)
+{
+    size_t size;
+
+    size = MIN(*size_p, chunk_left(self_p->patch_chunk_p));
+
+    if (size == 0) {
+        return (1);
+    }
+
+    memcpy(buf_p,
+           &self_p->patch_chunk_p->buf_p[self_p->patch_chunk_p->offset],
+           size);
+    self_p->patch_chunk_p->offset += size;
+    *size_p = size;
+
+    return (0);
+}
+
+static int patch_reader_none_destroy(
+    struct detools_apply_patch_patch_reader_t *self_p)
+{
+    (void)self_p;
+
+    return (0);
+}
+
+static int patch_reader_none_init(
+    struct detools_apply_patch_patch_reader_t *self_p)
+{
+    (void)self_p;
+
+    return (0);
+}
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_HEATSHRINK == 1
+
 /*
  * Heatshrink patch reader.
  */
@@ -207,6 +306,67 @@ static int patch_reader_heatshrink_decompress(
     return (res);
 }
 
+/**
+ * Skip up to given number of zeros that back-references copy from
+ * zeros, without expanding them. Stops at the first literal or
+ * back-reference over non-zero data.
+ */
+static int patch_reader_heatshrink_zeros(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    size_t *size_p)
+{
+    int res;
+    struct detools_apply_patch_patch_reader_heatshrink_t *heatshrink_p;
+    size_t size;
+    size_t left;
+    HSD_poll_res pres;
+    HSD_sink_res sres;
+    uint8_t byte;
+
+    heatshrink_p = &self_p->compression.heatshrink;
+    left = *size_p;
+
+    /* The header is read by the first decompression. */
+    if (heatshrink_p->window_sz2 == -1) {
+        left = 0;
+    }
+
+    while (left > 0) {
+        pres = heatshrink_decoder_skip_zeros(&heatshrink_p->decoder,
+                                             left,
+                                             &size);
+
+        if (pres < 0) {
+            return (-DETOOLS_HEATSHRINK_POLL);
+        }
+
+        left -= size;
+
+        if (pres != HSDR_POLL_EMPTY) {
+            break;
+        }
+
+        res = chunk_get(self_p->patch_chunk_p, &byte);
+
+        if (res != 0) {
+            break;
+        }
+
+        sres = heatshrink_decoder_sink(&heatshrink_p->decoder,
+                                       &byte,
+                                       sizeof(byte),
+                                       &size);
+
+        if ((sres < 0) || (size != sizeof(byte))) {
+            return (-DETOOLS_HEATSHRINK_SINK);
+        }
+    }
+
+    *size_p -= left;
+
+    return (0);
+}
+
 static int patch_reader_heatshrink_destroy(
     struct detools_apply_patch_patch_reader_t *self_p)
 {
@@ -233,397 +393,3047 @@ static int patch_reader_heatshrink_init(
     heatshrink_p->window_sz2 = -1;
     heatshrink_p->lookahead_sz2 = -1;
     heatshrink_decoder_reset(&heatshrink_p->decoder);
-    self_p->destroy = patch_reader_heatshrink_destroy;
-    self_p->decompress = patch_reader_heatshrink_decompress;
 
     return (0);
 }
 
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_CRLE == 1
+
 /*
- * Patch reader.
+ * CRLE patch reader. The stream is a sequence of scattered records
+ * (kind 0, size and that many bytes) and repeated records (kind 1,
+ * number of repetitions and the value to repeat).
  */
 
-/**
- * Initialize given patch reader.
- */
-static int patch_reader_init(struct detools_apply_patch_patch_reader_t *self_p,
-                             struct detools_apply_patch_chunk_t *patch_chunk_p,
-                             size_t patch_size,
-                             int compression)
+static int patch_reader_crle_decompress_idle(
+    struct detools_apply_patch_patch_reader_crle_t *crle_p,
+    struct detools_apply_patch_chunk_t *chunk_p)
 {
-    int res;
+    uint8_t kind;
 
-    self_p->patch_chunk_p = patch_chunk_p;
-    self_p->size.state = detools_unpack_usize_state_first_t;
-
-    res = patch_reader_heatshrink_init(self_p);
+    if (chunk_get(chunk_p, &kind) != 0) {
+        return (1);
+    }
 
-    return (res);
-}
+    switch (kind) {
 
-static int patch_reader_dump(struct detools_apply_patch_patch_reader_t *self_p,
-                             int compression,
-                             detools_state_write_t state_write)
-{
-    (void)self_p;
-    (void)state_write;
+    case 0:
+        crle_p->state = detools_crle_state_scattered_size_t;
+        crle_p->kind.scattered.size.state = detools_unpack_usize_state_first_t;
+        break;
 
-    int res;
+    case 1:
+        crle_p->state = detools_crle_state_repeated_repetitions_t;
+        crle_p->kind.repeated.size.state = detools_unpack_usize_state_first_t;
+        break;
 
-    res = 0;
+    default:
+        return (-DETOOLS_CORRUPT_PATCH_CRLE_KIND);
+    }
 
-    return (res);
+    return (0);
 }
 
-static int patch_reader_restore(struct detools_apply_patch_patch_reader_t *self_p,
-                                struct detools_apply_patch_patch_reader_t *dumped_p,
-                                struct detools_apply_patch_chunk_t *patch_chunk_p,
-                                int compression,
-                                detools_state_read_t state_read)
+static int patch_reader_crle_decompress_size(
+    struct detools_apply_patch_chunk_t *chunk_p,
+    struct detools_unpack_usize_t *size_p,
+    size_t *number_of_bytes_left_p)
 {
-    (void)state_read;
-
     int res;
+    int size;
 
-    res = 0;
-    *self_p = *dumped_p;
-    self_p->patch_chunk_p = patch_chunk_p;
+    res = chunk_unpack_usize(chunk_p, size_p, &size);
 
-    self_p->destroy = patch_reader_heatshrink_destroy;
-    self_p->decompress = patch_reader_heatshrink_decompress;
+    if (res != 0) {
+        return (res);
+    }
 
-    return (res);
+    if (size <= 0) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+
+    *number_of_bytes_left_p = (size_t)size;
+
+    return (0);
 }
 
 /**
- * Try to decompress given number of bytes.
- *
- * @return zero(0) if at least one byte was decompressed, one(1) if
- *         zero bytes were decompressed and more input is needed, or
- *         negative error code.
+ * Scattered data is copied straight from the patch chunk.
  */
-static int patch_reader_decompress(
-    struct detools_apply_patch_patch_reader_t *self_p,
+static size_t patch_reader_crle_decompress_scattered_data(
+    struct detools_apply_patch_patch_reader_crle_t *crle_p,
+    struct detools_apply_patch_chunk_t *chunk_p,
     uint8_t *buf_p,
-    size_t *size_p)
+    size_t size)
 {
-    return (self_p->decompress(self_p, buf_p, size_p));
+    size = MIN(size, crle_p->kind.scattered.number_of_bytes_left);
+    size = MIN(size, chunk_left(chunk_p));
+    memcpy(buf_p, &chunk_p->buf_p[chunk_p->offset], size);
+    chunk_p->offset += size;
+    crle_p->kind.scattered.number_of_bytes_left -= size;
+
+    if (crle_p->kind.scattered.number_of_bytes_left == 0) {
+        crle_p->state = detools_crle_state_idle_t;
+    }
+
+    return (size);
 }
 
 /**
- * Unpack a size value.
+ * Repeated data is expanded with a block fill.
  */
-static int patch_reader_unpack_size(
+static size_t patch_reader_crle_decompress_repeated_data(
+    struct detools_apply_patch_patch_reader_crle_t *crle_p,
+    uint8_t *buf_p,
+    size_t size)
+{
+    size = MIN(size, crle_p->kind.repeated.number_of_bytes_left);
+    memset(buf_p, crle_p->kind.repeated.value, size);
+    crle_p->kind.repeated.number_of_bytes_left -= size;
+
+    if (crle_p->kind.repeated.number_of_bytes_left == 0) {
+        crle_p->state = detools_crle_state_idle_t;
+    }
+
+    return (size);
+}
+
+static int patch_reader_crle_decompress(
     struct detools_apply_patch_patch_reader_t *self_p,
-    int *size_p)
+    uint8_t *buf_p,
+    size_t *size_p)
 {
     int res;
-    uint8_t byte;
     size_t size;
+    size_t left;
+    struct detools_apply_patch_patch_reader_crle_t *crle_p;
+    struct detools_apply_patch_chunk_t *chunk_p;
 
-    size = 1;
+    crle_p = &self_p->compression.crle;
+    chunk_p = self_p->patch_chunk_p;
+    left = *size_p;
+    res = 0;
 
-    do {
-        switch (self_p->size.state) {
+    /* Fill as much of the buffer as the available input allows. */
+    while ((left > 0) && (res == 0)) {
+        switch (crle_p->state) {
 
-        case detools_unpack_usize_state_first_t:
-            res = patch_reader_decompress(self_p, &byte, &size);
+        case detools_crle_state_idle_t:
+            res = patch_reader_crle_decompress_idle(crle_p, chunk_p);
+            break;
 
-            if (res != 0) {
-                return (res);
+        case detools_crle_state_scattered_size_t:
+            res = patch_reader_crle_decompress_size(
+                chunk_p,
+                &crle_p->kind.scattered.size,
+                &crle_p->kind.scattered.number_of_bytes_left);
+
+            if (res == 0) {
+                crle_p->state = detools_crle_state_scattered_data_t;
             }
 
-            self_p->size.is_signed = ((byte & 0x40) == 0x40);
-            self_p->size.value = (byte & 0x3f);
-            self_p->size.offset = 6;
-            self_p->size.state = detools_unpack_usize_state_consecutive_t;
             break;
 
-        case detools_unpack_usize_state_consecutive_t:
-            res = patch_reader_decompress(self_p, &byte, &size);
+        case detools_crle_state_scattered_data_t:
+            size = patch_reader_crle_decompress_scattered_data(crle_p,
+                                                               chunk_p,
+                                                               buf_p,
+                                                               left);
 
-            if (res != 0) {
-                return (res);
+            if (size == 0) {
+                res = 1;
             }
 
-            if (is_overflow(self_p->size.offset)) {
-                return (-DETOOLS_CORRUPT_PATCH_OVERFLOW);
+            buf_p += size;
+            left -= size;
+            break;
+
+        case detools_crle_state_repeated_repetitions_t:
+            res = patch_reader_crle_decompress_size(
+                chunk_p,
+                &crle_p->kind.repeated.size,
+                &crle_p->kind.repeated.number_of_bytes_left);
+
+            if (res == 0) {
+                crle_p->state = detools_crle_state_repeated_data_t;
             }
 
-            self_p->size.value |= ((byte & 0x7f) << self_p->size.offset);
-            self_p->size.offset += 7;
+            break;
+
+        case detools_crle_state_repeated_data_t:
+            res = chunk_get(chunk_p, &crle_p->kind.repeated.value);
+
+            if (res == 0) {
+                crle_p->state = detools_crle_state_repeated_data_read_t;
+            }
+
+            break;
+
+        case detools_crle_state_repeated_data_read_t:
+            size = patch_reader_crle_decompress_repeated_data(crle_p,
+                                                              buf_p,
+                                                              left);
+            buf_p += size;
+            left -= size;
             break;
 
         default:
-            return (-DETOOLS_INTERNAL_ERROR);
+            res = -DETOOLS_INTERNAL_ERROR;
+            break;
         }
-    } while ((byte & 0x80) != 0);
+    }
 
-    /* Done, fix sign. */
-    self_p->size.state = detools_unpack_usize_state_first_t;
+    if (res < 0) {
+        return (res);
+    }
 
-    if (self_p->size.is_signed) {
-        self_p->size.value *= -1;
+    if (left == *size_p) {
+        return (1);
     }
 
-    *size_p = self_p->size.value;
+    *size_p -= left;
 
-    return (res);
+    return (0);
 }
 
-static int common_process_size(
-    struct detools_apply_patch_patch_reader_t *patch_reader_p,
-    size_t to_pos,
-    size_t to_size,
-    int *size_p)
+/**
+ * Skip up to given number of zeros at the start of a repeated record
+ * without expanding them. Stops at the first scattered record or
+ * non-zero value.
+ */
+static int patch_reader_crle_zeros(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    size_t *size_p)
 {
     int res;
+    size_t size;
+    size_t left;
+    struct detools_apply_patch_patch_reader_crle_t *crle_p;
+    struct detools_apply_patch_chunk_t *chunk_p;
 
-    res = patch_reader_unpack_size(patch_reader_p, size_p);
+    crle_p = &self_p->compression.crle;
+    chunk_p = self_p->patch_chunk_p;
+    left = *size_p;
+    res = 0;
 
-    if (res != 0) {
-        return (res);
-    }
+    while ((left > 0) && (res == 0)) {
+        switch (crle_p->state) {
 
-    if (to_pos + (size_t)*size_p > to_size) {
-        return (-DETOOLS_CORRUPT_PATCH);
-    }
+        case detools_crle_state_idle_t:
+            res = patch_reader_crle_decompress_idle(crle_p, chunk_p);
+            break;
 
-    return (res);
-}
+        case detools_crle_state_repeated_repetitions_t:
+            res = patch_reader_crle_decompress_size(
+                chunk_p,
+                &crle_p->kind.repeated.size,
+                &crle_p->kind.repeated.number_of_bytes_left);
 
-/*
- * Low level sequential patch type functionality.
- */
+            if (res == 0) {
+                crle_p->state = detools_crle_state_repeated_data_t;
+            }
 
-static int process_init(struct detools_apply_patch_t *self_p)
-{
-    int patch_type;
+            break;
+
+        case detools_crle_state_repeated_data_t:
+            res = chunk_get(chunk_p, &crle_p->kind.repeated.value);
+
+            if (res == 0) {
+                crle_p->state = detools_crle_state_repeated_data_read_t;
+            }
+
+            break;
+
+        case detools_crle_state_repeated_data_read_t:
+            if (crle_p->kind.repeated.value != 0) {
+                res = 1;
+                break;
+            }
+
+            size = MIN(left, crle_p->kind.repeated.number_of_bytes_left);
+            crle_p->kind.repeated.number_of_bytes_left -= size;
+            left -= size;
+
+            if (crle_p->kind.repeated.number_of_bytes_left == 0) {
+                crle_p->state = detools_crle_state_idle_t;
+            }
+
+            break;
+
+        default:
+            res = 1;
+            break;
+        }
+    }
+
+    if (res < 0) {
+        return (res);
+    }
+
+    *size_p -= left;
+
+    return (0);
+}
+
+static int patch_reader_crle_destroy(
+    struct detools_apply_patch_patch_reader_t *self_p)
+{
+    if (self_p->compression.crle.state == detools_crle_state_idle_t) {
+        return (0);
+    } else {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+}
+
+static int patch_reader_crle_init(
+    struct detools_apply_patch_patch_reader_t *self_p)
+{
+    self_p->compression.crle.state = detools_crle_state_idle_t;
+
+    return (0);
+}
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+
+/*
+ * LZ4 patch reader. The stream starts with the base two logarithm of
+ * the block size, followed by independently compressed blocks, each
+ * prefixed by its size shifted left one bit. The low bit is set for
+ * blocks stored uncompressed. A block is decoded into the block
+ * buffer and then served from it, so matches never reach outside it.
+ */
+
+/**
+ * Get a byte belonging to the current block.
+ */
+static int patch_reader_lz4_get(
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p,
+    struct detools_apply_patch_chunk_t *chunk_p,
+    uint8_t *byte_p)
+{
+    if (lz4_p->input_left == 0) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+
+    if (chunk_get(chunk_p, byte_p) != 0) {
+        return (1);
+    }
+
+    lz4_p->input_left--;
+
+    return (0);
+}
+
+static int patch_reader_lz4_literals(
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p,
+    struct detools_apply_patch_chunk_t *chunk_p)
+{
+    size_t size;
+
+    if (lz4_p->length == 0) {
+        /* The last sequence of a block has no match. */
+        if (lz4_p->input_left == 0) {
+            lz4_p->state = detools_lz4_state_block_size_t;
+        } else {
+            lz4_p->state = detools_lz4_state_offset_low_t;
+        }
+
+        return (0);
+    }
+
+    size = MIN(lz4_p->length, lz4_p->input_left);
+    size = MIN(size, chunk_left(chunk_p));
+
+    if (size == 0) {
+        if (lz4_p->input_left == 0) {
+            return (-DETOOLS_CORRUPT_PATCH);
+        }
+
+        return (1);
+    }
+
+    if (lz4_p->write_pos + size > lz4_p->block_size) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+
+    memcpy(&lz4_p->block[lz4_p->write_pos],
+           &chunk_p->buf_p[chunk_p->offset],
+           size);
+    chunk_p->offset += size;
+    lz4_p->input_left -= size;
+    lz4_p->write_pos += size;
+    lz4_p->length -= size;
+
+    if ((lz4_p->length == 0) && (lz4_p->input_left == 0)) {
+        lz4_p->state = detools_lz4_state_block_size_t;
+    }
+
+    return (0);
+}
+
+static int patch_reader_lz4_match(
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p)
+{
+    size_t i;
+
+    if (lz4_p->write_pos + lz4_p->length > lz4_p->block_size) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+
+    /* Byte by byte, as the match may overlap its own output. */
+    for (i = 0; i < lz4_p->length; i++) {
+        lz4_p->block[lz4_p->write_pos] =
+            lz4_p->block[lz4_p->write_pos - lz4_p->offset];
+        lz4_p->write_pos++;
+    }
+
+    if (lz4_p->input_left == 0) {
+        lz4_p->state = detools_lz4_state_block_size_t;
+    } else {
+        lz4_p->state = detools_lz4_state_token_t;
+    }
+
+    return (0);
+}
+
+static int patch_reader_lz4_decode(
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p,
+    struct detools_apply_patch_chunk_t *chunk_p)
+{
+    int res;
+    int size;
+    uint8_t byte;
+
+    switch (lz4_p->state) {
+
+    case detools_lz4_state_header_t:
+        if (chunk_get(chunk_p, &byte) != 0) {
+            return (1);
+        }
+
+        if ((byte > 16)
+            || ((1u << byte) > DETOOLS_CONFIG_COMPRESSION_LZ4_BLOCK_SIZE)) {
+            return (-DETOOLS_LZ4_HEADER);
+        }
+
+        lz4_p->block_size = (1u << byte);
+        lz4_p->state = detools_lz4_state_block_size_t;
+        lz4_p->size.state = detools_unpack_usize_state_first_t;
+        res = 0;
+        break;
+
+    case detools_lz4_state_block_size_t:
+        res = chunk_unpack_usize(chunk_p, &lz4_p->size, &size);
+
+        if (res != 0) {
+            return (res);
+        }
+
+        lz4_p->input_left = ((size_t)size >> 1);
+
+        if ((lz4_p->input_left == 0)
+            || (lz4_p->input_left > lz4_p->block_size)) {
+            return (-DETOOLS_CORRUPT_PATCH);
+        }
+
+        lz4_p->read_pos = 0;
+        lz4_p->write_pos = 0;
+
+        if ((size & 1) != 0) {
+            lz4_p->state = detools_lz4_state_stored_t;
+        } else {
+            lz4_p->state = detools_lz4_state_token_t;
+        }
+
+        break;
+
+    case detools_lz4_state_token_t:
+        res = patch_reader_lz4_get(lz4_p, chunk_p, &lz4_p->token);
+
+        if (res != 0) {
+            return (res);
+        }
+
+        lz4_p->length = (lz4_p->token >> 4);
+
+        if (lz4_p->length == 15) {
+            lz4_p->state = detools_lz4_state_literal_length_t;
+        } else {
+            lz4_p->state = detools_lz4_state_literals_t;
+        }
+
+        break;
+
+    case detools_lz4_state_literal_length_t:
+        res = patch_reader_lz4_get(lz4_p, chunk_p, &byte);
+
+        if (res != 0) {
+            return (res);
+        }
+
+        lz4_p->length += byte;
+
+        if (byte != 255) {
+            lz4_p->state = detools_lz4_state_literals_t;
+        }
+
+        break;
+
+    case detools_lz4_state_literals_t:
+        res = patch_reader_lz4_literals(lz4_p, chunk_p);
+        break;
+
+    case detools_lz4_state_offset_low_t:
+        res = patch_reader_lz4_get(lz4_p, chunk_p, &byte);
+
+        if (res != 0) {
+            return (res);
+        }
+
+        lz4_p->offset = byte;
+        lz4_p->state = detools_lz4_state_offset_high_t;
+        break;
+
+    case detools_lz4_state_offset_high_t:
+        res = patch_reader_lz4_get(lz4_p, chunk_p, &byte);
+
+        if (res != 0) {
+            return (res);
+        }
+
+        lz4_p->offset |= ((size_t)byte << 8);
+
+        if ((lz4_p->offset == 0) || (lz4_p->offset > lz4_p->write_pos)) {
+            return (-DETOOLS_CORRUPT_PATCH);
+        }
+
+        lz4_p->length = ((lz4_p->token & 0xf) + 4);
+
+        if ((lz4_p->token & 0xf) == 15) {
+            lz4_p->state = detools_lz4_state_match_length_t;
+        } else {
+            lz4_p->state = detools_lz4_state_match_t;
+        }
+
+        break;
+
+    case detools_lz4_state_match_length_t:
+        res = patch_reader_lz4_get(lz4_p, chunk_p, &byte);
+
+        if (res != 0) {
+            return (res);
+        }
+
+        lz4_p->length += byte;
+
+        if (byte != 255) {
+            lz4_p->state = detools_lz4_state_match_t;
+        }
+
+        break;
+
+    case detools_lz4_state_match_t:
+        res = patch_reader_lz4_match(lz4_p);
+        break;
+
+    default:
+        res = -DETOOLS_INTERNAL_ERROR;
+        break;
+    }
+
+    return (res);
+}
+
+static int patch_reader_lz4_decompress(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    uint8_t *buf_p,
+    size_t *size_p)
+{
+    int res;
+    size_t size;
+    size_t left;
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p;
+    struct detools_apply_patch_chunk_t *chunk_p;
+
+    lz4_p = &self_p->compression.lz4;
+    chunk_p = self_p->patch_chunk_p;
+    left = *size_p;
+    res = 0;
+
+    while ((left > 0) && (res == 0)) {
+        /* Serve decoded data before decoding more. */
+        if (lz4_p->read_pos < lz4_p->write_pos) {
+            size = MIN(left, lz4_p->write_pos - lz4_p->read_pos);
+            memcpy(buf_p, &lz4_p->block[lz4_p->read_pos], size);
+            lz4_p->read_pos += size;
+            buf_p += size;
+            left -= size;
+        } else if (lz4_p->state == detools_lz4_state_stored_t) {
+            /* Stored blocks bypass the block buffer. */
+            size = MIN(left, lz4_p->input_left);
+            size = MIN(size, chunk_left(chunk_p));
+
+            if (size == 0) {
+                res = 1;
+                break;
+            }
+
+            memcpy(buf_p, &chunk_p->buf_p[chunk_p->offset], size);
+            chunk_p->offset += size;
+            lz4_p->input_left -= size;
+            buf_p += size;
+            left -= size;
+
+            if (lz4_p->input_left == 0) {
+                lz4_p->state = detools_lz4_state_block_size_t;
+            }
+        } else {
+            res = patch_reader_lz4_decode(lz4_p, chunk_p);
+        }
+    }
+
+    if (res < 0) {
+        return (res);
+    }
+
+    if (left == *size_p) {
+        return (1);
+    }
+
+    *size_p -= left;
+
+    return (0);
+}
+
+static int patch_reader_lz4_destroy(
+    struct detools_apply_patch_patch_reader_t *self_p)
+{
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p;
+
+    lz4_p = &self_p->compression.lz4;
+
+    /* A block may end with an empty literal run not yet decoded. */
+    if ((lz4_p->state == detools_lz4_state_literals_t)
+        && (lz4_p->length == 0)
+        && (lz4_p->input_left == 0)) {
+        lz4_p->state = detools_lz4_state_block_size_t;
+    }
+
+    if (((lz4_p->state == detools_lz4_state_block_size_t)
+         || (lz4_p->state == detools_lz4_state_header_t))
+        && (lz4_p->read_pos == lz4_p->write_pos)) {
+        return (0);
+    } else {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+}
+
+static int patch_reader_lz4_init(
+    struct detools_apply_patch_patch_reader_t *self_p)
+{
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p;
+
+    lz4_p = &self_p->compression.lz4;
+    lz4_p->state = detools_lz4_state_header_t;
+    lz4_p->read_pos = 0;
+    lz4_p->write_pos = 0;
+
+    return (0);
+}
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1
+
+/*
+ * LZMA patch reader. The stream is in the LZMA_Alone format, a 13
+ * bytes header with the properties, the dictionary size and the
+ * uncompressed size, followed by range coded packets. The
+ * uncompressed size and the end marker are not needed as the patch
+ * knows its to-size.
+ */
+
+#define LZMA_HEADER_SIZE                                   13
+#define LZMA_DICT_SIZE_MIN                               4096
+#define LZMA_INPUT_MAX                                     20
+#define LZMA_NUMBER_OF_STATES                              12
+#define LZMA_POS_STATES_MAX                                16
+#define LZMA_LEN_TO_POS_STATES                              4
+#define LZMA_END_POS_MODEL_INDEX                           14
+#define LZMA_FULL_DISTANCES                               128
+#define LZMA_ALIGN_BITS                                     4
+#define LZMA_MATCH_MIN_LEN                                  2
+#define LZMA_BIT_MODEL_TOTAL_BITS                          11
+#define LZMA_BIT_MODEL_TOTAL        (1u << LZMA_BIT_MODEL_TOTAL_BITS)
+#define LZMA_MOVE_BITS                                      5
+#define LZMA_TOP_VALUE                              (1u << 24)
+#define LZMA_END_MARKER                            0xffffffff
+
+/* Packet kinds. */
+#define LZMA_PACKET_MATCH                                   0
+#define LZMA_PACKET_LITERAL                                 1
+#define LZMA_PACKET_END                                     2
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA_DICT_SIZE < LZMA_DICT_SIZE_MIN
+#    error "The LZMA dictionary must be at least 4096 bytes."
+#endif
+
+struct lzma_length_probs_t {
+    uint16_t choice;
+    uint16_t choice_2;
+    uint16_t low[LZMA_POS_STATES_MAX][8];
+    uint16_t mid[LZMA_POS_STATES_MAX][8];
+    uint16_t high[256];
+};
+
+struct lzma_probs_t {
+    uint16_t is_match[LZMA_NUMBER_OF_STATES][LZMA_POS_STATES_MAX];
+    uint16_t is_rep[LZMA_NUMBER_OF_STATES];
+    uint16_t is_rep_g0[LZMA_NUMBER_OF_STATES];
+    uint16_t is_rep_g1[LZMA_NUMBER_OF_STATES];
+    uint16_t is_rep_g2[LZMA_NUMBER_OF_STATES];
+    uint16_t is_rep0_long[LZMA_NUMBER_OF_STATES][LZMA_POS_STATES_MAX];
+    uint16_t pos_slot[LZMA_LEN_TO_POS_STATES][64];
+    uint16_t pos_special[1 + LZMA_FULL_DISTANCES - LZMA_END_POS_MODEL_INDEX];
+    uint16_t align[1 << LZMA_ALIGN_BITS];
+    struct lzma_length_probs_t match_length;
+    struct lzma_length_probs_t rep_length;
+    uint16_t literal[0x300 << DETOOLS_CONFIG_COMPRESSION_LZMA_LC_LP_MAX];
+};
+
+/* Only one patch is applied at a time, so the probabilities and the
+   dictionary are shared by all patch readers. */
+static struct {
+    struct lzma_probs_t probs;
+    uint8_t dict[DETOOLS_CONFIG_COMPRESSION_LZMA_DICT_SIZE];
+} lzma_arena ARENA;
+
+/**
+ * Range decoder over the input of one packet. A dry run decodes
+ * without updating the probabilities, to find out if the input is
+ * sufficient.
+ */
+struct lzma_range_decoder_t {
+    uint32_t range;
+    uint32_t code;
+    const uint8_t *buf_p;
+    size_t size;
+    size_t offset;
+    bool dry_run;
+    bool overrun;
+};
+
+static inline void lzma_normalize(struct lzma_range_decoder_t *rc_p)
+{
+    if (rc_p->range < LZMA_TOP_VALUE) {
+        rc_p->range <<= 8;
+        rc_p->code <<= 8;
+
+        if (rc_p->offset < rc_p->size) {
+            rc_p->code |= rc_p->buf_p[rc_p->offset];
+            rc_p->offset++;
+        } else {
+            rc_p->overrun = true;
+        }
+    }
+}
+
+static inline unsigned lzma_decode_bit(struct lzma_range_decoder_t *rc_p,
+                                       uint16_t *prob_p)
+{
+    uint32_t bound;
+    unsigned bit;
+
+    bound = ((rc_p->range >> LZMA_BIT_MODEL_TOTAL_BITS) * *prob_p);
+
+    if (rc_p->code < bound) {
+        if (!rc_p->dry_run) {
+            *prob_p += ((LZMA_BIT_MODEL_TOTAL - *prob_p) >> LZMA_MOVE_BITS);
+        }
+
+        rc_p->range = bound;
+        bit = 0;
+    } else {
+        if (!rc_p->dry_run) {
+            *prob_p -= (*prob_p >> LZMA_MOVE_BITS);
+        }
+
+        rc_p->code -= bound;
+        rc_p->range -= bound;
+        bit = 1;
+    }
+
+    lzma_normalize(rc_p);
+
+    return (bit);
+}
+
+static uint32_t lzma_decode_direct_bits(struct lzma_range_decoder_t *rc_p,
+                                        unsigned number_of_bits)
+{
+    uint32_t value;
+    uint32_t mask;
+
+    value = 0;
+
+    while (number_of_bits > 0) {
+        rc_p->range >>= 1;
+        rc_p->code -= rc_p->range;
+        mask = (0 - (rc_p->code >> 31));
+        rc_p->code += (rc_p->range & mask);
+        value = ((value << 1) + (mask + 1));
+        lzma_normalize(rc_p);
+        number_of_bits--;
+    }
+
+    return (value);
+}
+
+static uint32_t lzma_decode_bit_tree(struct lzma_range_decoder_t *rc_p,
+                                     uint16_t *probs_p,
+                                     unsigned number_of_bits)
+{
+    uint32_t symbol;
+    unsigned i;
+
+    symbol = 1;
+
+    for (i = 0; i < number_of_bits; i++) {
+        symbol = ((symbol << 1) | lzma_decode_bit(rc_p, &probs_p[symbol]));
+    }
+
+    return (symbol - (1u << number_of_bits));
+}
+
+static uint32_t lzma_decode_reverse_bit_tree(struct lzma_range_decoder_t *rc_p,
+                                             uint16_t *probs_p,
+                                             unsigned number_of_bits)
+{
+    uint32_t symbol;
+    uint32_t value;
+    unsigned bit;
+    unsigned i;
+
+    symbol = 1;
+    value = 0;
+
+    for (i = 0; i < number_of_bits; i++) {
+        bit = lzma_decode_bit(rc_p, &probs_p[symbol]);
+        symbol = ((symbol << 1) | bit);
+        value |= (bit << i);
+    }
+
+    return (value);
+}
+
+static uint32_t lzma_decode_length(struct lzma_range_decoder_t *rc_p,
+                                   struct lzma_length_probs_t *probs_p,
+                                   unsigned pos_state)
+{
+    if (lzma_decode_bit(rc_p, &probs_p->choice) == 0) {
+        return (lzma_decode_bit_tree(rc_p, &probs_p->low[pos_state][0], 3));
+    }
+
+    if (lzma_decode_bit(rc_p, &probs_p->choice_2) == 0) {
+        return (8 + lzma_decode_bit_tree(rc_p, &probs_p->mid[pos_state][0], 3));
+    }
+
+    return (16 + lzma_decode_bit_tree(rc_p, &probs_p->high[0], 8));
+}
+
+static uint32_t lzma_decode_distance(struct lzma_range_decoder_t *rc_p,
+                                     uint32_t length)
+{
+    struct lzma_probs_t *probs_p;
+    uint32_t pos_slot;
+    uint32_t distance;
+    unsigned number_of_direct_bits;
+
+    probs_p = &lzma_arena.probs;
+    pos_slot = lzma_decode_bit_tree(
+        rc_p,
+        &probs_p->pos_slot[MIN(length, LZMA_LEN_TO_POS_STATES - 1)][0],
+        6);
+
+    if (pos_slot < 4) {
+        return (pos_slot);
+    }
+
+    number_of_direct_bits = ((pos_slot >> 1) - 1);
+    distance = ((2 | (pos_slot & 1)) << number_of_direct_bits);
+
+    if (pos_slot < LZMA_END_POS_MODEL_INDEX) {
+        distance += lzma_decode_reverse_bit_tree(
+            rc_p,
+            &probs_p->pos_special[distance - pos_slot],
+            number_of_direct_bits);
+    } else {
+        distance += (lzma_decode_direct_bits(
+                         rc_p,
+                         number_of_direct_bits - LZMA_ALIGN_BITS)
+                     << LZMA_ALIGN_BITS);
+        distance += lzma_decode_reverse_bit_tree(rc_p,
+                                                 &probs_p->align[0],
+                                                 LZMA_ALIGN_BITS);
+    }
+
+    return (distance);
+}
+
+static uint8_t lzma_dict_get(struct detools_apply_patch_patch_reader_lzma_t *lzma_p,
+                             uint32_t distance)
+{
+    size_t offset;
+
+    offset = (distance + 1);
+
+    if (offset <= lzma_p->dict_pos) {
+        return (lzma_arena.dict[lzma_p->dict_pos - offset]);
+    } else {
+        return (lzma_arena.dict[lzma_p->dict_size + lzma_p->dict_pos - offset]);
+    }
+}
+
+static void lzma_dict_put(struct detools_apply_patch_patch_reader_lzma_t *lzma_p,
+                          uint8_t byte)
+{
+    lzma_arena.dict[lzma_p->dict_pos] = byte;
+    lzma_p->dict_pos++;
+    lzma_p->position++;
+
+    if (lzma_p->dict_pos == lzma_p->dict_size) {
+        lzma_p->dict_pos = 0;
+        lzma_p->dict_full = true;
+    }
+}
+
+static uint8_t lzma_decode_literal(
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p,
+    struct lzma_range_decoder_t *rc_p)
+{
+    uint16_t *probs_p;
+    uint32_t symbol;
+    unsigned previous_byte;
+    unsigned match_byte;
+    unsigned match_bit;
+    unsigned bit;
+
+    previous_byte = 0;
+
+    if ((lzma_p->position > 0) || lzma_p->dict_full) {
+        previous_byte = lzma_dict_get(lzma_p, 0);
+    }
+
+    probs_p = &lzma_arena.probs.literal[
+        0x300 * ((((lzma_p->position & ((1u << lzma_p->lp) - 1)) << lzma_p->lc))
+                 + (previous_byte >> (8 - lzma_p->lc)))];
+    symbol = 1;
+
+    /* After a match the literal is coded relative to the byte at the
+       last distance. */
+    if (lzma_p->state_index >= 7) {
+        match_byte = lzma_dict_get(lzma_p, lzma_p->reps[0]);
+
+        while (symbol < 0x100) {
+            match_bit = ((match_byte >> 7) & 1);
+            match_byte <<= 1;
+            bit = lzma_decode_bit(rc_p, &probs_p[((1 + match_bit) << 8) + symbol]);
+            symbol = ((symbol << 1) | bit);
+
+            if (match_bit != bit) {
+                break;
+            }
+        }
+    }
+
+    while (symbol < 0x100) {
+        symbol = ((symbol << 1) | lzma_decode_bit(rc_p, &probs_p[symbol]));
+    }
+
+    return ((uint8_t)symbol);
+}
+
+/**
+ * Decode one packet, a literal, a match or a repeated match. Nothing
+ * but the range decoder is modified in a dry run.
+ *
+ * @return Packet kind or negative error code.
+ */
+static int lzma_decode_packet(
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p,
+    struct lzma_range_decoder_t *rc_p,
+    uint8_t *byte_p)
+{
+    struct lzma_probs_t *probs_p;
+    unsigned state;
+    unsigned pos_state;
+    uint32_t reps[4];
+    uint32_t length;
+    uint32_t distance;
+
+    probs_p = &lzma_arena.probs;
+    state = lzma_p->state_index;
+    pos_state = (lzma_p->position & ((1u << lzma_p->pb) - 1));
+
+    if (lzma_decode_bit(rc_p, &probs_p->is_match[state][pos_state]) == 0) {
+        *byte_p = lzma_decode_literal(lzma_p, rc_p);
+
+        if (!rc_p->dry_run) {
+            if (state < 4) {
+                lzma_p->state_index = 0;
+            } else if (state < 10) {
+                lzma_p->state_index = (state - 3);
+            } else {
+                lzma_p->state_index = (state - 6);
+            }
+        }
+
+        return (LZMA_PACKET_LITERAL);
+    }
+
+    /* There is nothing to repeat before the first literal. */
+    if ((lzma_p->position == 0) && !lzma_p->dict_full) {
+        return (-DETOOLS_LZMA_DECODE);
+    }
+
+    memcpy(&reps[0], &lzma_p->reps[0], sizeof(reps));
+
+    if (lzma_decode_bit(rc_p, &probs_p->is_rep[state]) == 0) {
+        length = lzma_decode_length(rc_p, &probs_p->match_length, pos_state);
+        distance = lzma_decode_distance(rc_p, length);
+
+        if (distance == LZMA_END_MARKER) {
+            return (LZMA_PACKET_END);
+        }
+
+        reps[3] = reps[2];
+        reps[2] = reps[1];
+        reps[1] = reps[0];
+        reps[0] = distance;
+        state = ((state < 7) ? 7 : 10);
+    } else if (lzma_decode_bit(rc_p, &probs_p->is_rep_g0[state]) == 0) {
+        if (lzma_decode_bit(rc_p, &probs_p->is_rep0_long[state][pos_state]) == 0) {
+            length = (1 - LZMA_MATCH_MIN_LEN);
+            state = ((state < 7) ? 9 : 11);
+        } else {
+            length = lzma_decode_length(rc_p, &probs_p->rep_length, pos_state);
+            state = ((state < 7) ? 8 : 11);
+        }
+    } else {
+        if (lzma_decode_bit(rc_p, &probs_p->is_rep_g1[state]) == 0) {
+            distance = reps[1];
+        } else {
+            if (lzma_decode_bit(rc_p, &probs_p->is_rep_g2[state]) == 0) {
+                distance = reps[2];
+            } else {
+                distance = reps[3];
+                reps[3] = reps[2];
+            }
+
+            reps[2] = reps[1];
+        }
+
+        reps[1] = reps[0];
+        reps[0] = distance;
+        length = lzma_decode_length(rc_p, &probs_p->rep_length, pos_state);
+        state = ((state < 7) ? 8 : 11);
+    }
+
+    if ((reps[0] >= lzma_p->dict_size)
+        || (!lzma_p->dict_full && (reps[0] >= lzma_p->dict_pos))) {
+        return (-DETOOLS_LZMA_DECODE);
+    }
+
+    if (!rc_p->dry_run) {
+        memcpy(&lzma_p->reps[0], &reps[0], sizeof(reps));
+        lzma_p->state_index = state;
+        lzma_p->match_left = (length + LZMA_MATCH_MIN_LEN);
+    }
+
+    return (LZMA_PACKET_MATCH);
+}
+
+/**
+ * Decode one packet from the chunk, or from the input buffer if the
+ * chunk does not hold a complete packet.
+ *
+ * @return zero(0) if a packet was decoded, one(1) if more input is
+ *         needed, or negative error code.
+ */
+static int patch_reader_lzma_packet(
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p,
+    struct detools_apply_patch_chunk_t *chunk_p,
+    int *kind_p,
+    uint8_t *byte_p)
+{
+    int res;
+    size_t size;
+    struct lzma_range_decoder_t rc;
+
+    size = 0;
+
+    if ((lzma_p->input_size == 0) && (chunk_left(chunk_p) >= LZMA_INPUT_MAX)) {
+        rc.buf_p = &chunk_p->buf_p[chunk_p->offset];
+        rc.size = chunk_left(chunk_p);
+    } else {
+        size = MIN(LZMA_INPUT_MAX - lzma_p->input_size, chunk_left(chunk_p));
+        memcpy(&lzma_p->input[lzma_p->input_size],
+               &chunk_p->buf_p[chunk_p->offset],
+               size);
+        chunk_p->offset += size;
+        lzma_p->input_size += size;
+        rc.buf_p = &lzma_p->input[0];
+        rc.size = lzma_p->input_size;
+    }
+
+    rc.range = lzma_p->range;
+    rc.code = lzma_p->code;
+    rc.offset = 0;
+    rc.overrun = false;
+
+    /* Only a packet that may be longer than the input needs a dry
+       run, the rest of it is still to come. */
+    if (rc.size < LZMA_INPUT_MAX) {
+        rc.dry_run = true;
+        res = lzma_decode_packet(lzma_p, &rc, byte_p);
+
+        if (rc.overrun) {
+            return (1);
+        }
+
+        if (res < 0) {
+            return (res);
+        }
+
+        rc.range = lzma_p->range;
+        rc.code = lzma_p->code;
+        rc.offset = 0;
+    }
+
+    rc.dry_run = false;
+    res = lzma_decode_packet(lzma_p, &rc, byte_p);
+
+    if (rc.overrun) {
+        return (-DETOOLS_LZMA_DECODE);
+    }
+
+    if (res < 0) {
+        return (res);
+    }
+
+    *kind_p = res;
+    lzma_p->range = rc.range;
+    lzma_p->code = rc.code;
+
+    /* Give input not used by the packet back to the chunk. */
+    if (rc.buf_p != &lzma_p->input[0]) {
+        chunk_p->offset += rc.offset;
+    } else if (rc.offset >= lzma_p->input_size - size) {
+        chunk_p->offset -= (lzma_p->input_size - rc.offset);
+        lzma_p->input_size = 0;
+    } else {
+        chunk_p->offset -= size;
+        lzma_p->input_size -= (size + rc.offset);
+        memmove(&lzma_p->input[0],
+                &lzma_p->input[rc.offset],
+                lzma_p->input_size);
+    }
+
+    return (0);
+}
+
+static int patch_reader_lzma_header(
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p,
+    struct detools_apply_patch_chunk_t *chunk_p)
+{
+    int res;
+    unsigned properties;
+    uint32_t dict_size;
+    uint16_t *probs_p;
+    size_t number_of_probs;
+    size_t i;
+
+    res = chunk_get(chunk_p, &lzma_p->input[lzma_p->input_size]);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    lzma_p->input_size++;
+
+    if (lzma_p->input_size < LZMA_HEADER_SIZE) {
+        return (0);
+    }
+
+    properties = lzma_p->input[0];
+
+    if (properties >= (9 * 5 * 5)) {
+        return (-DETOOLS_LZMA_INIT);
+    }
+
+    lzma_p->lc = (properties % 9);
+    properties /= 9;
+    lzma_p->lp = (properties % 5);
+    lzma_p->pb = (properties / 5);
+
+    if ((lzma_p->lc + lzma_p->lp) > DETOOLS_CONFIG_COMPRESSION_LZMA_LC_LP_MAX) {
+        return (-DETOOLS_LZMA_INIT);
+    }
+
+    dict_size = ((uint32_t)lzma_p->input[1]
+                 | ((uint32_t)lzma_p->input[2] << 8)
+                 | ((uint32_t)lzma_p->input[3] << 16)
+                 | ((uint32_t)lzma_p->input[4] << 24));
+
+    if (dict_size > DETOOLS_CONFIG_COMPRESSION_LZMA_DICT_SIZE) {
+        return (-DETOOLS_LZMA_INIT);
+    }
+
+    lzma_p->dict_size = MAX(dict_size, LZMA_DICT_SIZE_MIN);
+
+    /* All probabilities start at one half. The literal probabilities
+       are last and only the ones used by lc and lp are needed. */
+    number_of_probs = ((sizeof(lzma_arena.probs)
+                        - sizeof(lzma_arena.probs.literal)) / sizeof(uint16_t)
+                       + (0x300u << (lzma_p->lc + lzma_p->lp)));
+    probs_p = (uint16_t *)&lzma_arena.probs;
+
+    for (i = 0; i < number_of_probs; i++) {
+        probs_p[i] = (LZMA_BIT_MODEL_TOTAL >> 1);
+    }
+
+    lzma_p->input_size = 0;
+    lzma_p->state = detools_lzma_state_range_coder_t;
+
+    return (0);
+}
+
+static int patch_reader_lzma_range_coder(
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p,
+    struct detools_apply_patch_chunk_t *chunk_p)
+{
+    int res;
+    uint8_t byte;
+
+    res = chunk_get(chunk_p, &byte);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    /* The first byte is always zero. */
+    if ((lzma_p->input_size == 0) && (byte != 0)) {
+        return (-DETOOLS_LZMA_DECODE);
+    }
+
+    lzma_p->code = ((lzma_p->code << 8) | byte);
+    lzma_p->input_size++;
+
+    if (lzma_p->input_size == 5) {
+        if (lzma_p->code == 0xffffffff) {
+            return (-DETOOLS_LZMA_DECODE);
+        }
+
+        lzma_p->input_size = 0;
+        lzma_p->state = detools_lzma_state_packet_t;
+    }
+
+    return (0);
+}
+
+static int patch_reader_lzma_decompress(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    uint8_t *buf_p,
+    size_t *size_p)
+{
+    int res;
+    int kind;
+    size_t left;
+    uint8_t byte;
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+    struct detools_apply_patch_chunk_t *chunk_p;
+
+    lzma_p = &self_p->compression.lzma;
+    chunk_p = self_p->patch_chunk_p;
+    left = *size_p;
+    res = 0;
+
+    while ((left > 0) && (res == 0)) {
+        if (lzma_p->match_left > 0) {
+            byte = lzma_dict_get(lzma_p, lzma_p->reps[0]);
+            lzma_dict_put(lzma_p, byte);
+            *buf_p++ = byte;
+            left--;
+            lzma_p->match_left--;
+            continue;
+        }
+
+        switch (lzma_p->state) {
+
+        case detools_lzma_state_header_t:
+            res = patch_reader_lzma_header(lzma_p, chunk_p);
+            break;
+
+        case detools_lzma_state_range_coder_t:
+            res = patch_reader_lzma_range_coder(lzma_p, chunk_p);
+            break;
+
+        case detools_lzma_state_packet_t:
+            res = patch_reader_lzma_packet(lzma_p, chunk_p, &kind, &byte);
+
+            if (res != 0) {
+                break;
+            }
+
+            if (kind == LZMA_PACKET_LITERAL) {
+                lzma_dict_put(lzma_p, byte);
+                *buf_p++ = byte;
+                left--;
+            } else if (kind == LZMA_PACKET_END) {
+                lzma_p->state = detools_lzma_state_end_t;
+                res = 1;
+            }
+
+            break;
+
+        case detools_lzma_state_end_t:
+            res = -DETOOLS_CORRUPT_PATCH;
+            break;
+
+        default:
+            res = -DETOOLS_INTERNAL_ERROR;
+            break;
+        }
+    }
+
+    if (res < 0) {
+        return (res);
+    }
+
+    if (left == *size_p) {
+        return (1);
+    }
+
+    *size_p -= left;
+
+    return (0);
+}
+
+static int patch_reader_lzma_destroy(
+    struct detools_apply_patch_patch_reader_t *self_p)
+{
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+
+    lzma_p = &self_p->compression.lzma;
+
+    if ((lzma_p->state >= detools_lzma_state_packet_t)
+        && (lzma_p->match_left == 0)) {
+        return (0);
+    } else {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+}
+
+static int patch_reader_lzma_init(
+    struct detools_apply_patch_patch_reader_t *self_p)
+{
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+
+    lzma_p = &self_p->compression.lzma;
+    lzma_p->state = detools_lzma_state_header_t;
+    lzma_p->input_size = 0;
+    lzma_p->range = 0xffffffff;
+    lzma_p->code = 0;
+    lzma_p->state_index = 0;
+    lzma_p->reps[0] = 0;
+    lzma_p->reps[1] = 0;
+    lzma_p->reps[2] = 0;
+    lzma_p->reps[3] = 0;
+    lzma_p->position = 0;
+    lzma_p->dict_pos = 0;
+    lzma_p->dict_full = false;
+    lzma_p->match_left = 0;
+
+    return (0);
+}
+
+#endif
+
+/*
+ * Compression backends, indexed by the compression number in the
+ * patch header.
+ */
+
+struct patch_reader_backend_t {
+    int (*init)(struct detools_apply_patch_patch_reader_t *self_p);
+    int (*destroy)(struct detools_apply_patch_patch_reader_t *self_p);
+    int (*decompress)(struct detools_apply_patch_patch_reader_t *self_p,
+                      uint8_t *buf_p,
+                      size_t *size_p);
+    int (*zeros)(struct detools_apply_patch_patch_reader_t *self_p,
+                 size_t *size_p);
+};
+
+static const struct patch_reader_backend_t patch_reader_backends[16] = {
+#if DETOOLS_CONFIG_COMPRESSION_NONE == 1
+    [COMPRESSION_NONE] = {
+        patch_reader_none_init,
+        patch_reader_none_destroy,
+        patch_reader_none_decompress,
+        NULL
+    },
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1
+    [COMPRESSION_LZMA] = {
+        patch_reader_lzma_init,
+        patch_reader_lzma_destroy,
+        patch_reader_lzma_decompress,
+        NULL
+    },
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_CRLE == 1
+    [COMPRESSION_CRLE] = {
+        patch_reader_crle_init,
+        patch_reader_crle_destroy,
+        patch_reader_crle_decompress,
+        patch_reader_crle_zeros
+    },
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_HEATSHRINK == 1
+    [COMPRESSION_HEATSHRINK] = {
+        patch_reader_heatshrink_init,
+        patch_reader_heatshrink_destroy,
+        patch_reader_heatshrink_decompress,
+        patch_reader_heatshrink_zeros
+    },
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    [COMPRESSION_LZ4] = {
+        patch_reader_lz4_init,
+        patch_reader_lz4_destroy,
+        patch_reader_lz4_decompress,
+        NULL
+    },
+#endif
+};
+
+static const struct patch_reader_backend_t *patch_reader_backend(int compression)
+{
+    const struct patch_reader_backend_t *backend_p;
+
+    backend_p = &patch_reader_backends[compression & 0xf];
+
+    if (backend_p->init == NULL) {
+        return (NULL);
+    }
+
+    return (backend_p);
+}
+
+/*
+ * Patch reader.
+ */
+
+/**
+ * Initialize given patch reader.
+ */
+static int patch_reader_init(struct detools_apply_patch_patch_reader_t *self_p,
+                             struct detools_apply_patch_chunk_t *patch_chunk_p,
+                             size_t patch_size,
+                             int compression)
+{
+    const struct patch_reader_backend_t *backend_p;
+
+    (void)patch_size;
+
+    self_p->patch_chunk_p = patch_chunk_p;
+    self_p->size.state = detools_unpack_usize_state_first_t;
+    self_p->peek.offset = 0;
+    self_p->peek.size = 0;
+
+    backend_p = patch_reader_backend(compression);
+
+    if (backend_p == NULL) {
+        return (-DETOOLS_BAD_COMPRESSION);
+    }
+
+    self_p->destroy = backend_p->destroy;
+    self_p->decompress = backend_p->decompress;
+    self_p->zeros = backend_p->zeros;
+
+    return (backend_p->init(self_p));
+}
+
+static int patch_reader_dump(struct detools_apply_patch_patch_reader_t *self_p,
+                             int compression,
+                             detools_state_write_t state_write)
+{
+    (void)self_p;
+    (void)compression;
+    (void)state_write;
+
+    int res;
+
+    res = 0;
+
+    return (res);
+}
+
+static int patch_reader_restore(struct detools_apply_patch_patch_reader_t *self_p,
+                                struct detools_apply_patch_patch_reader_t *dumped_p,
+                                struct detools_apply_patch_chunk_t *patch_chunk_p,
+                                int compression,
+                                detools_state_read_t state_read)
+{
+    (void)state_read;
+
+    int res;
+    const struct patch_reader_backend_t *backend_p;
+
+    res = 0;
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1
+    /* The dictionary and the probabilities are not dumped. */
+    if (compression == COMPRESSION_LZMA) {
+        return (-DETOOLS_NOT_IMPLEMENTED);
+    }
+#endif
+
+    *self_p = *dumped_p;
+    self_p->patch_chunk_p = patch_chunk_p;
+
+    backend_p = patch_reader_backend(compression);
+
+    if (backend_p == NULL) {
+        return (-DETOOLS_BAD_COMPRESSION);
+    }
+
+    self_p->destroy = backend_p->destroy;
+    self_p->decompress = backend_p->decompress;
+    self_p->zeros = backend_p->zeros;
+
+    return (res);
+}
+
+/**
+ * Try to decompress given number of bytes.
+ *
+ * @return zero(0) if at least one byte was decompressed, one(1) if
+ *         zero bytes were decompressed and more input is needed, or
+ *         negative error code.
+ */
+static int patch_reader_decompress(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    uint8_t *buf_p,
+    size_t *size_p)
+{
+    int res;
+    size_t size;
+    size_t left;
+
+    if (self_p->peek.offset == self_p->peek.size) {
+        return (self_p->decompress(self_p, buf_p, size_p));
+    }
+
+    /* Data read ahead when unpacking a size comes first, then as much
+       as is available of the rest, so the caller gets it at once. */
+    size = MIN(*size_p, self_p->peek.size - self_p->peek.offset);
+    memcpy(buf_p, &self_p->peek.buf[self_p->peek.offset], size);
+    self_p->peek.offset += size;
+    left = (*size_p - size);
+
+    if (left > 0) {
+        res = self_p->decompress(self_p, &buf_p[size], &left);
+
+        if (res < 0) {
+            return (res);
+        }
+
+        if (res == 0) {
+            size += left;
+        }
+    }
+
+    *size_p = size;
+
+    return (0);
+}
+
+/**
+ * Skip up to given number of zeros in the decompressed stream. Only
+ * backends that see zero runs without expanding them skip any.
+ *
+ * @return zero(0) with the number of skipped zeros, possibly zero, or
+ *         negative error code.
+ */
+static int patch_reader_zeros(struct detools_apply_patch_patch_reader_t *self_p,
+                              size_t *size_p)
+{
+    if ((self_p->zeros == NULL)
+        || (self_p->peek.offset != self_p->peek.size)) {
+        *size_p = 0;
+
+        return (0);
+    }
+
+    return (self_p->zeros(self_p, size_p));
+}
+
+/**
+ * Read ahead into the empty peek buffer.
+ */
+static int patch_reader_peek(struct detools_apply_patch_patch_reader_t *self_p)
+{
+    int res;
+    size_t size;
+
+    size = sizeof(self_p->peek.buf);
+    res = self_p->decompress(self_p, &self_p->peek.buf[0], &size);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    self_p->peek.offset = 0;
+    self_p->peek.size = size;
+
+    return (res);
+}
+
+/**
+ * Unpack a size value. Bytes are taken from the peek buffer, which
+ * is refilled when empty, instead of decompressing them one at a
+ * time. The unpacking resumes where it stopped if the patch data
+ * runs out.
+ */
+static int patch_reader_unpack_size(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    int *size_p)
+{
+    int res;
+    uint8_t byte;
+
+    res = 0;
+
+    do {
+        if (self_p->peek.offset == self_p->peek.size) {
+            res = patch_reader_peek(self_p);
+
+            if (res != 0) {
+                return (res);
+            }
+        }
+
+        byte = self_p->peek.buf[self_p->peek.offset];
+        self_p->peek.offset++;
+
+        switch (self_p->size.state) {
+
+        case detools_unpack_usize_state_first_t:
+            self_p->size.is_signed = ((byte & 0x40) == 0x40);
+            self_p->size.value = (byte & 0x3f);
+            self_p->size.offset = 6;
+            self_p->size.state = detools_unpack_usize_state_consecutive_t;
+            break;
+
+        case detools_unpack_usize_state_consecutive_t:
+            if (is_overflow(self_p->size.offset)) {
+                return (-DETOOLS_CORRUPT_PATCH_OVERFLOW);
+            }
+
+            self_p->size.value |= ((byte & 0x7f) << self_p->size.offset);
+            self_p->size.offset += 7;
+            break;
+
+        default:
+            return (-DETOOLS_INTERNAL_ERROR);
+        }
+    } while ((byte & 0x80) != 0);
+
+    /* Done, fix sign. */
+    self_p->size.state = detools_unpack_usize_state_first_t;
+
+    if (self_p->size.is_signed) {
+        self_p->size.value *= -1;
+    }
+
+    *size_p = self_p->size.value;
+
+    return (res);
+}
+
+static int common_process_size(
+    struct detools_apply_patch_patch_reader_t *patch_reader_p,
+    size_t to_pos,
+    size_t to_size,
+    int *size_p)
+{
+    int res;
+
+    res = patch_reader_unpack_size(patch_reader_p, size_p);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    if (to_pos + (size_t)*size_p > to_size) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+
+    return (res);
+}
+
+/*
+ * ARM Cortex-M data format.
+ */
+
+#if DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M == 1
+
+/* The address map and the from-data window are kept out of the apply
+   patch object, which is often on the stack. Only one patch with a
+   data format is applied at a time. */
+static struct {
+    struct detools_data_format_segment_t segments[
+        DETOOLS_CONFIG_DATA_FORMAT_MAX_SEGMENTS];
+    uint8_t window[DETOOLS_CONFIG_DATA_BUFFER_SIZE
+                   + 2 * DETOOLS_DATA_FORMAT_CONTEXT_SIZE];
+} data_format_arena ARENA;
+
+static uint16_t data_format_get_16(const uint8_t *buf_p)
+{
+    return ((uint16_t)(buf_p[0] | (buf_p[1] << 8)));
+}
+
+static uint32_t data_format_get_32(const uint8_t *buf_p)
+{
+    return ((uint32_t)data_format_get_16(&buf_p[0])
+            | ((uint32_t)data_format_get_16(&buf_p[2]) << 16));
+}
+
+static void data_format_put_16(uint8_t *buf_p, uint16_t value)
+{
+    buf_p[0] = (uint8_t)value;
+    buf_p[1] = (uint8_t)(value >> 8);
+}
+
+static void data_format_put_32(uint8_t *buf_p, uint32_t value)
+{
+    data_format_put_16(&buf_p[0], (uint16_t)value);
+    data_format_put_16(&buf_p[2], (uint16_t)(value >> 16));
+}
+
+static bool data_format_is_bl_first(uint16_t value)
+{
+    return ((value & 0xf800) == 0xf000);
+}
+
+static bool data_format_is_bl_second(uint16_t value)
+{
+    return ((value & 0xd000) == 0xd000);
+}
+
+/**
+ * A BL instruction at given offset, unless the previous halfword may
+ * also be the first half of one, as only one of them can be.
+ */
+static bool data_format_is_bl(const uint8_t *buf_p, int size, int offset)
+{
+    if ((offset < 0) || (offset + 4 > size)) {
+        return (false);
+    }
+
+    if (!data_format_is_bl_first(data_format_get_16(&buf_p[offset]))
+        || !data_format_is_bl_second(data_format_get_16(&buf_p[offset + 2]))) {
+        return (false);
+    }
+
+    if (offset >= 2) {
+        return (!data_format_is_bl_first(data_format_get_16(&buf_p[offset - 2])));
+    }
+
+    return (true);
+}
+
+/**
+ * Find the shift of given address. Returns false if not in any
+ * segment.
+ */
+static bool data_format_shift(struct detools_data_format_arm_cortex_m_t *self_p,
+                              uint32_t address,
+                              int32_t *shift_p)
+{
+    int low;
+    int high;
+    int middle;
+    struct detools_data_format_segment_t *segment_p;
+
+    low = 0;
+    high = self_p->number_of_segments;
+
+    while (low < high) {
+        middle = ((low + high) / 2);
+        segment_p = &self_p->segments_p[middle];
+
+        if (address < segment_p->begin) {
+            high = middle;
+        } else if (address - segment_p->begin >= segment_p->size) {
+            low = middle + 1;
+        } else {
+            *shift_p = segment_p->shift;
+
+            return (true);
+        }
+    }
+
+    return (false);
+}
+
+static bool data_format_relocate_bl(struct detools_data_format_arm_cortex_m_t *self_p,
+                                    uint8_t *buf_p,
+                                    uint32_t address)
+{
+    uint16_t upper;
+    uint16_t lower;
+    uint32_t s;
+    uint32_t i1;
+    uint32_t i2;
+    int32_t offset;
+    int32_t from_shift;
+    int32_t to_shift;
+
+    upper = data_format_get_16(&buf_p[0]);
+    lower = data_format_get_16(&buf_p[2]);
+    s = ((upper >> 10) & 1);
+    i1 = (((lower >> 13) & 1) ^ s ^ 1);
+    i2 = (((lower >> 11) & 1) ^ s ^ 1);
+    offset = (int32_t)((s << 24)
+                       | (i1 << 23)
+                       | (i2 << 22)
+                       | ((uint32_t)(upper & 0x3ff) << 12)
+                       | ((uint32_t)(lower & 0x7ff) << 1));
+
+    if (s == 1) {
+        offset -= (1 << 25);
+    }
+
+    if (!data_format_shift(self_p, address, &from_shift)
+        || !data_format_shift(self_p, address + 4 + (uint32_t)offset, &to_shift)
+        || (to_shift == from_shift)) {
+        return (false);
+    }
+
+    offset += (to_shift - from_shift);
+
+    if ((offset < -(1 << 24)) || (offset >= (1 << 24))) {
+        return (false);
+    }
+
+    s = (((uint32_t)offset >> 24) & 1);
+    i1 = (((uint32_t)offset >> 23) & 1);
+    i2 = (((uint32_t)offset >> 22) & 1);
+    data_format_put_16(&buf_p[0],
+                       (uint16_t)(0xf000
+                                  | (s << 10)
+                                  | (((uint32_t)offset >> 12) & 0x3ff)));
+    data_format_put_16(&buf_p[2],
+                       (uint16_t)(0xd000
+                                  | ((i1 ^ s ^ 1) << 13)
+                                  | ((i2 ^ s ^ 1) << 11)
+                                  | (((uint32_t)offset >> 1) & 0x7ff)));
+
+    return (true);
+}
+
+static bool data_format_relocate_pointer(
+    struct detools_data_format_arm_cortex_m_t *self_p,
+    uint8_t *buf_p)
+{
+    uint32_t value;
+    int32_t shift;
+
+    value = data_format_get_32(buf_p);
+
+    /* Function pointers have the Thumb bit set. */
+    if (!data_format_shift(self_p, value & ~1u, &shift) || (shift == 0)) {
+        return (false);
+    }
+
+    data_format_put_32(buf_p, value + (uint32_t)shift);
+
+    return (true);
+}
+
+/**
+ * Relocate the from-data in buf_p, starting at given from-data
+ * offset. Only window bytes begin to end are written to dst_p.
+ */
+static void data_format_transform(
+    struct detools_data_format_arm_cortex_m_t *self_p,
+    const uint8_t *buf_p,
+    int size,
+    size_t offset,
+    int begin,
+    int end,
+    uint8_t *dst_p)
+{
+    int i;
+    int j;
+    uint32_t address;
+    uint8_t value[4];
+    bool relocated;
+
+    memcpy(dst_p, &buf_p[begin], (size_t)(end - begin));
+
+    for (i = MAX(begin - 3, 0); i < end; i++) {
+        address = (self_p->from_address + (uint32_t)(offset + (size_t)i));
+
+        if ((address % 2) != 0) {
+            continue;
+        }
+
+        memcpy(&value[0], &buf_p[i], MIN(sizeof(value), (size_t)(size - i)));
+
+        if (data_format_is_bl(buf_p, size, i)) {
+            relocated = data_format_relocate_bl(self_p, &value[0], address);
+        } else if (((address % 4) == 0)
+                   && (i + 4 <= size)
+                   && !data_format_is_bl(buf_p, size, i - 2)
+                   && !data_format_is_bl(buf_p, size, i + 2)) {
+            relocated = data_format_relocate_pointer(self_p, &value[0]);
+        } else {
+            relocated = false;
+        }
+
+        if (!relocated) {
+            continue;
+        }
+
+        for (j = MAX(i, begin); j < MIN(i + 4, end); j++) {
+            dst_p[j - begin] = value[j - i];
+        }
+    }
+}
+
+static void data_format_init(struct detools_data_format_arm_cortex_m_t *self_p,
+                             int size)
+{
+    self_p->left = size;
+    self_p->field = 0;
+    self_p->size.first = true;
+    self_p->number_of_segments = 0;
+    self_p->segments_p = &data_format_arena.segments[0];
+}
+
+static int data_format_set_field(
+    struct detools_data_format_arm_cortex_m_t *self_p,
+    int32_t value)
+{
+    struct detools_data_format_segment_t *segment_p;
+    int index;
+
+    switch (self_p->field) {
+
+    case 0:
+        if (value != DETOOLS_DATA_FORMAT_ARM_CORTEX_M) {
+            return (-DETOOLS_NOT_IMPLEMENTED);
+        }
+
+        break;
+
+    case 1:
+        self_p->from_address = (uint32_t)value;
+        break;
+
+    case 2:
+        self_p->from_size = (uint32_t)value;
+        break;
+
+    case 3:
+        if ((value < 0) || (value > DETOOLS_CONFIG_DATA_FORMAT_MAX_SEGMENTS)) {
+            return (-DETOOLS_OUT_OF_MEMORY);
+        }
+
+        self_p->number_of_segments = value;
+        break;
+
+    default:
+        index = ((self_p->field - 4) / 3);
+
+        if (index >= self_p->number_of_segments) {
+            return (-DETOOLS_CORRUPT_PATCH);
+        }
+
+        segment_p = &self_p->segments_p[index];
+
+        switch ((self_p->field - 4) % 3) {
+
+        case 0:
+            segment_p->begin = (uint32_t)value;
+
+            if (index > 0) {
+                segment_p->begin += (segment_p[-1].begin + segment_p[-1].size);
+            }
+
+            break;
+
+        case 1:
+            segment_p->size = (uint32_t)value;
+            break;
+
+        default:
+            segment_p->shift = value;
+            break;
+        }
+
+        break;
+    }
+
+    self_p->field++;
+
+    return (0);
+}
+
+/**
+ * Unpack sizes of up to 32 bits, as addresses does not fit in
+ * patch_reader_unpack_size().
+ */
+static int data_format_unpack(struct detools_data_format_arm_cortex_m_t *self_p,
+                              uint8_t byte)
+{
+    uint32_t value;
+
+    if (self_p->size.first) {
+        self_p->size.is_signed = ((byte & 0x40) == 0x40);
+        self_p->size.value = (byte & 0x3f);
+        self_p->size.offset = 6;
+        self_p->size.first = false;
+    } else {
+        if ((self_p->size.offset > 27)
+            || ((self_p->size.offset == 27) && ((byte & 0x7f) > 0x1f))) {
+            return (-DETOOLS_CORRUPT_PATCH_OVERFLOW);
+        }
+
+        value = ((uint32_t)(byte & 0x7f) << self_p->size.offset);
+        self_p->size.value = (int)((uint32_t)self_p->size.value | value);
+        self_p->size.offset += 7;
+    }
+
+    if ((byte & 0x80) != 0) {
+        return (0);
+    }
+
+    self_p->size.first = true;
+    value = (uint32_t)self_p->size.value;
+
+    if (self_p->size.is_signed) {
+        value = (0 - value);
+    }
+
+    return (data_format_set_field(self_p, (int32_t)value));
+}
+
+/**
+ * Read relocated from-data. The from-data around the read is needed
+ * to find instructions and pointers crossing its edges.
+ */
+static int data_format_from_read(struct detools_apply_patch_t *self_p,
+                                 uint8_t *buf_p,
+                                 size_t size)
+{
+    struct detools_data_format_arm_cortex_m_t *data_format_p;
+    uint8_t *window_p;
+    size_t offset;
+    size_t before;
+    size_t after;
+    int res;
+
+    data_format_p = &self_p->data_format;
+    window_p = &data_format_arena.window[0];
+
+    if ((self_p->from_offset < 0) || (size > DETOOLS_CONFIG_DATA_BUFFER_SIZE)) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+
+    offset = (size_t)self_p->from_offset;
+    before = MIN(offset, DETOOLS_DATA_FORMAT_CONTEXT_SIZE);
+    after = 0;
+
+    if (offset + size < data_format_p->from_size) {
+        after = MIN(data_format_p->from_size - (offset + size),
+                    DETOOLS_DATA_FORMAT_CONTEXT_SIZE);
+    }
+
+    if (before > 0) {
+        res = self_p->from_seek(self_p->arg_p, -(int)before);
+
+        if (res != 0) {
+            return (res);
+        }
+    }
+
+    res = self_p->from_read(self_p->arg_p, window_p, before + size + after);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    if (after > 0) {
+        res = self_p->from_seek(self_p->arg_p, -(int)after);
+
+        if (res != 0) {
+            return (res);
+        }
+    }
+
+    data_format_transform(data_format_p,
+                          window_p,
+                          (int)(before + size + after),
+                          offset - before,
+                          (int)before,
+                          (int)(before + size),
+                          buf_p);
+
+    return (0);
+}
+
+#endif
+
+/*
+ * Low level sequential patch type functionality.
+ */
+
+static int process_init(struct detools_apply_patch_t *self_p)
+{
+    int patch_type;
+    uint8_t byte;
+    int res;
+    int to_size;
+
+    if (chunk_get(&self_p->chunk, &byte) != 0) {
+        return (-DETOOLS_SHORT_HEADER);
+    }
+
+    patch_type = ((byte >> 4) & 0x7);
+    self_p->compression = (byte & 0xf);
+
+    if (patch_type != PATCH_TYPE_SEQUENTIAL) {
+        return (-DETOOLS_BAD_PATCH_TYPE);
+    }
+
+    res = chunk_unpack_header_size(&self_p->chunk, &to_size);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    res = patch_reader_init(&self_p->patch_reader,
+                            &self_p->chunk,
+                            self_p->patch_size - self_p->chunk.offset,
+                            self_p->compression);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    if (to_size < 0) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+
+    self_p->to_offset = 0;
+    self_p->to_size = (size_t)to_size;
+
+    if (to_size > 0) {
+        self_p->state = detools_apply_patch_state_dfpatch_size_t;
+    } else {
+        self_p->state = detools_apply_patch_state_done_t;
+    }
+
+    return (res);
+}
+
+static int process_dfpatch_size(struct detools_apply_patch_t *self_p)
+{
+    int res;
+    int size;
+
+    res = patch_reader_unpack_size(&self_p->patch_reader, &size);
+
+    if (res != 0) {
+        return (res);
+    }
+
+#if DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M == 1
+    data_format_init(&self_p->data_format, 0);
+
+    if (size > 0) {
+        data_format_init(&self_p->data_format, size);
+        self_p->state = detools_apply_patch_state_dfpatch_data_t;
+
+        return (0);
+    }
+#else
+    if (size > 0) {
+        return (-DETOOLS_NOT_IMPLEMENTED);
+    }
+#endif
+
+    self_p->state = detools_apply_patch_state_diff_size_t;
+
+    return (0);
+}
+
+#if DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M == 1
+
+static int process_dfpatch_data(struct detools_apply_patch_t *self_p)
+{
+    struct detools_data_format_arm_cortex_m_t *data_format_p;
+    int res;
+    uint8_t byte;
+    size_t size;
+
+    data_format_p = &self_p->data_format;
+
+    while (data_format_p->left > 0) {
+        size = 1;
+        res = patch_reader_decompress(&self_p->patch_reader, &byte, &size);
+
+        if (res != 0) {
+            return (res);
+        }
+
+        data_format_p->left--;
+        res = data_format_unpack(data_format_p, byte);
+
+        if (res != 0) {
+            return (res);
+        }
+    }
+
+    if (!data_format_p->size.first
+        || (data_format_p->field < 4)
+        || (data_format_p->field != 4 + 3 * data_format_p->number_of_segments)) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+
+    self_p->state = detools_apply_patch_state_diff_size_t;
+
+    return (0);
+}
+
+#endif
+
+static int process_size(struct detools_apply_patch_t *self_p,
+                        enum detools_apply_patch_state_t next_state)
+{
+    int res;
+    int size;
+
+    res = common_process_size(&self_p->patch_reader,
+                              self_p->to_offset,
+                              self_p->to_size,
+                              &size);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    self_p->state = next_state;
+    self_p->chunk_size = (size_t)size;
+
+    return (res);
+}
+
+/**
+ * Read given number of bytes from the from-data, through the data
+ * format address map if there is one.
+ */
+static int process_from_read(struct detools_apply_patch_t *self_p,
+                             uint8_t *buf_p,
+                             size_t size)
+{
+    int res;
+
+#if DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M == 1
+    if (self_p->data_format.number_of_segments > 0) {
+        res = data_format_from_read(self_p, buf_p, size);
+    } else {
+        res = self_p->from_read(self_p->arg_p, buf_p, size);
+    }
+#else
+    res = self_p->from_read(self_p->arg_p, buf_p, size);
+#endif
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    self_p->from_offset += size;
+
+    return (0);
+}
+
+static int process_data(struct detools_apply_patch_t *self_p,
+                        enum detools_apply_patch_state_t next_state)
+{
+    int res;
+    size_t i;
+    uint8_t *to_p;
+    size_t to_size;
+    uint8_t *from_p;
+
+    to_p = &self_p->to[0];
+    from_p = &self_p->from[0];
+
+    /* All of the data if the patch data lasts, otherwise resumed in
+       the next call. */
+    while (self_p->chunk_size > 0) {
+        to_size = MIN(sizeof(self_p->to), self_p->chunk_size);
+
+        if (next_state == detools_apply_patch_state_extra_size_t) {
+            res = patch_reader_zeros(&self_p->patch_reader, &to_size);
+
+            if (res != 0) {
+                return (res);
+            }
+
+            if (to_size > 0) {
+                /* Unchanged data is copied straight from the
+                   from-data. */
+                res = process_from_read(self_p, to_p, to_size);
+            } else {
+                to_size = MIN(sizeof(self_p->to), self_p->chunk_size);
+                res = patch_reader_decompress(&self_p->patch_reader,
+                                              to_p,
+                                              &to_size);
+
+                if (res != 0) {
+                    return (res);
+                }
+
+                res = process_from_read(self_p, from_p, to_size);
+
+                for (i = 0; i < to_size; i++) {
+                    to_p[i] = (uint8_t)(to_p[i] + from_p[i]);
+                }
+            }
+
+            if (res != 0) {
+                return (res);
+            }
+        } else {
+            res = patch_reader_decompress(&self_p->patch_reader,
+                                          to_p,
+                                          &to_size);
+
+            if (res != 0) {
+                return (res);
+            }
+        }
+
+        self_p->to_offset += to_size;
+        self_p->chunk_size -= to_size;
+
+        res = self_p->to_write(self_p->arg_p, to_p, to_size);
+
+        if (res != 0) {
+            return (-DETOOLS_IO_FAILED);
+        }
+    }
+
+    self_p->state = next_state;
+
+    return (0);
+}
+
+static int process_diff_size(struct detools_apply_patch_t *self_p)
+{
+    return (process_size(self_p, detools_apply_patch_state_diff_data_t));
+}
+
+static int process_diff_data(struct detools_apply_patch_t *self_p)
+{
+    return (process_data(self_p, detools_apply_patch_state_extra_size_t));
+}
+
+static int process_extra_size(struct detools_apply_patch_t *self_p)
+{
+    return (process_size(self_p, detools_apply_patch_state_extra_data_t));
+}
+
+static int process_extra_data(struct detools_apply_patch_t *self_p)
+{
+    return (process_data(self_p, detools_apply_patch_state_adjustment_t));
+}
+
+static int process_adjustment(struct detools_apply_patch_t *self_p)
+{
+    int res;
+    int offset;
+
+    res = patch_reader_unpack_size(&self_p->patch_reader, &offset);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    res = self_p->from_seek(self_p->arg_p, offset);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    self_p->from_offset += offset;
+
+    if (self_p->to_offset == self_p->to_size) {
+        self_p->state = detools_apply_patch_state_done_t;
+    } else {
+        self_p->state = detools_apply_patch_state_diff_size_t;
+    }
+
+    return (res);
+}
+
+/**
+ * Run records, diff size and data, extra size and data and
+ * adjustment, back to back without returning to the state dispatch.
+ * A step that runs out of patch data keeps its state, and the record
+ * is finished one step at a time in the next call.
+ */
+static int process_records(struct detools_apply_patch_t *self_p)
+{
+    int res;
+
+    do {
+        res = process_diff_size(self_p);
+
+        if (res == 0) {
+            res = process_diff_data(self_p);
+        }
+
+        if (res == 0) {
+            res = process_extra_size(self_p);
+        }
+
+        if (res == 0) {
+            res = process_extra_data(self_p);
+        }
+
+        if (res == 0) {
+            res = process_adjustment(self_p);
+        }
+    } while ((res == 0)
+             && (self_p->state == detools_apply_patch_state_diff_size_t));
+
+    return (res);
+}
+
+/**
+ * Patch data after the last record may only end the compressed
+ * stream, as the LZMA end marker does.
+ */
+static int process_done(struct detools_apply_patch_t *self_p)
+{
+    int res;
     uint8_t byte;
+    size_t size;
+
+    if (!chunk_available(&self_p->chunk)) {
+        return (-DETOOLS_ALREADY_DONE);
+    }
+
+    size = 1;
+    res = patch_reader_decompress(&self_p->patch_reader, &byte, &size);
+
+    if (res == 0) {
+        res = -DETOOLS_ALREADY_DONE;
+    }
+
+    return (res);
+}
+
+static int apply_patch_process_once(struct detools_apply_patch_t *self_p)
+{
+    int res;
+
+    switch (self_p->state) {
+
+    case detools_apply_patch_state_init_t:
+        res = process_init(self_p);
+        break;
+
+    case detools_apply_patch_state_dfpatch_size_t:
+        res = process_dfpatch_size(self_p);
+        break;
+
+#if DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M == 1
+    case detools_apply_patch_state_dfpatch_data_t:
+        res = process_dfpatch_data(self_p);
+        break;
+#endif
+
+    case detools_apply_patch_state_diff_size_t:
+        res = process_records(self_p);
+        break;
+
+    case detools_apply_patch_state_diff_data_t:
+        res = process_diff_data(self_p);
+        break;
+
+    case detools_apply_patch_state_extra_size_t:
+        res = process_extra_size(self_p);
+        break;
+
+    case detools_apply_patch_state_extra_data_t:
+        res = process_extra_data(self_p);
+        break;
+
+    case detools_apply_patch_state_adjustment_t:
+        res = process_adjustment(self_p);
+        break;
+
+    case detools_apply_patch_state_done_t:
+        res = process_done(self_p);
+        break;
+
+    case detools_apply_patch_state_failed_t:
+        res = -DETOOLS_ALREADY_FAILED;
+        break;
+
+    default:
+        res = -DETOOLS_INTERNAL_ERROR;
+        break;
+    }
+
+    if (res < 0) {
+        self_p->state = detools_apply_patch_state_failed_t;
+    }
+
+    return (res);
+}
+
+static int apply_patch_common_finalize(
+    int res,
+    struct detools_apply_patch_patch_reader_t *patch_reader_p,
+    size_t to_size)
+{
+    if (res == 1) {
+        res = -DETOOLS_NOT_ENOUGH_PATCH_DATA;
+    }
+
+    if (res == -DETOOLS_ALREADY_DONE) {
+        res = 0;
+    }
+
+    /* Nothing may be left after the last record. */
+    if ((res == 0) && (patch_reader_p->peek.offset < patch_reader_p->peek.size)) {
+        res = -DETOOLS_CORRUPT_PATCH;
+    }
+
+    if (patch_reader_p->destroy != NULL) {
+        if (res == 0) {
+            res = patch_reader_p->destroy(patch_reader_p);
+        } else {
+            (void)patch_reader_p->destroy(patch_reader_p);
+        }
+    }
+
+    if (res == 0) {
+        res = (int)to_size;
+    }
+
+    return (res);
+}
+
+int detools_apply_patch_init(struct detools_apply_patch_t *self_p,
+                             detools_read_t from_read,
+                             detools_seek_t from_seek,
+                             size_t patch_size,
+                             detools_write_t to_write,
+                             void *arg_p)
+{
+    self_p->from_read = from_read;
+    self_p->from_seek = from_seek;
+    self_p->patch_size = patch_size;
+    self_p->patch_offset = 0;
+    self_p->to_write = to_write;
+    self_p->from_offset = 0;
+    self_p->arg_p = arg_p;
+    self_p->state = detools_apply_patch_state_init_t;
+    self_p->patch_reader.destroy = NULL;
+#if DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M == 1
+    data_format_init(&self_p->data_format, 0);
+#endif
+
+    return (0);
+}
+
+int detools_apply_patch_dump(struct detools_apply_patch_t *self_p,
+                             detools_state_write_t state_write)
+{
     int res;
-    int to_size;
 
-    if (chunk_get(&self_p->chunk, &byte) != 0) {
-        return (-DETOOLS_SHORT_HEADER);
+    res = state_write(self_p->arg_p, self_p, sizeof(*self_p));
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
     }
 
-    patch_type = ((byte >> 4) & 0x7);
-    self_p->compression = (byte & 0xf);
+    if (self_p->state == detools_apply_patch_state_init_t) {
+        return (0);
+    }
 
-    if (patch_type != PATCH_TYPE_SEQUENTIAL) {
-        return (-DETOOLS_BAD_PATCH_TYPE);
+#if DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M == 1
+    res = state_write(self_p->arg_p,
+                      self_p->data_format.segments_p,
+                      sizeof(*self_p->data_format.segments_p)
+                      * (size_t)self_p->data_format.number_of_segments);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
     }
+#endif
 
-    res = chunk_unpack_header_size(&self_p->chunk, &to_size);
+    return (patch_reader_dump(&self_p->patch_reader,
+                              self_p->compression,
+                              state_write));
+}
+
+int detools_apply_patch_restore(struct detools_apply_patch_t *self_p,
+                                detools_state_read_t state_read)
+{
+    int res;
+    struct detools_apply_patch_t dumped;
+
+    res = state_read(self_p->arg_p, &dumped, sizeof(dumped));
 
     if (res != 0) {
-        return (res);
+        return (-DETOOLS_IO_FAILED);
     }
 
-    res = patch_reader_init(&self_p->patch_reader,
-                            &self_p->chunk,
-                            self_p->patch_size - self_p->chunk.offset,
-                            self_p->compression);
+    self_p->state = dumped.state;
+    self_p->patch_size = dumped.patch_size;
+
+    if (self_p->state == detools_apply_patch_state_init_t) {
+        return (0);
+    }
+
+    self_p->compression = dumped.compression;
+    self_p->patch_offset = dumped.patch_offset;
+    self_p->to_offset = dumped.to_offset;
+    self_p->to_size = dumped.to_size;
+    self_p->from_offset = dumped.from_offset;
+    self_p->chunk_size = dumped.chunk_size;
+#if DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M == 1
+    self_p->data_format = dumped.data_format;
+    self_p->data_format.segments_p = &data_format_arena.segments[0];
+
+    if ((self_p->data_format.number_of_segments < 0)
+        || (self_p->data_format.number_of_segments
+            > DETOOLS_CONFIG_DATA_FORMAT_MAX_SEGMENTS)) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+
+    res = state_read(self_p->arg_p,
+                     self_p->data_format.segments_p,
+                     sizeof(*self_p->data_format.segments_p)
+                     * (size_t)self_p->data_format.number_of_segments);
 
     if (res != 0) {
-        return (res);
+        return (-DETOOLS_IO_FAILED);
     }
+#endif
 
-    if (to_size < 0) {
+    res = self_p->from_seek(self_p->arg_p, self_p->from_offset);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    return (patch_reader_restore(&self_p->patch_reader,
+                                 &dumped.patch_reader,
+                                 &self_p->chunk,
+                                 self_p->compression,
+                                 state_read));
+}
+
+size_t detools_apply_patch_get_patch_offset(struct detools_apply_patch_t *self_p)
+{
+    return (self_p->patch_offset);
+}
+
+size_t detools_apply_patch_get_to_offset(struct detools_apply_patch_t *self_p)
+{
+    return (self_p->to_offset);
+}
+
+int detools_apply_patch_process(struct detools_apply_patch_t *self_p,
+                                const uint8_t *patch_p,
+                                size_t size)
+{
+    int res;
+
+    res = 0;
+    self_p->patch_offset += size;
+    self_p->chunk.buf_p = patch_p;
+    self_p->chunk.size = size;
+    self_p->chunk.offset = 0;
+
+    while (chunk_available(&self_p->chunk) && (res >= 0)) {
+        res = apply_patch_process_once(self_p);
+    }
+
+    if (res == 1) {
+        res = 0;
+    }
+
+    return (res);
+}
+
+int detools_apply_patch_finalize(struct detools_apply_patch_t *self_p)
+{
+    int res;
+
+    self_p->chunk.size = 0;
+    self_p->chunk.offset = 0;
+
+    do {
+        res = apply_patch_process_once(self_p);
+    } while (res == 0);
+
+    return (apply_patch_common_finalize(res,
+                                        &self_p->patch_reader,
+                                        self_p->to_size));
+}
+
+/*
+ * In-place patch type functionality.
+ *
+ * The from-data is first shifted shift_size bytes towards the end of
+ * the memory, starting with the last segment. Then the to-data is
+ * written one segment at a time from the start of the memory. Each
+ * segment is a sequential patch against the from-data that has not
+ * yet been overwritten. The step is saved after every shifted and
+ * every written segment, so an interrupted patching can be resumed.
+ */
+
+static int in_place_from_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+    struct detools_apply_patch_in_place_t *self_p;
+    int res;
+
+    self_p = (struct detools_apply_patch_in_place_t *)arg_p;
+
+    if (self_p->from_pos + size > self_p->memory_size) {
         return (-DETOOLS_CORRUPT_PATCH);
     }
 
-    self_p->to_offset = 0;
-    self_p->to_size = (size_t)to_size;
+    /* The output of skipped segments is discarded. */
+    if (self_p->skip_segment) {
+        res = 0;
+    } else {
+        res = self_p->mem_read(self_p->arg_p, buf_p, self_p->from_pos, size);
+    }
 
-    if (to_size > 0) {
-        self_p->state = detools_apply_patch_state_dfpatch_size_t;
+    self_p->from_pos += size;
+
+    return (res);
+}
+
+static int in_place_from_seek(void *arg_p, int offset)
+{
+    struct detools_apply_patch_in_place_t *self_p;
+
+    self_p = (struct detools_apply_patch_in_place_t *)arg_p;
+    self_p->from_pos += offset;
+
+    return (0);
+}
+
+static int in_place_to_write(void *arg_p, const uint8_t *buf_p, size_t size)
+{
+    struct detools_apply_patch_in_place_t *self_p;
+    int res;
+
+    self_p = (struct detools_apply_patch_in_place_t *)arg_p;
+
+    if (self_p->skip_segment) {
+        res = 0;
     } else {
-        self_p->state = detools_apply_patch_state_done_t;
+        res = self_p->mem_write(self_p->arg_p,
+                                self_p->to_pos,
+                                (void *)buf_p,
+                                size);
     }
 
+    self_p->to_pos += size;
+
     return (res);
 }
 
-static int process_dfpatch_size(struct detools_apply_patch_t *self_p)
+static int in_place_step_set(struct detools_apply_patch_in_place_t *self_p,
+                             int step)
 {
     int res;
-    int size;
 
-    res = patch_reader_unpack_size(&self_p->patch_reader, &size);
+    res = self_p->step_set(self_p->arg_p, step);
 
     if (res != 0) {
-        return (res);
+        return (-DETOOLS_STEP_SET_FAILED);
     }
 
-    if (size > 0) {
-        return (-DETOOLS_NOT_IMPLEMENTED);
+    self_p->step = step;
+
+    return (0);
+}
+
+static int in_place_shift(struct detools_apply_patch_in_place_t *self_p)
+{
+    int res;
+    int i;
+    uintptr_t src;
+    size_t size;
+    size_t offset;
+    size_t shifted_size;
+    size_t left;
+    uint8_t buf[128];
+
+    shifted_size = MIN(self_p->from_size,
+                       self_p->memory_size - self_p->shift_size);
+
+    if (self_p->shift_size == 0) {
+        self_p->number_of_shift_steps = 0;
+    } else {
+        self_p->number_of_shift_steps = (int)DIV_CEIL(shifted_size,
+                                                      self_p->segment_size);
     }
 
-    self_p->state = detools_apply_patch_state_diff_size_t;
+    /* Last segment first, as the destination overlaps the source. */
+    for (i = self_p->step; i < self_p->number_of_shift_steps; i++) {
+        src = ((size_t)(self_p->number_of_shift_steps - 1 - i)
+               * self_p->segment_size);
+        size = MIN(self_p->segment_size, shifted_size - src);
+
+        res = self_p->mem_erase(self_p->arg_p,
+                                src + self_p->shift_size,
+                                self_p->segment_size);
+
+        if (res != 0) {
+            return (-DETOOLS_IO_FAILED);
+        }
+
+        for (offset = 0; offset < size; offset += left) {
+            left = MIN(sizeof(buf), size - offset);
+            res = self_p->mem_read(self_p->arg_p,
+                                   &buf[0],
+                                   src + offset,
+                                   left);
+
+            if (res != 0) {
+                return (-DETOOLS_IO_FAILED);
+            }
+
+            res = self_p->mem_write(self_p->arg_p,
+                                    src + self_p->shift_size + offset,
+                                    &buf[0],
+                                    left);
+
+            if (res != 0) {
+                return (-DETOOLS_IO_FAILED);
+            }
+        }
+
+        res = in_place_step_set(self_p, i + 1);
+
+        if (res != 0) {
+            return (res);
+        }
+    }
 
     return (0);
 }
 
-static int process_size(struct detools_apply_patch_t *self_p,
-                        enum detools_apply_patch_state_t next_state)
+static int in_place_segment_start(struct detools_apply_patch_in_place_t *self_p)
 {
     int res;
-    int size;
+    struct detools_apply_patch_t *apply_patch_p;
 
-    res = common_process_size(&self_p->patch_reader,
-                              self_p->to_offset,
-                              self_p->to_size,
-                              &size);
+    apply_patch_p = &self_p->apply_patch;
+    self_p->to_pos = ((size_t)self_p->segment * self_p->segment_size);
+    self_p->from_pos = MAX(self_p->to_pos + self_p->segment_size,
+                           self_p->shift_size);
+    self_p->skip_segment = ((self_p->number_of_shift_steps + self_p->segment)
+                            < self_p->step);
 
-    if (res != 0) {
-        return (res);
+    if (!self_p->skip_segment) {
+        res = self_p->mem_erase(self_p->arg_p,
+                                self_p->to_pos,
+                                self_p->segment_size);
+
+        if (res != 0) {
+            return (-DETOOLS_IO_FAILED);
+        }
     }
 
-    self_p->state = next_state;
-    self_p->chunk_size = (size_t)size;
+    apply_patch_p->to_offset = 0;
+    apply_patch_p->to_size = MIN(self_p->segment_size,
+                                 self_p->to_size - self_p->to_pos);
+    apply_patch_p->from_offset = 0;
+    apply_patch_p->state = detools_apply_patch_state_dfpatch_size_t;
 
-    return (res);
+    return (0);
 }
 
-static int process_data(struct detools_apply_patch_t *self_p,
-                        enum detools_apply_patch_state_t next_state)
+static int in_place_process_init(struct detools_apply_patch_in_place_t *self_p)
 {
+    int patch_type;
+    uint8_t byte;
     int res;
+    int sizes[5];
     size_t i;
-    uint8_t to[128];
-    size_t to_size;
-    uint8_t from[128];
+    struct detools_apply_patch_t *apply_patch_p;
 
-    to_size = MIN(sizeof(to), self_p->chunk_size);
+    apply_patch_p = &self_p->apply_patch;
 
-    if (to_size == 0) {
-        self_p->state = next_state;
-
-        return (0);
+    if (chunk_get(&apply_patch_p->chunk, &byte) != 0) {
+        return (-DETOOLS_SHORT_HEADER);
     }
 
-    res = patch_reader_decompress(&self_p->patch_reader,
-                                  &to[0],
-                                  &to_size);
+    patch_type = ((byte >> 4) & 0x7);
+    apply_patch_p->compression = (byte & 0xf);
 
-    if (res != 0) {
-        return (res);
+    if (patch_type != PATCH_TYPE_IN_PLACE) {
+        return (-DETOOLS_BAD_PATCH_TYPE);
     }
 
-    if (next_state == detools_apply_patch_state_extra_size_t) {
-        res = self_p->from_read(self_p->arg_p, &from[0], to_size);
+    /* Memory, segment, shift, from and to sizes. */
+    for (i = 0; i < 5; i++) {
+        res = chunk_unpack_header_size(&apply_patch_p->chunk, &sizes[i]);
 
         if (res != 0) {
-            return (-DETOOLS_IO_FAILED);
+            return (res);
         }
 
-        self_p->from_offset += to_size;
-
-        for (i = 0; i < to_size; i++) {
-            to[i] = (uint8_t)(to[i] + from[i]);
+        if (sizes[i] < 0) {
+            return (-DETOOLS_CORRUPT_PATCH);
         }
     }
 
-    self_p->to_offset += to_size;
-    self_p->chunk_size -= to_size;
+    self_p->memory_size = (size_t)sizes[0];
+    self_p->segment_size = (size_t)sizes[1];
+    self_p->shift_size = (size_t)sizes[2];
+    self_p->from_size = (size_t)sizes[3];
+    self_p->to_size = (size_t)sizes[4];
+
+    if ((self_p->segment_size == 0)
+        || ((self_p->memory_size % self_p->segment_size) != 0)
+        || ((self_p->shift_size % self_p->segment_size) != 0)
+        || (self_p->shift_size > self_p->memory_size)
+        || (self_p->to_size > self_p->memory_size)) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
 
-    res = self_p->to_write(self_p->arg_p, &to[0], to_size);
+    res = patch_reader_init(&apply_patch_p->patch_reader,
+                            &apply_patch_p->chunk,
+                            self_p->patch_size - apply_patch_p->chunk.offset,
+                            apply_patch_p->compression);
 
     if (res != 0) {
-        return (-DETOOLS_IO_FAILED);
+        return (res);
     }
 
-    return (res);
-}
+    res = self_p->step_get(self_p->arg_p, &self_p->step);
 
-static int process_diff_size(struct detools_apply_patch_t *self_p)
-{
-    return (process_size(self_p, detools_apply_patch_state_diff_data_t));
-}
+    if (res != 0) {
+        return (-DETOOLS_STEP_GET_FAILED);
+    }
 
-static int process_diff_data(struct detools_apply_patch_t *self_p)
-{
-    return (process_data(self_p, detools_apply_patch_state_extra_size_t));
-}
+    res = in_place_shift(self_p);
 
-static int process_extra_size(struct detools_apply_patch_t *self_p)
-{
-    return (process_size(self_p, detools_apply_patch_state_extra_data_t));
-}
+    if (res != 0) {
+        return (res);
+    }
 
-static int process_extra_data(struct detools_apply_patch_t *self_p)
-{
-    return (process_data(self_p, detools_apply_patch_state_adjustment_t));
+    self_p->number_of_segments = (int)DIV_CEIL(self_p->to_size,
+                                               self_p->segment_size);
+    self_p->segment = 0;
+
+    if (self_p->number_of_segments == 0) {
+        self_p->state = detools_apply_patch_in_place_state_done_t;
+
+        return (0);
+    }
+
+    self_p->state = detools_apply_patch_in_place_state_segment_t;
+
+    return (in_place_segment_start(self_p));
 }
 
-static int process_adjustment(struct detools_apply_patch_t *self_p)
+static int in_place_process_segment(struct detools_apply_patch_in_place_t *self_p)
 {
     int res;
-    int offset;
 
-    res = patch_reader_unpack_size(&self_p->patch_reader, &offset);
+    res = apply_patch_process_once(&self_p->apply_patch);
 
     if (res != 0) {
         return (res);
     }
 
-    res = self_p->from_seek(self_p->arg_p, offset);
+    /* From-data offsets restart in every segment, which the data
+       format does not support. */
+    if (self_p->apply_patch.state == detools_apply_patch_state_dfpatch_data_t) {
+        return (-DETOOLS_NOT_IMPLEMENTED);
+    }
 
-    if (res != 0) {
-        return (-DETOOLS_IO_FAILED);
+    if (self_p->apply_patch.state != detools_apply_patch_state_done_t) {
+        return (0);
     }
 
-    self_p->from_offset += offset;
+    if (!self_p->skip_segment) {
+        res = in_place_step_set(self_p,
+                                self_p->number_of_shift_steps
+                                + self_p->segment
+                                + 1);
 
-    if (self_p->to_offset == self_p->to_size) {
-        self_p->state = detools_apply_patch_state_done_t;
-    } else {
-        self_p->state = detools_apply_patch_state_diff_size_t;
+        if (res != 0) {
+            return (res);
+        }
     }
 
-    return (res);
+    self_p->segment++;
+
+    if (self_p->segment == self_p->number_of_segments) {
+        self_p->state = detools_apply_patch_in_place_state_done_t;
+
+        return (0);
+    }
+
+    return (in_place_segment_start(self_p));
 }
 
-static int apply_patch_process_once(struct detools_apply_patch_t *self_p)
+static int apply_patch_in_place_process_once(
+    struct detools_apply_patch_in_place_t *self_p)
 {
     int res;
 
     switch (self_p->state) {
 
-    case detools_apply_patch_state_init_t:
-        res = process_init(self_p);
-        break;
-
-    case detools_apply_patch_state_dfpatch_size_t:
-        res = process_dfpatch_size(self_p);
-        break;
-
-    case detools_apply_patch_state_diff_size_t:
-        res = process_diff_size(self_p);
-        break;
-
-    case detools_apply_patch_state_diff_data_t:
-        res = process_diff_data(self_p);
-        break;
-
-    case detools_apply_patch_state_extra_size_t:
-        res = process_extra_size(self_p);
-        break;
-
-    case detools_apply_patch_state_extra_data_t:
-        res = process_extra_data(self_p);
+    case detools_apply_patch_in_place_state_init_t:
+        res = in_place_process_init(self_p);
         break;
 
-    case detools_apply_patch_state_adjustment_t:
-        res = process_adjustment(self_p);
+    case detools_apply_patch_in_place_state_segment_t:
+        res = in_place_process_segment(self_p);
         break;
 
-    case detools_apply_patch_state_done_t:
+    case detools_apply_patch_in_place_state_done_t:
         res = -DETOOLS_ALREADY_DONE;
         break;
 
-    case detools_apply_patch_state_failed_t:
+    case detools_apply_patch_in_place_state_failed_t:
         res = -DETOOLS_ALREADY_FAILED;
         break;
 
@@ -633,143 +3443,59 @@ static int apply_patch_process_once(struct detools_apply_patch_t *self_p)
     }
 
     if (res < 0) {
-        self_p->state = detools_apply_patch_state_failed_t;
-    }
-
-    return (res);
-}
-
-static int apply_patch_common_finalize(
-    int res,
-    struct detools_apply_patch_patch_reader_t *patch_reader_p,
-    size_t to_size)
-{
-    if (res == 1) {
-        res = -DETOOLS_NOT_ENOUGH_PATCH_DATA;
-    }
-
-    if (res == -DETOOLS_ALREADY_DONE) {
-        res = 0;
-    }
-
-    if (patch_reader_p->destroy != NULL) {
-        if (res == 0) {
-            res = patch_reader_p->destroy(patch_reader_p);
-        } else {
-            (void)patch_reader_p->destroy(patch_reader_p);
-        }
-    }
-
-    if (res == 0) {
-        res = (int)to_size;
+        self_p->state = detools_apply_patch_in_place_state_failed_t;
     }
 
     return (res);
 }
 
-int detools_apply_patch_init(struct detools_apply_patch_t *self_p,
-                             detools_read_t from_read,
-                             detools_seek_t from_seek,
-                             size_t patch_size,
-                             detools_write_t to_write,
-                             void *arg_p)
+int detools_apply_patch_in_place_init(
+    struct detools_apply_patch_in_place_t *self_p,
+    detools_mem_read_t mem_read,
+    detools_mem_write_t mem_write,
+    detools_mem_erase_t mem_erase,
+    detools_step_set_t step_set,
+    detools_step_get_t step_get,
+    size_t patch_size,
+    void *arg_p)
 {
-    self_p->from_read = from_read;
-    self_p->from_seek = from_seek;
+    self_p->mem_read = mem_read;
+    self_p->mem_write = mem_write;
+    self_p->mem_erase = mem_erase;
+    self_p->step_set = step_set;
+    self_p->step_get = step_get;
     self_p->patch_size = patch_size;
-    self_p->patch_offset = 0;
-    self_p->to_write = to_write;
-    self_p->from_offset = 0;
     self_p->arg_p = arg_p;
-    self_p->state = detools_apply_patch_state_init_t;
-    self_p->patch_reader.destroy = NULL;
-
-    return (0);
-}
-
-int detools_apply_patch_dump(struct detools_apply_patch_t *self_p,
-                             detools_state_write_t state_write)
-{
-    int res;
-
-    res = state_write(self_p->arg_p, self_p, sizeof(*self_p));
-
-    if (res != 0) {
-        return (-DETOOLS_IO_FAILED);
-    }
-
-    if (self_p->state == detools_apply_patch_state_init_t) {
-        return (0);
-    }
-
-    return (patch_reader_dump(&self_p->patch_reader,
-                              self_p->compression,
-                              state_write));
-}
-
-int detools_apply_patch_restore(struct detools_apply_patch_t *self_p,
-                                detools_state_read_t state_read)
-{
-    int res;
-    struct detools_apply_patch_t dumped;
-
-    res = state_read(self_p->arg_p, &dumped, sizeof(dumped));
-
-    if (res != 0) {
-        return (-DETOOLS_IO_FAILED);
-    }
-
-    self_p->state = dumped.state;
-    self_p->patch_size = dumped.patch_size;
-
-    if (self_p->state == detools_apply_patch_state_init_t) {
-        return (0);
-    }
-
-    self_p->compression = dumped.compression;
-    self_p->patch_offset = dumped.patch_offset;
-    self_p->to_offset = dumped.to_offset;
-    self_p->to_size = dumped.to_size;
-    self_p->from_offset = dumped.from_offset;
-    self_p->chunk_size = dumped.chunk_size;
-
-    res = self_p->from_seek(self_p->arg_p, self_p->from_offset);
-
-    if (res != 0) {
-        return (-DETOOLS_IO_FAILED);
-    }
-
-    return (patch_reader_restore(&self_p->patch_reader,
-                                 &dumped.patch_reader,
-                                 &self_p->chunk,
-                                 self_p->compression,
-                                 state_read));
-}
-
-size_t detools_apply_patch_get_patch_offset(struct detools_apply_patch_t *self_p)
-{
-    return (self_p->patch_offset);
+    self_p->state = detools_apply_patch_in_place_state_init_t;
+    self_p->step = 0;
+    self_p->to_size = 0;
+
+    /* Segments are patched through the sequential functionality. */
+    return (detools_apply_patch_init(&self_p->apply_patch,
+                                     in_place_from_read,
+                                     in_place_from_seek,
+                                     patch_size,
+                                     in_place_to_write,
+                                     self_p));
 }
 
-size_t detools_apply_patch_get_to_offset(struct detools_apply_patch_t *self_p)
-{
-    return (self_p->to_offset);
-}
-
-int detools_apply_patch_process(struct detools_apply_patch_t *self_p,
-                                const uint8_t *patch_p,
-                                size_t size)
+int detools_apply_patch_in_place_process(
+    struct detools_apply_patch_in_place_t *self_p,
+    const uint8_t *patch_p,
+    size_t size)
 {
     int res;
+    struct detools_apply_patch_chunk_t *chunk_p;
 
     res = 0;
-    self_p->patch_offset += size;
-    self_p->chunk.buf_p = patch_p;
-    self_p->chunk.size = size;
-    self_p->chunk.offset = 0;
-
-    while (chunk_available(&self_p->chunk) && (res >= 0)) {
-        res = apply_patch_process_once(self_p);
+    chunk_p = &self_p->apply_patch.chunk;
+    self_p->apply_patch.patch_offset += size;
+    chunk_p->buf_p = patch_p;
+    chunk_p->size = size;
+    chunk_p->offset = 0;
+
+    while (chunk_available(chunk_p) && (res >= 0)) {
+        res = apply_patch_in_place_process_once(self_p);
     }
 
     if (res == 1) {
@@ -779,19 +3505,20 @@ int detools_apply_patch_process(struct detools_apply_patch_t *self_p,
     return (res);
 }
 
-int detools_apply_patch_finalize(struct detools_apply_patch_t *self_p)
+int detools_apply_patch_in_place_finalize(
+    struct detools_apply_patch_in_place_t *self_p)
 {
     int res;
 
-    self_p->chunk.size = 0;
-    self_p->chunk.offset = 0;
+    self_p->apply_patch.chunk.size = 0;
+    self_p->apply_patch.chunk.offset = 0;
 
     do {
-        res = apply_patch_process_once(self_p);
+        res = apply_patch_in_place_process_once(self_p);
     } while (res == 0);
 
     return (apply_patch_common_finalize(res,
-                                        &self_p->patch_reader,
+                                        &self_p->apply_patch.patch_reader,
                                         self_p->to_size));
 }
 
@@ -799,7 +3526,21 @@ int detools_apply_patch_finalize(struct detools_apply_patch_t *self_p)
  * Callback functionality.
  */
 
+#if DETOOLS_CONFIG_STATIC_STATE == 1
+
+/* Only one patch is applied at a time. */
+static struct {
+    union {
+        struct detools_apply_patch_t sequential;
+        struct detools_apply_patch_in_place_t in_place;
+    } state;
+    uint8_t chunk[DETOOLS_CONFIG_CHUNK_SIZE];
+} callbacks_arena ARENA;
+
+#endif
+
 static int callbacks_process(struct detools_apply_patch_t *apply_patch_p,
+                             uint8_t *chunk_p,
                              detools_read_t patch_read,
                              size_t patch_size,
                              void *arg_p)
@@ -807,21 +3548,21 @@ static int callbacks_process(struct detools_apply_patch_t *apply_patch_p,
     int res;
     size_t patch_offset;
     size_t chunk_size;
-    uint8_t chunk[512];
 
     res = 0;
     patch_offset = 0;
 
     while ((patch_offset < patch_size) && (res == 0)) {
-        chunk_size = MIN(patch_size - patch_offset, 512);
-        res = patch_read(arg_p, &chunk[0], chunk_size);
+        chunk_size = MIN(patch_size - patch_offset,
+                         DETOOLS_CONFIG_CHUNK_SIZE);
+        res = patch_read(arg_p, chunk_p, chunk_size);
 
         if (res == 0) {
             res = detools_apply_patch_process(apply_patch_p,
-                                              &chunk[0],
+                                              chunk_p,
                                               chunk_size);
             patch_offset += chunk_size;
-        } else {
+        } else if (res > 0) {
             res = -DETOOLS_IO_FAILED;
         }
     }
@@ -843,9 +3584,23 @@ int detools_apply_patch_callbacks(detools_read_t from_read,
                                   void *arg_p)
 {
     int res;
+#if DETOOLS_CONFIG_STATIC_STATE == 1
+    struct detools_apply_patch_t *apply_patch_p;
+    uint8_t *chunk_p;
+
+    apply_patch_p = &callbacks_arena.state.sequential;
+    chunk_p = &callbacks_arena.chunk[0];
+#else
     struct detools_apply_patch_t apply_patch;
+    struct detools_apply_patch_t *apply_patch_p;
+    uint8_t chunk[DETOOLS_CONFIG_CHUNK_SIZE];
+    uint8_t *chunk_p;
+
+    apply_patch_p = &apply_patch;
+    chunk_p = &chunk[0];
+#endif
 
-    res = detools_apply_patch_init(&apply_patch,
+    res = detools_apply_patch_init(apply_patch_p,
                                    from_read,
                                    from_seek,
                                    patch_size,
@@ -856,7 +3611,78 @@ int detools_apply_patch_callbacks(detools_read_t from_read,
         return (res);
     }
 
-    return (callbacks_process(&apply_patch, patch_read, patch_size, arg_p));
+    return (callbacks_process(apply_patch_p,
+                              chunk_p,
+                              patch_read,
+                              patch_size,
+                              arg_p));
+}
+
+int detools_apply_patch_in_place_callbacks(detools_mem_read_t mem_read,
+                                           detools_mem_write_t mem_write,
+                                           detools_mem_erase_t mem_erase,
+                                           detools_step_set_t step_set,
+                                           detools_step_get_t step_get,
+                                           detools_read_t patch_read,
+                                           size_t patch_size,
+                                           void *arg_p)
+{
+    int res;
+    size_t patch_offset;
+    size_t chunk_size;
+#if DETOOLS_CONFIG_STATIC_STATE == 1
+    struct detools_apply_patch_in_place_t *apply_patch_p;
+    uint8_t *chunk_p;
+
+    apply_patch_p = &callbacks_arena.state.in_place;
+    chunk_p = &callbacks_arena.chunk[0];
+#else
+    struct detools_apply_patch_in_place_t apply_patch;
+    struct detools_apply_patch_in_place_t *apply_patch_p;
+    uint8_t chunk[DETOOLS_CONFIG_CHUNK_SIZE];
+    uint8_t *chunk_p;
+
+    apply_patch_p = &apply_patch;
+    chunk_p = &chunk[0];
+#endif
+
+    res = detools_apply_patch_in_place_init(apply_patch_p,
+                                            mem_read,
+                                            mem_write,
+                                            mem_erase,
+                                            step_set,
+                                            step_get,
+                                            patch_size,
+                                            arg_p);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    patch_offset = 0;
+
+    while ((patch_offset < patch_size) && (res == 0)) {
+        chunk_size = MIN(patch_size - patch_offset,
+                         DETOOLS_CONFIG_CHUNK_SIZE);
+        res = patch_read(arg_p, chunk_p, chunk_size);
+
+        if (res == 0) {
+            res = detools_apply_patch_in_place_process(apply_patch_p,
+                                                       chunk_p,
+                                                       chunk_size);
+            patch_offset += chunk_size;
+        } else if (res > 0) {
+            res = -DETOOLS_IO_FAILED;
+        }
+    }
+
+    if (res == 0) {
+        res = detools_apply_patch_in_place_finalize(apply_patch_p);
+    } else {
+        (void)detools_apply_patch_in_place_finalize(apply_patch_p);
+    }
+
+    return (res);
 }
 
 const char *detools_error_as_string(int error)
@@ -882,6 +3708,12 @@ const char *detools_error_as_string(int error)
     case DETOOLS_INTERNAL_ERROR:
         return "Internal error.";
 
+    case DETOOLS_LZMA_INIT:
+        return "LZMA init.";
+
+    case DETOOLS_LZMA_DECODE:
+        return "LZMA decode.";
+
     case DETOOLS_OUT_OF_MEMORY:
         return "Out of memory.";
 
@@ -918,9 +3750,15 @@ const char *detools_error_as_string(int error)
     case DETOOLS_CORRUPT_PATCH_OVERFLOW:
         return "Corrupt patch, overflow.";
 
+    case DETOOLS_CORRUPT_PATCH_CRLE_KIND:
+        return "Corrupt patch, CRLE kind.";
+
     case DETOOLS_HEATSHRINK_HEADER:
         return "Heatshrink header.";
 
+    case DETOOLS_LZ4_HEADER:
+        return "LZ4 header.";
+
     default:
         return "Unknown error.";
     }
@@ -39,6 +39,74 @@
 #    define DETOOLS_CONFIG_COMPRESSION_HEATSHRINK  1
 #endif
 
+#ifndef DETOOLS_CONFIG_COMPRESSION_NONE
+#    define DETOOLS_CONFIG_COMPRESSION_NONE  1
+#endif
+
+#ifndef DETOOLS_CONFIG_COMPRESSION_CRLE
+#    define DETOOLS_CONFIG_COMPRESSION_CRLE  1
+#endif
+
+#ifndef DETOOLS_CONFIG_COMPRESSION_LZ4
+#    define DETOOLS_CONFIG_COMPRESSION_LZ4  0
+#endif
+
+/* Largest LZ4 block, all of it is kept in the apply patch object. */
+#ifndef DETOOLS_CONFIG_COMPRESSION_LZ4_BLOCK_SIZE
+#    define DETOOLS_CONFIG_COMPRESSION_LZ4_BLOCK_SIZE  1024
+#endif
+
+#ifndef DETOOLS_CONFIG_COMPRESSION_LZMA
+#    define DETOOLS_CONFIG_COMPRESSION_LZMA  0
+#endif
+
+/* Largest LZMA dictionary, kept in a static arena. At least 4096. */
+#ifndef DETOOLS_CONFIG_COMPRESSION_LZMA_DICT_SIZE
+#    define DETOOLS_CONFIG_COMPRESSION_LZMA_DICT_SIZE  16384
+#endif
+
+/* Largest sum of the LZMA lc and lp properties, the literal
+   probabilities take 1536 << lc + lp bytes of the static arena. */
+#ifndef DETOOLS_CONFIG_COMPRESSION_LZMA_LC_LP_MAX
+#    define DETOOLS_CONFIG_COMPRESSION_LZMA_LC_LP_MAX  3
+#endif
+
+/* Decompressed bytes read ahead to unpack sizes from memory. */
+#ifndef DETOOLS_CONFIG_PATCH_READER_PEEK_SIZE
+#    define DETOOLS_CONFIG_PATCH_READER_PEEK_SIZE  16
+#endif
+
+/* Diff and extra data are processed in pieces of this size. Two
+   buffers of it are in the apply patch object, and one more for the
+   data format in static memory. */
+#ifndef DETOOLS_CONFIG_DATA_BUFFER_SIZE
+#    define DETOOLS_CONFIG_DATA_BUFFER_SIZE  128
+#endif
+
+/* The callback functions read the patch in chunks of this size. */
+#ifndef DETOOLS_CONFIG_CHUNK_SIZE
+#    define DETOOLS_CONFIG_CHUNK_SIZE  512
+#endif
+
+#ifndef DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M
+#    define DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M  1
+#endif
+
+/* Maximum number of address map segments in a data format patch. The
+   map is in static memory, not in the apply patch object. */
+#ifndef DETOOLS_CONFIG_DATA_FORMAT_MAX_SEGMENTS
+#    define DETOOLS_CONFIG_DATA_FORMAT_MAX_SEGMENTS  32
+#endif
+
+/* Keep the state and patch chunk of the callback functions in static
+   memory instead of on the stack. */
+#ifndef DETOOLS_CONFIG_STATIC_STATE
+#    define DETOOLS_CONFIG_STATIC_STATE  0
+#endif
+
+/* Static decoder memory is put in the linker section named by
+   DETOOLS_CONFIG_ARENA_SECTION, if defined. */
+
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
@@ -53,10 +121,13 @@
 #define DETOOLS_BAD_PATCH_TYPE                            3
 #define DETOOLS_BAD_COMPRESSION                           4
 #define DETOOLS_INTERNAL_ERROR                            5
+#define DETOOLS_LZMA_INIT                                 6
+#define DETOOLS_LZMA_DECODE                               7
 #define DETOOLS_OUT_OF_MEMORY                             8
 #define DETOOLS_CORRUPT_PATCH                             9
 #define DETOOLS_IO_FAILED                                10
 #define DETOOLS_ALREADY_DONE                             11
+#define DETOOLS_LZ4_HEADER                               12
 #define DETOOLS_SHORT_HEADER                             18
 #define DETOOLS_NOT_ENOUGH_PATCH_DATA                    19
 #define DETOOLS_HEATSHRINK_SINK                          20
@@ -65,8 +136,20 @@
 #define DETOOLS_STEP_GET_FAILED                          23
 #define DETOOLS_ALREADY_FAILED                           24
 #define DETOOLS_CORRUPT_PATCH_OVERFLOW                   25
+#define DETOOLS_CORRUPT_PATCH_CRLE_KIND                  26
 #define DETOOLS_HEATSHRINK_HEADER                        27
 
+/* Patch types. */
+#define DETOOLS_PATCH_TYPE_SEQUENTIAL                     0
+#define DETOOLS_PATCH_TYPE_IN_PLACE                       1
+
+/* Data formats. */
+#define DETOOLS_DATA_FORMAT_ARM_CORTEX_M                  1
+
+/* Bytes read on each side of the from-data to find instructions and
+   pointers crossing its edges. */
+#define DETOOLS_DATA_FORMAT_CONTEXT_SIZE                  8
+
 /**
  * Read callback.
  *
@@ -230,6 +313,68 @@ struct detools_apply_patch_patch_reader_crle_t {
     } kind;
 };
 
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+
+enum detools_lz4_state_t {
+    detools_lz4_state_header_t = 0,
+    detools_lz4_state_block_size_t,
+    detools_lz4_state_stored_t,
+    detools_lz4_state_token_t,
+    detools_lz4_state_literal_length_t,
+    detools_lz4_state_literals_t,
+    detools_lz4_state_offset_low_t,
+    detools_lz4_state_offset_high_t,
+    detools_lz4_state_match_length_t,
+    detools_lz4_state_match_t
+};
+
+struct detools_apply_patch_patch_reader_lz4_t {
+    enum detools_lz4_state_t state;
+    struct detools_unpack_usize_t size;
+    uint8_t token;
+    size_t block_size;
+    size_t input_left;
+    size_t length;
+    size_t offset;
+    size_t read_pos;
+    size_t write_pos;
+    uint8_t block[DETOOLS_CONFIG_COMPRESSION_LZ4_BLOCK_SIZE];
+};
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1
+
+enum detools_lzma_state_t {
+    detools_lzma_state_header_t = 0,
+    detools_lzma_state_range_coder_t,
+    detools_lzma_state_packet_t,
+    detools_lzma_state_end_t
+};
+
+/* The probabilities and the dictionary are in a static arena in
+   detools.c. */
+struct detools_apply_patch_patch_reader_lzma_t {
+    enum detools_lzma_state_t state;
+    /* Header, or a packet that did not fit in the chunk. */
+    uint8_t input[20];
+    size_t input_size;
+    uint32_t range;
+    uint32_t code;
+    uint8_t lc;
+    uint8_t lp;
+    uint8_t pb;
+    uint8_t state_index;
+    uint32_t reps[4];
+    uint32_t position;
+    size_t dict_size;
+    size_t dict_pos;
+    bool dict_full;
+    size_t match_left;
+};
+
+#endif
+
 struct detools_apply_patch_patch_reader_t {
     struct detools_apply_patch_chunk_t *patch_chunk_p;
     struct {
@@ -238,13 +383,31 @@ struct detools_apply_patch_patch_reader_t {
         int offset;
         bool is_signed;
     } size;
+    struct {
+        uint8_t buf[DETOOLS_CONFIG_PATCH_READER_PEEK_SIZE];
+        size_t offset;
+        size_t size;
+    } peek;
     union {
+#if DETOOLS_CONFIG_COMPRESSION_HEATSHRINK == 1
         struct detools_apply_patch_patch_reader_heatshrink_t heatshrink;
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_CRLE == 1
+        struct detools_apply_patch_patch_reader_crle_t crle;
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+        struct detools_apply_patch_patch_reader_lz4_t lz4;
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1
+        struct detools_apply_patch_patch_reader_lzma_t lzma;
+#endif
     } compression;
     int (*destroy)(struct detools_apply_patch_patch_reader_t *self_p);
     int (*decompress)(struct detools_apply_patch_patch_reader_t *self_p,
                       uint8_t *buf_p,
                       size_t *size_p);
+    int (*zeros)(struct detools_apply_patch_patch_reader_t *self_p,
+                 size_t *size_p);
 };
 
 struct detools_apply_patch_chunk_t {
@@ -253,9 +416,43 @@ struct detools_apply_patch_chunk_t {
     size_t offset;
 };
 
+#if DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M == 1
+
+struct detools_data_format_segment_t {
+    uint32_t begin;
+    uint32_t size;
+    int32_t shift;
+};
+
+/**
+ * ARM Cortex-M data format. The from-data is read through an address
+ * map, moving BL instruction targets and literal pool pointers to
+ * where the to-data has them. The data format patch (dfpatch) is a
+ * sequence of sizes: data format, from-data address, from-data size,
+ * number of segments, and then begin (relative to the end of the
+ * previous segment), size and shift of each segment.
+ */
+struct detools_data_format_arm_cortex_m_t {
+    int left;
+    int field;
+    struct {
+        int value;
+        int offset;
+        bool is_signed;
+        bool first;
+    } size;
+    uint32_t from_address;
+    uint32_t from_size;
+    int number_of_segments;
+    struct detools_data_format_segment_t *segments_p;
+};
+
+#endif
+
 enum detools_apply_patch_state_t {
     detools_apply_patch_state_init_t = 0,
     detools_apply_patch_state_dfpatch_size_t,
+    detools_apply_patch_state_dfpatch_data_t,
     detools_apply_patch_state_diff_size_t,
     detools_apply_patch_state_diff_data_t,
     detools_apply_patch_state_extra_size_t,
@@ -283,6 +480,48 @@ struct detools_apply_patch_t {
     size_t chunk_size;
     struct detools_apply_patch_patch_reader_t patch_reader;
     struct detools_apply_patch_chunk_t chunk;
+    uint8_t to[DETOOLS_CONFIG_DATA_BUFFER_SIZE];
+    uint8_t from[DETOOLS_CONFIG_DATA_BUFFER_SIZE];
+#if DETOOLS_CONFIG_DATA_FORMAT_ARM_CORTEX_M == 1
+    struct detools_data_format_arm_cortex_m_t data_format;
+#endif
+};
+
+enum detools_apply_patch_in_place_state_t {
+    detools_apply_patch_in_place_state_init_t = 0,
+    detools_apply_patch_in_place_state_segment_t,
+    detools_apply_patch_in_place_state_done_t,
+    detools_apply_patch_in_place_state_failed_t
+};
+
+/**
+ * The in-place apply patch data structure. Each segment of the
+ * to-data is patched like a sequential patch by the embedded apply
+ * patch object, with from-data read from the part of the memory not
+ * yet overwritten.
+ */
+struct detools_apply_patch_in_place_t {
+    detools_mem_read_t mem_read;
+    detools_mem_write_t mem_write;
+    detools_mem_erase_t mem_erase;
+    detools_step_set_t step_set;
+    detools_step_get_t step_get;
+    size_t patch_size;
+    void *arg_p;
+    enum detools_apply_patch_in_place_state_t state;
+    int step;
+    size_t memory_size;
+    size_t segment_size;
+    size_t shift_size;
+    size_t from_size;
+    size_t to_size;
+    int number_of_shift_steps;
+    int number_of_segments;
+    int segment;
+    bool skip_segment;
+    uintptr_t from_pos;
+    uintptr_t to_pos;
+    struct detools_apply_patch_t apply_patch;
 };
 
 /**
@@ -392,7 +631,9 @@ int detools_apply_patch_finalize(struct detools_apply_patch_t *self_p);
  * @param[in] to_write Destination write callback.
  * @param[in] arg_p Argument passed to all callbacks.
  *
- * @return Size of to-data in bytes or negative error code.
+ * @return Size of to-data in bytes or negative error code. A
+ *         negative error code returned by patch_read is returned
+ *         as is, so the reader can tell why it stopped.
  */
 int detools_apply_patch_callbacks(detools_read_t from_read,
                                   detools_seek_t from_seek,
@@ -401,6 +642,88 @@ int detools_apply_patch_callbacks(detools_read_t from_read,
                                   detools_write_t to_write,
                                   void *arg_p);
 
+/**
+ * Initialize given in-place apply patch object.
+ *
+ * @param[out] self_p In-place apply patch object to initialize.
+ * @param[in] mem_read Callback to read data.
+ * @param[in] mem_write Callback to write data.
+ * @param[in] mem_erase Callback to erase memory.
+ * @param[in] step_set Callback to save step.
+ * @param[in] step_get Callback to get saved step.
+ * @param[in] patch_size Patch size in bytes.
+ * @param[in] arg_p Argument passed to the callbacks.
+ *
+ * @return zero(0) or negative error code.
+ */
+int detools_apply_patch_in_place_init(
+    struct detools_apply_patch_in_place_t *self_p,
+    detools_mem_read_t mem_read,
+    detools_mem_write_t mem_write,
+    detools_mem_erase_t mem_erase,
+    detools_step_set_t step_set,
+    detools_step_get_t step_get,
+    size_t patch_size,
+    void *arg_p);
+
+/**
+ * Call this function repeatedly until all patch data has been
+ * processed or an error occurres. Call
+ * detools_apply_patch_in_place_finalize() to finalize the patching,
+ * even if an error occurred.
+ *
+ * A previously interrupted patching resumes at the step returned by
+ * the step get callback. The whole patch must be processed again,
+ * but segments already written are not touched.
+ *
+ * @param[in,out] self_p Initialized in-place apply patch object.
+ * @param[in] patch_p Next chunk of the patch.
+ * @param[in] size Patch buffer size.
+ *
+ * @return zero(0) or negative error code.
+ */
+int detools_apply_patch_in_place_process(
+    struct detools_apply_patch_in_place_t *self_p,
+    const uint8_t *patch_p,
+    size_t size);
+
+/**
+ * Call once after all data has been processed to finalize the
+ * patching.
+ *
+ * @param[in,out] self_p Initialized in-place apply patch object.
+ *
+ * @return Size of to-data in bytes if the patch was applied
+ *         successfully, or negative error code.
+ */
+int detools_apply_patch_in_place_finalize(
+    struct detools_apply_patch_in_place_t *self_p);
+
+/**
+ * Apply given in-place patch using memory and step callbacks.
+ *
+ * @param[in] mem_read Memory read callback.
+ * @param[in] mem_write Memory write callback.
+ * @param[in] mem_erase Memory erase callback.
+ * @param[in] step_set Step set callback.
+ * @param[in] step_get Step get callback.
+ * @param[in] patch_read Patch read callback.
+ * @param[in] patch_size Patch size in bytes.
+ * @param[in] arg_p Argument passed to all callbacks.
+ *
+ * @return Size of to-data in bytes or negative error code. A
+ *         negative error code returned by patch_read is returned
+ *         as is, so the reader can tell why it stopped.
+ */
+int detools_apply_patch_in_place_callbacks(detools_mem_read_t mem_read,
+                                           detools_mem_write_t mem_write,
+                                           detools_mem_erase_t mem_erase,
+                                           detools_step_set_t step_set,
+                                           detools_step_get_t step_get,
+                                           detools_read_t patch_read,
+                                           size_t patch_size,
+                                           void *arg_p);
+
 /**
  * Get the error string for given error code.
  *
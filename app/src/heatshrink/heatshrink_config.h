@@ -12,7 +12,9 @@
     #define HEATSHRINK_FREE(P, SZ) free(P)
 #else
     /* Required parameters for static configuration */
+    #ifndef HEATSHRINK_STATIC_INPUT_BUFFER_SIZE
     #define HEATSHRINK_STATIC_INPUT_BUFFER_SIZE 256
+    #endif
     #define HEATSHRINK_STATIC_WINDOW_BITS 8
     #define HEATSHRINK_STATIC_LOOKAHEAD_BITS 7
 #endif
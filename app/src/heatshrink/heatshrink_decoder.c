@@ -285,6 +285,69 @@ static HSD_state st_yield_backref(heatshrink_decoder *hsd,
     return HSDS_YIELD_BACKREF;
 }
 
+static int skip_backref_zeros(heatshrink_decoder *hsd, size_t *count) {
+    uint8_t *buf = &hsd->buffers[HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(hsd)];
+    uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd)) - 1;
+    uint16_t neg_offset = hsd->output_index;
+    size_t i = 0;
+    if (hsd->output_count < *count) *count = hsd->output_count;
+
+    /* The copy repeats every NEG_OFFSET bytes, so those decide. */
+    for (i=0; i<*count && i<neg_offset; i++) {
+        if (buf[(hsd->head_index - neg_offset + i) & mask] != 0) { return 0; }
+    }
+    LOG("-- skipping %zu zeros from -%u bytes back\n", *count, neg_offset);
+    for (i=0; i<*count; i++) {
+        buf[hsd->head_index & mask] = 0;
+        hsd->head_index++;
+    }
+    hsd->output_count -= *count;
+    return 1;
+}
+
+HSD_poll_res heatshrink_decoder_skip_zeros(heatshrink_decoder *hsd,
+        size_t max, size_t *skipped) {
+    if ((hsd == NULL) || (skipped == NULL)) {
+        return HSDR_POLL_ERROR_NULL;
+    }
+    *skipped = 0;
+
+    while (*skipped < max) {
+        uint8_t in_state = hsd->state;
+        size_t count = max - *skipped;
+        switch (in_state) {
+        case HSDS_TAG_BIT:
+            hsd->state = st_tag_bit(hsd);
+            break;
+        case HSDS_BACKREF_INDEX_MSB:
+            hsd->state = st_backref_index_msb(hsd);
+            break;
+        case HSDS_BACKREF_INDEX_LSB:
+            hsd->state = st_backref_index_lsb(hsd);
+            break;
+        case HSDS_BACKREF_COUNT_MSB:
+            hsd->state = st_backref_count_msb(hsd);
+            break;
+        case HSDS_BACKREF_COUNT_LSB:
+            hsd->state = st_backref_count_lsb(hsd);
+            break;
+        case HSDS_YIELD_BACKREF:
+            if (!skip_backref_zeros(hsd, &count)) { return HSDR_POLL_MORE; }
+            *skipped += count;
+            if (hsd->output_count == 0) { hsd->state = HSDS_TAG_BIT; }
+            continue;
+        case HSDS_YIELD_LITERAL:
+            return HSDR_POLL_MORE;
+        default:
+            return HSDR_POLL_ERROR_UNKNOWN;
+        }
+
+        /* Out of input in the middle of a tag, index or count. */
+        if (hsd->state == in_state) { return HSDR_POLL_EMPTY; }
+    }
+    return HSDR_POLL_MORE;
+}
+
 /* Get the next COUNT bits from the input buffer, saving incremental progress.
  * Returns NO_BITS on end of input, or if more than 15 bits are requested. */
 static uint16_t get_bits(heatshrink_decoder *hsd, uint8_t count) {
@@ -92,6 +92,14 @@ HSD_sink_res heatshrink_decoder_sink(heatshrink_decoder *hsd,
 HSD_poll_res heatshrink_decoder_poll(heatshrink_decoder *hsd,
     uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
 
+/* Skip at most MAX bytes of output that back-references copy from zeros,
+ * without copying them out, setting *SKIPPED to the number skipped. Stops
+ * at a literal or at a back-reference over non-zero data, returning
+ * HSDR_POLL_MORE, or when the input is exhausted, returning
+ * HSDR_POLL_EMPTY. */
+HSD_poll_res heatshrink_decoder_skip_zeros(heatshrink_decoder *hsd,
+    size_t max, size_t *skipped);
+
 /* Notify the dencoder that the input stream is finished.
  * If the return value is HSDR_FINISH_MORE, there is still more output, so
  * call heatshrink_decoder_poll and repeat. */
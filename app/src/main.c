@@ -9,6 +9,9 @@
 #include <zephyr/sys/printk.h>
 #include <zephyr/drivers/gpio.h>
 #include "delta/delta.h"
+#ifdef CONFIG_DELTA_STREAM
+#include "delta/delta_stream.h"
+#endif
 
 /* BUTTON */
 #define SW0_NODE	DT_ALIAS(sw0)
@@ -50,13 +53,16 @@ void button_pressed(const struct device *dev,
 					struct gpio_callback *cb,
 					uint32_t pins);
 
+/* FLASH STATE, STATIC SO THAT NO HEAP IS NEEDED */
+static struct flash_mem flash_mem;
+
 /* MAIN FUNCTION */
 void main(void)
 {
 	struct flash_mem *flash_pt;
 	int ret;
 
-	flash_pt = k_malloc(sizeof(struct flash_mem));
+	flash_pt = &flash_mem;
 	flash_pt->device = flash_device;
 
 	if (!flash_pt->device) {
@@ -66,6 +72,19 @@ void main(void)
 		return;
 	}
 
+#ifdef CONFIG_DELTA_APPLY_AT_BOOT
+	ret = delta_check_and_apply(flash_pt);
+#else
+	/* an in-place patch interrupted by a reset is finished right away */
+	ret = delta_resume_in_place(flash_pt);
+#endif
+	if (ret) {
+		#if PRINT_ERRORS == 1
+		printk("%s", delta_error_as_string(ret));
+		#endif
+		return;
+	}
+
 	/*Main loop*/
 	while (1) {
 		/* turn light on/off */
@@ -77,6 +96,11 @@ void main(void)
 
 		if (btn_flag) {
 			ret = delta_check_and_apply(flash_pt);
+#ifdef CONFIG_DELTA_STREAM
+			if (!ret) {
+				ret = delta_stream_check_and_apply(flash_pt);
+			}
+#endif
 			if (ret) {
 				#if PRINT_ERRORS == 1
 				printk("%s", delta_error_as_string(ret));
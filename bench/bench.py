@@ -0,0 +1,111 @@
+import os
+import sys
+import json
+import argparse
+import subprocess
+
+sys.path.insert(0,os.path.join(os.path.dirname(os.path.abspath(__file__)),'..','scripts'))
+import create_patch
+
+#every subdirectory of the corpus holds from.bin and to.bin, optionally with ELF files
+def corpus_pairs(corpus):
+    pairs = []
+    for name in sorted(os.listdir(corpus)):
+        path = os.path.join(corpus,name)
+        if(os.path.exists(os.path.join(path,'from.bin'))
+           and os.path.exists(os.path.join(path,'to.bin'))):
+            pairs.append((name,path))
+    return pairs
+
+def create(path,compression,from_address,patch_path):
+    from_data = open(os.path.join(path,'from.bin'),'rb').read()
+    to_data = open(os.path.join(path,'to.bin'),'rb').read()
+    from_elf = os.path.join(path,'from.elf')
+    to_elf = os.path.join(path,'to.elf')
+
+    patch = create_patch.plain_patch(from_data,to_data,compression)
+    if(os.path.exists(from_elf) and os.path.exists(to_elf)):
+        segments = create_patch.address_map(from_elf,to_elf)
+        df_patch = create_patch.data_format_patch(from_data,to_data,from_address,
+                                                  segments,compression)
+        if(len(df_patch)<len(patch)):
+            patch = df_patch
+
+    f=open(patch_path,'wb')
+    f.write(patch)
+    f.close()
+
+def apply(bench_apply,path,patch_path,runs):
+    out = subprocess.run([bench_apply,os.path.join(path,'from.bin'),patch_path,
+                          os.path.join(path,'to.bin'),str(runs)],
+                         capture_output=True,text=True)
+    if(out.returncode!=0):
+        print("ERROR: " + out.stderr.strip(),file=sys.stderr)
+        sys.exit(1)
+    return json.loads(out.stdout)
+
+def start(corpus,bench_apply,compressions,from_address,runs,work_dir):
+    os.makedirs(work_dir,exist_ok=True)
+    results = []
+    totals = {c: {'patch_size': 0,'to_size': 0,'apply_us': 0.0,'io': {}} for c in compressions}
+
+    for name,path in corpus_pairs(corpus):
+        for compression in compressions:
+            patch_path = os.path.join(work_dir,name + '.' + compression + '.bin')
+            create(path,compression,from_address,patch_path)
+            result = apply(bench_apply,path,patch_path,runs)
+            result['name'] = name
+            result['compression'] = compression
+            results.append(result)
+            for key in ('patch_size','to_size','apply_us'):
+                totals[compression][key] += result[key]
+            for kind,io in result['io'].items():
+                total = totals[compression]['io'].setdefault(kind,{'calls': 0,'bytes': 0})
+                total['calls'] += io['calls']
+                total['bytes'] += io['bytes']
+
+    for total in totals.values():
+        total['ratio'] = round(total['patch_size']/max(total['to_size'],1),4)
+        total['apply_us'] = round(total['apply_us'],1)
+
+    ram = results[0]['ram'] if results else 0
+    return {'corpus': corpus,'runs': runs,'ram': ram,'results': results,'totals': totals}
+
+#one line per profile and compression from reports of builds with different buffer
+#sizes, or of corpora built with different link layouts
+def summary(paths):
+    print("%-12s %-11s %7s %10s %12s %10s" % ('profile','compression','ram','patch',
+                                             'apply_us','calls'))
+    for path in paths:
+        report = json.load(open(path))
+        profile = os.path.splitext(os.path.basename(path))[0].replace('bench_','',1)
+        for compression,total in report['totals'].items():
+            calls = sum(io['calls'] for io in total['io'].values())
+            print("%-12s %-11s %7d %10d %12.1f %10d" % (profile,compression,report['ram'],
+                                                       total['patch_size'],
+                                                       total['apply_us'],calls))
+
+if __name__ == "__main__":
+    if(len(sys.argv)>1 and sys.argv[1]=='--summary'):
+        summary(sys.argv[2:])
+        sys.exit(0)
+
+    parser = argparse.ArgumentParser()
+    parser.add_argument('corpus')
+    parser.add_argument('bench_apply')
+    parser.add_argument('--compressions',nargs='+',default=['heatshrink','lzma'],
+                        choices=create_patch.COMPRESSIONS.keys())
+    parser.add_argument('--from-address',type=lambda x: int(x,0),default=0xc000)
+    parser.add_argument('--runs',type=int,default=5)
+    parser.add_argument('--work-dir',default='bench/patches')
+    parser.add_argument('--output')
+    args = parser.parse_args()
+
+    report = start(args.corpus,args.bench_apply,args.compressions,
+                   args.from_address,args.runs,args.work_dir)
+    text = json.dumps(report,indent=2)
+    if(args.output):
+        f=open(args.output,'w')
+        f.write(text + '\n')
+        f.close()
+    print(text)
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Applies a patch on the host with the same detools sources as the
+ * firmware and prints the fastest of a number of runs as JSON, with
+ * the calls the patcher makes counted like the firmware does (see
+ * struct delta_stats). Page erases are modelled on the firmware
+ * erasing each page of the target before writing to it. The RAM of
+ * the apply state and patch chunk is printed too, as it depends on
+ * the DETOOLS_CONFIG_* sizes it is built with.
+ *
+ * Usage: bench_apply <from> <patch> <to> [runs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "detools.h"
+
+#define HIST_SIZE 14
+#define PAGE_SIZE 4096
+
+enum io {
+	IO_PATCH_READ,
+	IO_FROM_READ,
+	IO_WRITE,
+	IO_SEEK,
+	IO_ERASE,
+	IO_COUNT
+};
+
+static const char *const io_names[IO_COUNT] = {
+	"patch_read", "from_read", "write", "seek", "erase"
+};
+
+struct io_stats {
+	unsigned long calls;
+	unsigned long bytes;
+	unsigned long hist[HIST_SIZE];
+};
+
+static struct io_stats io[IO_COUNT];
+static size_t erased_end;
+
+struct buffer {
+	uint8_t *data;
+	size_t size;
+	size_t offset;
+};
+
+static struct buffer from;
+static struct buffer patch;
+static struct buffer to;
+static struct buffer expected;
+
+static int read_file(const char *path, struct buffer *buf)
+{
+	FILE *f;
+	long size;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		return -1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	buf->data = malloc(size > 0 ? size : 1);
+	buf->size = size;
+	buf->offset = 0;
+
+	if (buf->data == NULL || fread(buf->data, 1, size, f) != (size_t)size) {
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/* Count a call in a histogram by the base two logarithm of its size. */
+static void count(enum io kind, size_t size)
+{
+	int bucket;
+
+	io[kind].calls++;
+	io[kind].bytes += size;
+
+	for (bucket = 0; bucket < HIST_SIZE - 1 && (size >> (bucket + 1)) > 0;
+	     bucket++) {
+	}
+	io[kind].hist[bucket]++;
+}
+
+static int from_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+	(void)arg_p;
+
+	count(IO_FROM_READ, size);
+
+	if (from.offset + size > from.size) {
+		return -DETOOLS_IO_FAILED;
+	}
+
+	memcpy(buf_p, &from.data[from.offset], size);
+	from.offset += size;
+	return 0;
+}
+
+static int from_seek(void *arg_p, int offset)
+{
+	(void)arg_p;
+
+	count(IO_SEEK, (size_t)abs(offset));
+	from.offset += offset;
+	return 0;
+}
+
+static int patch_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+	(void)arg_p;
+
+	count(IO_PATCH_READ, size);
+	if (patch.offset + size > patch.size) {
+		return -DETOOLS_IO_FAILED;
+	}
+
+	memcpy(buf_p, &patch.data[patch.offset], size);
+	patch.offset += size;
+	return 0;
+}
+
+static int to_write(void *arg_p, const uint8_t *buf_p, size_t size)
+{
+	(void)arg_p;
+
+	count(IO_WRITE, size);
+
+	while (to.offset + size > erased_end) {
+		count(IO_ERASE, PAGE_SIZE);
+		erased_end += PAGE_SIZE;
+	}
+
+	if (to.offset + size > to.size) {
+		return -DETOOLS_IO_FAILED;
+	}
+
+	memcpy(&to.data[to.offset], buf_p, size);
+	to.offset += size;
+	return 0;
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+	double best, start, elapsed;
+	int runs, i, j, ret;
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s <from> <patch> <to> [runs]\n", argv[0]);
+		return 1;
+	}
+
+	runs = argc > 4 ? atoi(argv[4]) : 5;
+
+	if (read_file(argv[1], &from) || read_file(argv[2], &patch) ||
+	    read_file(argv[3], &expected)) {
+		fprintf(stderr, "Failed to read input files\n");
+		return 1;
+	}
+
+	to.size = expected.size;
+	to.data = malloc(to.size > 0 ? to.size : 1);
+	best = 0;
+
+	for (i = 0; i < runs; i++) {
+		from.offset = 0;
+		patch.offset = 0;
+		to.offset = 0;
+		erased_end = 0;
+		memset(io, 0, sizeof(io));
+
+		start = now_us();
+		ret = detools_apply_patch_callbacks(from_read, from_seek,
+						    patch_read, patch.size,
+						    to_write, NULL);
+		elapsed = now_us() - start;
+
+		if (ret < 0) {
+			fprintf(stderr, "Patching failed: %s\n",
+				detools_error_as_string(ret));
+			return 1;
+		}
+
+		if ((size_t)ret != expected.size ||
+		    memcmp(to.data, expected.data, expected.size) != 0) {
+			fprintf(stderr, "Patched image does not match\n");
+			return 1;
+		}
+
+		if (i == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+
+	printf("{\"patch_size\": %zu, \"to_size\": %zu, \"apply_us\": %.1f, "
+	       "\"ram\": %zu, \"io\": {", patch.size, expected.size, best,
+	       sizeof(struct detools_apply_patch_t) + DETOOLS_CONFIG_CHUNK_SIZE);
+
+	for (i = 0; i < IO_COUNT; i++) {
+		printf("%s\"%s\": {\"calls\": %lu, \"bytes\": %lu, \"hist\": [",
+		       i > 0 ? ", " : "", io_names[i], io[i].calls, io[i].bytes);
+		for (j = 0; j < HIST_SIZE; j++) {
+			printf("%s%lu", j > 0 ? ", " : "", io[i].hist[j]);
+		}
+		printf("]}");
+	}
+
+	printf("}}\n");
+
+	return 0;
+}
@@ -0,0 +1,29 @@
+import os
+import sys
+import shutil
+
+HEADER_SIZE = 16
+
+#keep the smaller of a sequential patch from slot 0 and an in-place patch from
+#slot 1, the in-place one only if it fits in the patch partition as it cannot spill
+def start(slot0_patch,slot1_patch,patch_path,max_size,header_size=HEADER_SIZE):
+    best = slot0_patch
+    size0 = os.stat(slot0_patch).st_size
+    print("Patch from slot 0: " + hex(size0))
+
+    if(os.path.exists(slot1_patch)):
+        size1 = os.stat(slot1_patch).st_size
+        print("Patch from slot 1: " + hex(size1))
+        if(size1<size0 and header_size+size1<=max_size):
+            best = slot1_patch
+    else:
+        print("No patch from slot 1.")
+
+    shutil.copyfile(best,patch_path)
+    print("Using the patch from slot " + ("1" if best==slot1_patch else "0") + ".")
+
+if __name__ == "__main__":
+    if(len(sys.argv)>5):
+        start(sys.argv[1],sys.argv[2],sys.argv[3],int(sys.argv[4],0),int(sys.argv[5],0))
+    else:
+        start(sys.argv[1],sys.argv[2],sys.argv[3],int(sys.argv[4],0))
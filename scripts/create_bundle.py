@@ -0,0 +1,60 @@
+import sys
+import struct
+import hashlib
+import argparse
+import create_patch
+import sign_patch
+
+NO_IMAGE = 0xff #DELTA_BUNDLE_NO_IMAGE, the target is not an MCUboot image
+ENTRY_SIZE = 48 #sizeof(struct delta_bundle_entry)
+
+#a sub-patch is given as from.bin:to.bin:from_area:to_area[:image]
+def parse_entry(spec):
+    fields = spec.split(':')
+    if(len(fields) not in (4,5)):
+        raise argparse.ArgumentTypeError("expected from.bin:to.bin:from_area:to_area[:image]")
+    image = int(fields[4],0) if len(fields)==5 else NO_IMAGE
+    return (fields[0],fields[1],int(fields[2],0),int(fields[3],0),image)
+
+def start(bundle_path,entries,compression,max_size,key_path=None):
+    table = struct.pack('<I',len(entries))
+    patches = b''
+    offset = 4 + len(entries)*ENTRY_SIZE
+
+    for from_path,to_path,from_area,to_area,image in entries:
+        from_data = open(from_path,'rb').read()
+        to_data = open(to_path,'rb').read()
+        patch = create_patch.plain_patch(from_data,to_data,compression)
+        print("Area " + str(from_area) + " -> " + str(to_area) + ": patch size "
+              + hex(len(patch)))
+        table += struct.pack('<BBBBIII',from_area,to_area,image,0,
+                             offset+len(patches),len(patch),len(to_data))
+        table += hashlib.sha256(to_data).digest()
+        patches += patch
+
+    bundle = table + patches
+    header = 'NEWB'.encode() + len(bundle).to_bytes(4,byteorder='little')
+    header += bytes(8) #bundles do not spill
+    if(key_path!=None):
+        header += sign_patch.sign(key_path,header,bundle)
+    if(len(header)+len(bundle)>max_size):
+        print("ERROR: Bundle too large for patch partition!")
+        sys.exit(1)
+
+    f=open(bundle_path,'wb')
+    f.write(header)
+    f.write(bundle)
+    f.close()
+
+    print("Bundle size: " + hex(len(bundle)) + " + " + hex(len(header)) + " (header)")
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('bundle_path')
+    parser.add_argument('max_size',type=lambda x: int(x,0))
+    parser.add_argument('entries',nargs='+',type=parse_entry)
+    parser.add_argument('--compression',choices=create_patch.COMPRESSIONS.keys(),
+                        default='heatshrink')
+    parser.add_argument('--key',help="sign the bundle with this key, for CONFIG_DELTA_SIGNATURE")
+    args = parser.parse_args()
+    start(args.bundle_path,args.entries,args.compression,args.max_size,args.key)
@@ -0,0 +1,387 @@
+import os
+import sys
+import argparse
+import bisect
+import struct
+from io import BytesIO
+import detools
+import heatshrink2
+import lzma
+
+DATA_FORMAT_ARM_CORTEX_M = 1
+MAX_SEGMENTS = 32 #must not exceed DETOOLS_CONFIG_DATA_FORMAT_MAX_SEGMENTS
+MAX_SEGMENT_GAP = 0x10000 #symbols further apart than this are not merged
+COMPRESSIONS = {'none': 0, 'lzma': 1, 'crle': 2, 'heatshrink': 4, 'lz4': 7}
+HEATSHRINK_HEADER = 0x44 #window 8, lookahead 7, as the device expects
+CRLE_MIN_REPETITIONS = 6
+LZ4_BLOCK_SIZE = 1024 #must match CONFIG_DELTA_COMPRESSION_LZ4_BLOCK_SIZE
+LZMA_DICT_SIZE = 16384 #must not exceed CONFIG_DELTA_COMPRESSION_LZMA_DICT_SIZE
+LZMA_LC_LP_MAX = 3 #must not exceed CONFIG_DELTA_COMPRESSION_LZMA_LC_LP_MAX
+IMAGE_MAGIC = 0x96f3b83d #MCUboot image header, see bootutil/image.h
+IMAGE_HEADER = '<IIHHIIBBHII'
+IMAGE_HEADER_SIZE = 32
+IMAGE_TLV_INFO_MAGIC = 0x6907
+IMAGE_SECTION = '<IHHIIIHHBBHII' #struct delta_image_section
+
+#detools size encoding: 6 bits and a sign bit in the first byte, then 7 bits per byte
+def pack_size(value):
+    out = [0x40 if value<0 else 0]
+    value = abs(value)
+    out[0] |= value & 0x3f
+    value >>= 6
+    while(value>0):
+        out[-1] |= 0x80
+        out.append(value & 0x7f)
+        value >>= 7
+    return bytes(out)
+
+#unsigned, 7 bits per byte
+def pack_usize(value):
+    out = [value & 0x7f]
+    value >>= 7
+    while(value>0):
+        out[-1] |= 0x80
+        out.append(value & 0x7f)
+        value >>= 7
+    return bytes(out)
+
+#scattered records (0, size, data) and repeated records (1, repetitions, value)
+def crle_compress(data):
+    out = b''
+    scattered = b''
+    i = 0
+    while(i<len(data)):
+        j = i
+        while(j<len(data) and data[j]==data[i]):
+            j += 1
+        if(j-i>=CRLE_MIN_REPETITIONS):
+            if(len(scattered)>0):
+                out += bytes([0]) + pack_usize(len(scattered)) + scattered
+                scattered = b''
+            out += bytes([1]) + pack_usize(j-i) + bytes([data[i]])
+        else:
+            scattered += data[i:j]
+        i = j
+    if(len(scattered)>0):
+        out += bytes([0]) + pack_usize(len(scattered)) + scattered
+    return out
+
+#block size log2, then independent blocks, each prefixed by its size and a stored flag
+def lz4_compress(data,block_size):
+    import lz4.block
+
+    out = bytes([block_size.bit_length()-1])
+    for i in range(0,len(data),block_size):
+        block = data[i:i+block_size]
+        compressed = lz4.block.compress(block,mode='high_compression',
+                                        store_size=False)
+        if(len(compressed)<len(block)):
+            out += pack_usize(len(compressed)<<1) + compressed
+        else:
+            out += pack_usize(len(block)<<1 | 1) + block
+    return out
+
+#LZMA_Alone format with an end marker, the smallest of a few lc, lp and pb
+def lzma_compress(data,dict_size):
+    best = None
+    for lc,lp,pb in ((3,0,2),(0,0,0),(1,1,1),(0,1,1),(2,0,0),(0,2,2)):
+        if(lc+lp>LZMA_LC_LP_MAX):
+            continue
+        compressed = lzma.compress(data,format=lzma.FORMAT_ALONE,filters=[{
+            'id': lzma.FILTER_LZMA1,'preset': 9 | lzma.PRESET_EXTREME,
+            'dict_size': dict_size,'lc': lc,'lp': lp,'pb': pb}])
+        if(best==None or len(compressed)<len(best)):
+            best = compressed
+    return best
+
+def compress(stream,compression):
+    if(compression=='heatshrink'):
+        return (bytes([HEATSHRINK_HEADER])
+                + heatshrink2.compress(stream,window_sz2=8,lookahead_sz2=7))
+    if(compression=='crle'):
+        return crle_compress(stream)
+    if(compression=='lz4'):
+        return lz4_compress(stream,LZ4_BLOCK_SIZE)
+    if(compression=='lzma'):
+        return lzma_compress(stream,LZMA_DICT_SIZE)
+    return stream
+
+#
+# ADDRESS MAP
+#
+
+def elf_symbols(path):
+    from elftools.elf.elffile import ELFFile
+    from elftools.elf.sections import SymbolTableSection
+
+    symbols = {}
+    duplicates = set()
+    f=open(path,'rb')
+    for section in ELFFile(f).iter_sections():
+        if(not isinstance(section,SymbolTableSection)):
+            continue
+        for symbol in section.iter_symbols():
+            if(symbol['st_info']['type'] not in ('STT_FUNC','STT_OBJECT')
+               or symbol['st_size']==0 or symbol['st_shndx']=='SHN_UNDEF'):
+                continue
+            if(symbol.name in symbols):
+                duplicates.add(symbol.name)
+            symbols[symbol.name] = (symbol['st_value'] & ~1,symbol['st_size'])
+    f.close()
+
+    #static symbols with the same name can not be matched
+    for name in duplicates:
+        del symbols[name]
+    return symbols
+
+#segments of from-addresses that moved by the same amount in the to-image
+def address_map(from_elf,to_elf):
+    from_symbols = elf_symbols(from_elf)
+    to_symbols = elf_symbols(to_elf)
+
+    matched = []
+    for name,(address,size) in from_symbols.items():
+        if(name in to_symbols and to_symbols[name][1]==size):
+            matched.append((address,size,to_symbols[name][0]-address))
+    matched.sort()
+
+    segments = []
+    for address,size,shift in matched:
+        if(len(segments)>0):
+            begin,end,last_shift = segments[-1]
+            if(address<end):
+                continue
+            #the gap (literal pools, strings) moved with its neighbours
+            if(last_shift==shift and address-end<=MAX_SEGMENT_GAP):
+                segments[-1] = (begin,address+size,shift)
+                continue
+        segments.append((address,address+size,shift))
+
+    #keep the largest segments if there are too many
+    if(len(segments)>MAX_SEGMENTS):
+        segments = sorted(segments,key=lambda s: s[1]-s[0],reverse=True)
+        segments = sorted(segments[:MAX_SEGMENTS])
+    return segments
+
+#
+# ARM CORTEX-M DATA FORMAT, MUST MATCH data_format_transform() IN detools.c
+#
+
+def shift_of(segments,begins,address):
+    i = bisect.bisect_right(begins,address)-1
+    if(i>=0 and address<segments[i][1]):
+        return segments[i][2]
+    return None
+
+def is_bl(data,i):
+    def first(j): return (data[j] | data[j+1]<<8) & 0xf800 == 0xf000
+    def second(j): return (data[j] | data[j+1]<<8) & 0xd000 == 0xd000
+    if(i<0 or i+4>len(data)):
+        return False
+    if(not first(i) or not second(i+2)):
+        return False
+    return i<2 or not first(i-2)
+
+def relocate_bl(segments,begins,data,address):
+    upper = data[0] | data[1]<<8
+    lower = data[2] | data[3]<<8
+    s = (upper>>10) & 1
+    i1 = ((lower>>13) & 1) ^ s ^ 1
+    i2 = ((lower>>11) & 1) ^ s ^ 1
+    offset = s<<24 | i1<<23 | i2<<22 | (upper & 0x3ff)<<12 | (lower & 0x7ff)<<1
+    if(s==1):
+        offset -= 1<<25
+
+    from_shift = shift_of(segments,begins,address)
+    to_shift = shift_of(segments,begins,(address+4+offset) & 0xffffffff)
+    if(from_shift==None or to_shift==None or from_shift==to_shift):
+        return None
+    offset += to_shift-from_shift
+    if(offset<-(1<<24) or offset>=(1<<24)):
+        return None
+
+    offset &= 0xffffffff
+    s = (offset>>24) & 1
+    i1 = (offset>>23) & 1
+    i2 = (offset>>22) & 1
+    upper = 0xf000 | s<<10 | (offset>>12) & 0x3ff
+    lower = 0xd000 | (i1^s^1)<<13 | (i2^s^1)<<11 | (offset>>1) & 0x7ff
+    return upper.to_bytes(2,'little') + lower.to_bytes(2,'little')
+
+def relocate_pointer(segments,begins,data):
+    value = int.from_bytes(data,'little')
+    shift = shift_of(segments,begins,value & ~1)
+    if(shift==None or shift==0):
+        return None
+    return ((value+shift) & 0xffffffff).to_bytes(4,'little')
+
+def transform(data,from_address,segments):
+    begins = [s[0] for s in segments]
+    out = bytearray(data)
+    for i in range(len(data)):
+        address = (from_address+i) & 0xffffffff
+        if(address%2!=0):
+            continue
+        if(is_bl(data,i)):
+            value = relocate_bl(segments,begins,data[i:i+4],address)
+        elif(address%4==0 and i+4<=len(data)
+             and not is_bl(data,i-2) and not is_bl(data,i+2)):
+            value = relocate_pointer(segments,begins,data[i:i+4])
+        else:
+            continue
+        if(value!=None):
+            out[i:i+4] = value
+    return bytes(out)
+
+def dfpatch(from_address,from_size,segments):
+    out = pack_size(DATA_FORMAT_ARM_CORTEX_M)
+    out += pack_size(from_address)
+    out += pack_size(from_size)
+    out += pack_size(len(segments))
+    end = 0
+    for begin,segment_end,shift in segments:
+        out += pack_size(begin-end) + pack_size(segment_end-begin) + pack_size(shift)
+        end = segment_end
+    return out
+
+#
+# PATCH
+#
+
+#uncompressed detools patch, split into its header and its stream
+def uncompressed_patch(from_data,to_data):
+    fpatch = BytesIO()
+    detools.create_patch(BytesIO(from_data),BytesIO(to_data),fpatch,
+                         compression='none')
+    patch = fpatch.getvalue()
+
+    fto = BytesIO()
+    detools.apply_patch(BytesIO(from_data),BytesIO(patch),fto)
+    if(fto.getvalue()!=to_data):
+        print("ERROR: Patch does not reproduce the target image!")
+        sys.exit(1)
+
+    #type byte and to-size, then the stream starting with a zero dfpatch size
+    header_end = 1
+    while(patch[header_end] & 0x80):
+        header_end += 1
+    header_end += 1
+    if(patch[header_end]!=0):
+        print("ERROR: Unexpected patch layout!")
+        sys.exit(1)
+    return patch[:header_end],patch[header_end:]
+
+#the stream is compressed here since not all device compressions exist in detools
+def finish_patch(header,stream,compression):
+    return (bytes([header[0] & 0xf0 | COMPRESSIONS[compression]]) + header[1:]
+            + compress(stream,compression))
+
+def plain_patch(from_data,to_data,compression):
+    header,stream = uncompressed_patch(from_data,to_data)
+    return finish_patch(header,stream,compression)
+
+#sequential patch of the relocated from-image, with the dfpatch spliced in
+def data_format_patch(from_data,to_data,from_address,segments,compression):
+    relocated = transform(from_data,from_address,segments)
+    header,stream = uncompressed_patch(relocated,to_data)
+
+    df = dfpatch(from_address,len(from_data),segments)
+    stream = pack_size(len(df)) + df + stream[1:]
+    return finish_patch(header,stream,compression)
+
+#
+# IMAGE PATCH
+#
+
+#header fields, payload and TLV trailer of a signed MCUboot image, or None
+#if the device could not rebuild its header
+def split_image(data):
+    if(len(data)<IMAGE_HEADER_SIZE):
+        return None
+    header = struct.unpack_from(IMAGE_HEADER,data)
+    magic,load_addr,hdr_size,protect_tlv_size,img_size = header[0:5]
+    pad = header[10]
+    end = hdr_size+img_size+protect_tlv_size
+    if(magic!=IMAGE_MAGIC or hdr_size<IMAGE_HEADER_SIZE or end+4>len(data)):
+        return None
+    #the header is rebuilt with zeros up to the payload
+    if(pad!=0 or any(data[IMAGE_HEADER_SIZE:hdr_size])):
+        return None
+    tlv_magic,tlv_tot = struct.unpack_from('<HH',data,end)
+    if(tlv_magic!=IMAGE_TLV_INFO_MAGIC or end+tlv_tot>len(data)):
+        return None
+    return header,data[hdr_size:hdr_size+img_size],data[hdr_size+img_size:end+tlv_tot]
+
+def image_section(from_header,to_header,trailer_size):
+    magic,load_addr,hdr_size,protect_tlv_size,img_size,flags,major,minor,revision,\
+        build_num,pad = to_header
+    return struct.pack(IMAGE_SECTION,from_header[4],from_header[2],hdr_size,load_addr,
+                       img_size,flags,protect_tlv_size,revision,major,minor,0,
+                       build_num,trailer_size)
+
+def start(from_path,to_path,patch_path,from_address,from_elf,to_elf,compression,
+          lz4_block_size,lzma_dict_size,image=False):
+    global LZ4_BLOCK_SIZE,LZMA_DICT_SIZE
+    LZ4_BLOCK_SIZE = lz4_block_size
+    LZMA_DICT_SIZE = lzma_dict_size
+    from_data = open(from_path,'rb').read()
+    to_data = open(to_path,'rb').read()
+
+    #only the payloads are diffed, the device rebuilds the header and
+    #copies the trailer
+    section = b''
+    trailer = b''
+    if(image):
+        from_image = split_image(from_data)
+        to_image = split_image(to_data)
+        if(from_image==None or to_image==None):
+            print("ERROR: Image patches need MCUboot images with TLVs and zero header padding!")
+            sys.exit(1)
+        trailer = to_image[2]
+        section = image_section(from_image[0],to_image[0],len(trailer))
+        from_address += from_image[0][2]
+        from_data = from_image[1]
+        to_data = to_image[1]
+        print("Image header: " + hex(to_image[0][2]) + ", trailer: " + hex(len(trailer)))
+
+    patch = plain_patch(from_data,to_data,compression)
+    print("Patch size: " + hex(len(patch)))
+
+    if(from_elf==None or not os.path.exists(from_elf) or not os.path.exists(to_elf)):
+        print("No ELF files, creating patch without data format.")
+    else:
+        segments = address_map(from_elf,to_elf)
+        df_patch = data_format_patch(from_data,to_data,from_address,segments,
+                                     compression)
+        print("Data format patch size: " + hex(len(df_patch)) + " ("
+              + str(len(segments)) + " segments)")
+        if(len(df_patch)<len(patch)):
+            patch = df_patch
+
+    patch = section + patch + trailer
+    f=open(patch_path,'wb')
+    f.write(patch)
+    f.close()
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('from_path')
+    parser.add_argument('to_path')
+    parser.add_argument('patch_path')
+    parser.add_argument('from_address',type=lambda x: int(x,0))
+    parser.add_argument('from_elf',nargs='?')
+    parser.add_argument('to_elf',nargs='?')
+    parser.add_argument('--compression',choices=COMPRESSIONS.keys(),
+                        default='heatshrink')
+    parser.add_argument('--lz4-block-size',type=int,default=LZ4_BLOCK_SIZE)
+    parser.add_argument('--lzma-dict-size',type=int,default=LZMA_DICT_SIZE)
+    parser.add_argument('--image',action='store_true',
+                        help="patch the payload only, for CONFIG_DELTA_IMAGE_PATCH")
+    args = parser.parse_args()
+    if(args.lz4_block_size<16 or args.lz4_block_size & (args.lz4_block_size-1)):
+        parser.error("--lz4-block-size must be a power of two")
+    if(args.lzma_dict_size<4096):
+        parser.error("--lzma-dict-size must be at least 4096")
+    start(args.from_path,args.to_path,args.patch_path,args.from_address,
+          args.from_elf,args.to_elf,args.compression,args.lz4_block_size,
+          args.lzma_dict_size,args.image)
@@ -0,0 +1,33 @@
+import os
+import sys
+from cryptography.hazmat.primitives.ciphers import Cipher, algorithms, modes
+
+KEY_SIZE = 16 #DELTA_KEY_SIZE, AES-128
+NONCE_SIZE = 16 #DELTA_NONCE_SIZE, the initial counter block
+
+#a new AES-128 key for PATCH_AES_KEY_PATH, provisioned with make provision-key
+def keygen(key_path):
+    f=open(key_path,'wb')
+    f.write(os.urandom(KEY_SIZE))
+    f.close()
+    print("Patch encryption key written to " + key_path)
+
+def load_key(key_path):
+    key = open(key_path,'rb').read()
+    if(len(key)!=KEY_SIZE):
+        print("ERROR: Patch encryption key must be " + str(KEY_SIZE) + " bytes!")
+        sys.exit(1)
+    return key
+
+#AES-128-CTR with a new nonce per patch, the nonce goes in the header
+def encrypt(key_path,patch):
+    nonce = os.urandom(NONCE_SIZE)
+    encryptor = Cipher(algorithms.AES(load_key(key_path)),modes.CTR(nonce)).encryptor()
+    return nonce,encryptor.update(patch) + encryptor.finalize()
+
+if __name__ == "__main__":
+    if(len(sys.argv)==3 and sys.argv[1]=='keygen'):
+        keygen(sys.argv[2])
+    else:
+        print("usage: encrypt_patch.py keygen key.bin")
+        sys.exit(1)
@@ -0,0 +1,63 @@
+import struct
+import subprocess
+import sys
+
+ARENA = ".delta_arena" #linker section of CONFIG_DELTA_STATIC_ARENA
+
+#RAM the delta updater needs besides the code and the arena, by symbol name
+SYMBOLS = [
+    ("writer_stack", "pipeline writer stack"),
+    ("_ring_buffer_data_rx_ring", "stream receive buffer"),
+    ("bench", "shell bench images"),
+    ("z_main_stack", "main stack"),
+    ("kheap__system_heap", "system heap"),
+]
+
+def symbols(nm,elf):
+    out = subprocess.check_output([nm,"-S",elf]).decode()
+    found = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if(len(fields)==4):
+            found[fields[3]] = (int(fields[0],16),int(fields[1],16))
+        elif(len(fields)==3):
+            found[fields[2]] = (int(fields[0],16),0)
+    return found
+
+#address and size of a section, from the section headers of a 32-bit ELF
+def section(elf,name):
+    data = open(elf,"rb").read()
+    shoff, = struct.unpack_from("<I",data,0x20)
+    shentsize,shnum,shstrndx = struct.unpack_from("<HHH",data,0x2e)
+    headers = [struct.unpack_from("<IIIIII",data,shoff+i*shentsize) for i in range(shnum)]
+    strtab = headers[shstrndx][4]
+    for header in headers:
+        end = data.index(b"\0",strtab+header[0])
+        if(data[strtab+header[0]:end].decode()==name):
+            return header[3],header[5]
+    return None
+
+def start(nm,elf):
+    found = symbols(nm,elf)
+    total = 0
+
+    print("Delta update RAM footprint:")
+    arena = section(elf,ARENA)
+    if(arena!=None):
+        address,size = arena
+        print("  %-28s %6d B" % (ARENA,size))
+        members = sorted((value,name) for name,value in found.items()
+                         if value[1]>0 and address<=value[0]<address+size)
+        for (member_address,member_size),name in members:
+            print("    %-26s %6d B" % (name,member_size))
+        total += size
+
+    for name,what in SYMBOLS:
+        if(name in found):
+            size = found[name][1]
+            print("  %-28s %6d B  %s" % (name,size,what))
+            total += size
+    print("  %-28s %6d B" % ("total",total))
+
+if __name__ == "__main__":
+    start(sys.argv[1],sys.argv[2])
@@ -1,23 +1,116 @@
 import os
 import sys
+import zlib
+import sign_patch
+import encrypt_patch
 
-def padded_hex(s,p):
-    return '0x' + s[2:].zfill(p)
+HEADER_SIZE = 16
+PAGE_SIZE = 0x1000
+TRAILER_SIZE = 0x1000 #kept free for the MCUboot image trailer
+
+def round_up(x,a):
+    return ((x+a-1)//a)*a
+
+#a CRC-32 behind every chunk of patch data, for CONFIG_DELTA_PATCH_CRC
+def add_chunk_crcs(patch,chunk_size):
+    out = b''
+    for i in range(0,len(patch),chunk_size):
+        chunk = patch[i:i+chunk_size]
+        out += chunk + zlib.crc32(chunk).to_bytes(4,byteorder='little')
+    return out
+
+def start(path,max_size,header_size,slot_size=0,target_path=None,key_path=None,
+          aes_key_path=None,crc_chunk=0,image=False):
+    #signed patches carry the signature behind the header, then the nonce
+    #of encrypted patches
+    expected = HEADER_SIZE
+    if(key_path!=None):
+        expected += sign_patch.SIGNATURE_SIZE
+    if(aes_key_path!=None):
+        expected += encrypt_patch.NONCE_SIZE
+    if(header_size!=expected):
+        print("ERROR: Patch header size must be " + hex(expected) + "!")
+        sys.exit(1)
 
-def start(path,max_size,input_header_size):
-    header_size = max(input_header_size,8)
-    size=os.stat(path).st_size 
     f=open(path,'r+b')
     contents = f.read()
+
+    #encrypted before it is split, the spill is read as the rest of the patch
+    nonce = b''
+    if(aes_key_path!=None):
+        nonce,contents = encrypt_patch.encrypt(aes_key_path,contents)
+    #the CRCs are of the stored data
+    if(crc_chunk>0):
+        contents = add_chunk_crcs(contents,crc_chunk)
+    size = len(contents)
+
+    spill_path = os.path.splitext(path)[0] + "_spill.bin"
+    spill_size = 0
+    spill_offset = 0
+    for old in (spill_path,spill_path+".offset"):
+        if os.path.exists(old):
+            os.remove(old)
+
+    #move what does not fit in the patch partition to the end of slot 1
+    if((max_size-header_size)<size):
+        if(slot_size==0 or target_path==None):
+            print("WARNING: Patch too large for patch partition!")
+        else:
+            spill_size = size - (max_size-header_size)
+            spill_offset = (slot_size-TRAILER_SIZE-spill_size)//PAGE_SIZE*PAGE_SIZE
+            target_end = round_up(os.stat(target_path).st_size,PAGE_SIZE)
+            if(spill_offset<target_end):
+                print("ERROR: Patch too large for patch partition and slot 1!")
+                f.close()
+                sys.exit(1)
+            s=open(spill_path,'wb')
+            s.write(contents[size-spill_size:])
+            s.close()
+            open(spill_path+".offset",'w').write(hex(spill_offset))
+            contents = contents[:size-spill_size]
+
+    #image patches start with the image section of create_patch.py --image
+    magic = 'NEWI' if image else 'NEWP'
+    header = magic.encode() + size.to_bytes(4,byteorder='little')
+    header += spill_offset.to_bytes(4,byteorder='little')
+    header += spill_size.to_bytes(4,byteorder='little')
+    if(key_path!=None):
+        spill = open(spill_path,'rb').read() if spill_size>0 else b''
+        header += sign_patch.sign(key_path,header,nonce+contents+spill)
+    header += nonce
+
     f.seek(0)
-    f.write('NEWP'.encode()) 
-    f.write(size.to_bytes(header_size-4,byteorder='little'))
+    f.truncate()
+    f.write(header)
     f.write(contents)
+    f.close()
 
     print("Patch size: " + hex(size) + " + " + hex(header_size) + " (header)")
-
-    if((max_size-header_size)<size):
-        print("WARNING: Patch too large for patch partition!")
+    if(spill_size>0):
+        print("Spill: " + hex(spill_size) + " at slot 1 offset " + hex(spill_offset))
 
 if __name__ == "__main__":
-    start(sys.argv[1],int(sys.argv[2],0),int(sys.argv[3],0))
\ No newline at end of file
+    key_path = None
+    if('--key' in sys.argv):
+        i = sys.argv.index('--key')
+        key_path = sys.argv[i+1]
+        del sys.argv[i:i+2]
+    aes_key_path = None
+    if('--aes-key' in sys.argv):
+        i = sys.argv.index('--aes-key')
+        aes_key_path = sys.argv[i+1]
+        del sys.argv[i:i+2]
+    crc_chunk = 0
+    if('--crc-chunk' in sys.argv):
+        i = sys.argv.index('--crc-chunk')
+        crc_chunk = int(sys.argv[i+1],0)
+        del sys.argv[i:i+2]
+    image = '--image' in sys.argv
+    if(image):
+        sys.argv.remove('--image')
+    if(len(sys.argv)>5):
+        start(sys.argv[1],int(sys.argv[2],0),int(sys.argv[3],0),int(sys.argv[4],0),sys.argv[5],
+              key_path,aes_key_path,crc_chunk,image)
+    else:
+        start(sys.argv[1],int(sys.argv[2],0),int(sys.argv[3],0),key_path=key_path,
+              aes_key_path=aes_key_path,crc_chunk=crc_chunk,image=image)
@@ -11,6 +11,14 @@ def main(flashed_path,source_path):
     if(reply=="y"):
         print('Updating source.\n')
         copyfile(flashed_path,source_path)
+        #keep the ELF file for the data format of the next patch
+        flashed_elf = os.path.splitext(flashed_path)[0] + ".elf"
+        if(os.path.exists(flashed_elf)):
+            copyfile(flashed_elf,os.path.splitext(source_path)[0] + ".elf")
+        #and the map file for the stable link layout of the next build
+        flashed_map = os.path.splitext(flashed_path)[0] + ".map"
+        if(os.path.exists(flashed_map)):
+            copyfile(flashed_map,os.path.splitext(source_path)[0] + ".map")
     else:
         print('Source is not updated.\n')
 
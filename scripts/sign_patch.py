@@ -0,0 +1,43 @@
+import sys
+from cryptography.hazmat.primitives import hashes
+from cryptography.hazmat.primitives import serialization
+from cryptography.hazmat.primitives.asymmetric import ec
+from cryptography.hazmat.primitives.asymmetric.utils import decode_dss_signature
+
+SIGNATURE_SIZE = 64 #DELTA_SIGNATURE_SIZE, r and s of an ECDSA P-256 signature
+
+def load_key(key_path):
+    return serialization.load_pem_private_key(open(key_path,'rb').read(),password=None)
+
+#a new P-256 key for CONFIG_DELTA_SIGNATURE_KEY_FILE and PATCH_KEY_PATH
+def keygen(key_path):
+    key = ec.generate_private_key(ec.SECP256R1())
+    f=open(key_path,'wb')
+    f.write(key.private_bytes(serialization.Encoding.PEM,
+                              serialization.PrivateFormat.PKCS8,
+                              serialization.NoEncryption()))
+    f.close()
+    print("Patch signing key written to " + key_path)
+
+#the public key as the uncompressed point built into the firmware
+def export(key_path,out_path):
+    point = load_key(key_path).public_key().public_bytes(
+        serialization.Encoding.X962,serialization.PublicFormat.UncompressedPoint)
+    open(out_path,'wb').write(point)
+
+#the signature covers the header magic, the patch size and the patch,
+#with the nonce of encrypted patches in front, not the spill fields,
+#which the stream sends zeroed
+def sign(key_path,header,patch):
+    der = load_key(key_path).sign(header[0:8]+patch,ec.ECDSA(hashes.SHA256()))
+    r,s = decode_dss_signature(der)
+    return r.to_bytes(32,byteorder='big') + s.to_bytes(32,byteorder='big')
+
+if __name__ == "__main__":
+    if(len(sys.argv)==3 and sys.argv[1]=='keygen'):
+        keygen(sys.argv[2])
+    elif(len(sys.argv)==4 and sys.argv[1]=='export'):
+        export(sys.argv[2],sys.argv[3])
+    else:
+        print("usage: sign_patch.py keygen key.pem | export key.pem point.bin")
+        sys.exit(1)
@@ -0,0 +1,128 @@
+import os
+import re
+import sys
+import argparse
+
+ARCHIVE = 'libapp.a' #the app modules, as linked by Zephyr
+START = '__delta_layout_start'
+END = '__delta_layout_end'
+
+#
+# MAP FILE
+#
+
+#functions of the app modules by address, and the layout start and end if
+#the map is of a build with the stable layout
+def read_map(path):
+    functions = []
+    symbols = {}
+    pending = None
+    placed = False
+    for line in open(path):
+        #discarded sections are listed first, without addresses
+        if(line.startswith('Linker script and memory map')):
+            placed = True
+        if(not placed):
+            continue
+        symbol = re.match(r'\s+0x([0-9a-fA-F]+)\s+(' + START + '|' + END + r')\b',line)
+        if(symbol):
+            symbols[symbol.group(2)] = int(symbol.group(1),16)
+            continue
+        #long section names are followed by their address on the next line
+        section = re.match(r'\s(\.text\.\S+)(.*)$',line)
+        if(section):
+            pending = section.group(1)
+            line = section.group(2)
+        elif(pending==None):
+            continue
+        where = re.match(r'\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+\S*' + re.escape(ARCHIVE)
+                         + r'\((\S+)\)',line)
+        if(where):
+            address,size = int(where.group(1),16),int(where.group(2),16)
+            if(size>0):
+                functions.append((address,where.group(3),pending))
+        if(where or line.strip()!=''):
+            pending = None
+    functions.sort()
+    return functions,symbols.get(START),symbols.get(END)
+
+#modules in the order of their first function, each with its offset from the
+#layout start and its functions in order
+def modules_of(functions,start):
+    modules = []
+    index = {}
+    for address,module,section in functions:
+        if(module not in index):
+            index[module] = len(modules)
+            offset = address-start if start!=None else None
+            modules.append((module,offset,[]))
+        if(section not in modules[index[module]][2]):
+            modules[index[module]][2].append(section)
+    return modules
+
+#
+# LINKER SNIPPET
+#
+
+def module_lines(module,sections):
+    out = ['/* ' + module + ' */']
+    for section in sections:
+        out.append('*' + ARCHIVE + ':' + module + '(' + section + ')')
+    #functions new in this release stay in their module
+    out.append('*' + ARCHIVE + ':' + module + '(.text .text.*)')
+    return out
+
+#a module keeps the offset it had in the previous release unless the modules
+#in front of it outgrew their slack, and new modules go behind the others
+def snippet(modules,end,names,slack):
+    out = ['/* Stable link layout, see CONFIG_DELTA_STABLE_LAYOUT. Generated. */',
+           '. = ALIGN(4);',START + ' = .;']
+    known = []
+    for module,offset,sections in modules:
+        if(module not in names):
+            continue
+        known.append(module)
+        if(offset!=None):
+            out.append('. = MAX(., ' + START + ' + ' + hex(offset) + ');')
+        out += module_lines(module,sections)
+        if(offset==None):
+            out.append('. = . + ' + hex(slack) + ';')
+    if(end!=None):
+        out.append('. = MAX(., ' + START + ' + ' + hex(end) + ');')
+    for module in names:
+        if(module not in known):
+            out += module_lines(module,[])
+            out.append('. = . + ' + hex(slack) + ';')
+    out.append(END + ' = .;')
+    return '\n'.join(out) + '\n'
+
+def start(out_path,slack,names,map_path):
+    modules = []
+    end = None
+    if(map_path!=None and os.path.exists(map_path)):
+        functions,layout_start,layout_end = read_map(map_path)
+        modules = modules_of(functions,layout_start)
+        if(layout_start!=None and layout_end!=None):
+            end = layout_end-layout_start
+            print("Stable layout: offsets from " + map_path)
+        else:
+            print("Stable layout: order from " + map_path + ", fresh offsets")
+    else:
+        print("Stable layout: no previous map, fresh offsets")
+
+    text = snippet(modules,end,names,slack)
+    #unchanged snippets do not relink
+    if(os.path.exists(out_path) and open(out_path).read()==text):
+        return
+    f=open(out_path,'w')
+    f.write(text)
+    f.close()
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('out_path')
+    parser.add_argument('slack',type=lambda x: int(x,0))
+    parser.add_argument('modules',nargs='+',help="object names, such as delta.c.obj")
+    parser.add_argument('--map',help="zephyr.map of the previous release")
+    args = parser.parse_args()
+    start(args.out_path,args.slack,args.modules,args.map)
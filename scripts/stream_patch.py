@@ -0,0 +1,52 @@
+import os
+import sys
+import serial
+
+CREDIT = b'\x06'
+ABORT = b'\x15'
+CREDIT_SIZE = 256 #must match CONFIG_DELTA_STREAM_CREDIT_SIZE
+
+def start(port,path,baudrate):
+    f=open(path,'rb')
+    contents = f.read()
+    f.close()
+
+    if(contents[0:4] not in ('NEWP'.encode(),'NEWI'.encode())):
+        print("ERROR: Patch has no header, run make create-patch first.")
+        sys.exit(1)
+
+    #the whole patch goes over the stream, put the spill back
+    spill_path = os.path.splitext(path)[0] + "_spill.bin"
+    if(int.from_bytes(contents[12:16],byteorder='little')>0):
+        f=open(spill_path,'rb')
+        contents = contents[0:8] + bytes(8) + contents[16:] + f.read()
+        f.close()
+
+    print("Press button 1 on the device to start the transfer...")
+    s=serial.Serial(port,baudrate,timeout=None)
+    sent = 0
+    allowed = 0
+
+    while(sent<len(contents)):
+        reply = s.read(1)
+        if(reply==CREDIT):
+            allowed += CREDIT_SIZE
+            s.timeout = 10
+        elif(reply==ABORT):
+            print("ERROR: Device aborted after " + hex(sent) + " bytes.")
+            sys.exit(1)
+        elif(len(reply)==0):
+            print("ERROR: Timeout after " + hex(sent) + " bytes.")
+            sys.exit(1)
+
+        #send everything the device has room for
+        end = min(allowed,len(contents))
+        if(end>sent):
+            s.write(contents[sent:end])
+            sent = end
+
+    print("Patch sent: " + hex(sent) + " bytes")
+    s.close()
+
+if __name__ == "__main__":
+    start(sys.argv[1],sys.argv[2],int(sys.argv[3]) if len(sys.argv)>3 else 115200)
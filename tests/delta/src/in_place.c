@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/ztest.h>
+#include <zephyr/drivers/flash.h>
+#include "delta/delta.h"
+
+/* IMAGES. The patch rewrites the first in the second in slot 1, in two
+ * segments of a page, after shifting the first image up by a page.
+ */
+#define IMAGE_SIZE 0x2000
+
+static uint8_t from_byte(size_t i)
+{
+	return (uint8_t)(i * 31 + (i >> 8));
+}
+
+static uint8_t to_byte(size_t i)
+{
+	return from_byte(i) + (i % 0x400 == 0x11 ? 1 : 0);
+}
+
+/* In-place CRLE patch with a memory size of 0x3000, segments of
+ * 0x1000 and a shift of 0x1000, from the images above.
+ */
+static const uint8_t patch[] = {
+	0x12, 0x80, 0xc0, 0x01, 0x80, 0x40, 0x80, 0x40,
+	0x80, 0x80, 0x01, 0x80, 0x80, 0x01, 0x00, 0x03,
+	0x00, 0x80, 0x40, 0x01, 0x11, 0x00, 0x00, 0x01,
+	0x01, 0x01, 0xff, 0x07, 0x00, 0x00, 0x01, 0x01,
+	0x01, 0xff, 0x07, 0x00, 0x00, 0x01, 0x01, 0x01,
+	0xff, 0x07, 0x00, 0x00, 0x01, 0x01, 0x01, 0xf1,
+	0x07, 0x00, 0x00, 0x02, 0x80, 0x40, 0x01, 0x11,
+	0x00, 0x00, 0x01, 0x01, 0x01, 0xff, 0x07, 0x00,
+	0x00, 0x01, 0x01, 0x01, 0xff, 0x07, 0x00, 0x00,
+	0x01, 0x01, 0x01, 0xff, 0x07, 0x00, 0x00, 0x01,
+	0x01, 0x01, 0xf0, 0x07, 0x00,
+};
+
+/* FLASH THAT FAILS AN ERASE OF SLOT 1 ON REQUEST, in front of the
+ * simulated flash.
+ */
+static const struct device *const sim =
+	DEVICE_DT_GET(DT_CHOSEN(zephyr_flash_controller));
+
+static int slot1_erases;
+static int fail_erase; /* slot 1 erase that fails, counted from 1, or 0 */
+
+static int faulty_read(const struct device *dev, off_t offset, void *data,
+					   size_t len)
+{
+	return flash_read(sim, offset, data, len);
+}
+
+static int faulty_write(const struct device *dev, off_t offset,
+						const void *data, size_t len)
+{
+	return flash_write(sim, offset, data, len);
+}
+
+static int faulty_erase(const struct device *dev, off_t offset, size_t size)
+{
+	if (offset >= SECONDARY_OFFSET &&
+		offset < SECONDARY_OFFSET + SECONDARY_SIZE) {
+		slot1_erases++;
+		if (slot1_erases == fail_erase) {
+			return -EIO;
+		}
+	}
+
+	return flash_erase(sim, offset, size);
+}
+
+static const struct flash_parameters *faulty_get_parameters(
+	const struct device *dev)
+{
+	return flash_get_parameters(sim);
+}
+
+static void faulty_page_layout(const struct device *dev,
+							   const struct flash_pages_layout **layout,
+							   size_t *layout_size)
+{
+	const struct flash_driver_api *api = sim->api;
+
+	api->page_layout(sim, layout, layout_size);
+}
+
+static const struct flash_driver_api faulty_api = {
+	.read = faulty_read,
+	.write = faulty_write,
+	.erase = faulty_erase,
+	.get_parameters = faulty_get_parameters,
+	.page_layout = faulty_page_layout,
+};
+
+DEVICE_DEFINE(faulty_flash, "faulty_flash", NULL, NULL, NULL, NULL,
+			  POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEVICE, &faulty_api);
+
+/* Linked in place of the MCUboot call with --wrap. It fails, so that
+ * a finished apply returns here instead of rebooting.
+ */
+static bool upgrade_requested;
+
+int __wrap_boot_request_upgrade(int permanent)
+{
+	upgrade_requested = true;
+
+	return -EIO;
+}
+
+static struct flash_mem flash;
+
+static void write_patch(void)
+{
+	struct delta_patch_header header = {
+		.magic = DELTA_NEW_PATCH_MAGIC,
+		.size = sizeof(patch),
+	};
+	uint8_t buf[256];
+	size_t i, j;
+
+	zassert_ok(flash_erase(sim, SECONDARY_OFFSET, IMAGE_SIZE + PAGE_SIZE));
+	for (i = 0; i < IMAGE_SIZE; i += sizeof(buf)) {
+		for (j = 0; j < sizeof(buf); j++) {
+			buf[j] = from_byte(i + j);
+		}
+		zassert_ok(flash_write(sim, SECONDARY_OFFSET + i, buf, sizeof(buf)));
+	}
+
+	zassert_ok(flash_erase(sim, STORAGE_OFFSET, PAGE_SIZE));
+	zassert_ok(flash_erase(sim, STEP_LOG_OFFSET, STEP_LOG_SIZE));
+	zassert_ok(flash_write(sim, STORAGE_OFFSET, &header, sizeof(header)));
+	zassert_ok(flash_write(sim, STORAGE_OFFSET + HEADER_SIZE, patch,
+						   sizeof(patch)));
+}
+
+static uint32_t read_word(off_t offset)
+{
+	uint32_t word;
+
+	zassert_ok(flash_read(sim, offset, &word, sizeof(word)));
+
+	return word;
+}
+
+static void *in_place_setup(void)
+{
+	zassert_true(device_is_ready(sim));
+	flash.device = DEVICE_GET(faulty_flash);
+
+	return NULL;
+}
+
+ZTEST(in_place, test_nothing_to_resume)
+{
+	write_patch();
+	slot1_erases = 0;
+	fail_erase = 0;
+
+	zassert_equal(delta_resume_in_place(&flash), DELTA_OK);
+	zassert_equal(slot1_erases, 0);
+	zassert_equal(read_word(STORAGE_OFFSET), DELTA_NEW_PATCH_MAGIC);
+}
+
+ZTEST(in_place, test_interrupted_apply_resumes)
+{
+	uint8_t buf[256];
+	size_t i, j;
+
+	write_patch();
+
+	/* the two shift steps are done, the first segment erase fails */
+	slot1_erases = 0;
+	fail_erase = 3;
+	zassert_equal(delta_check_and_apply(&flash), -DETOOLS_IO_FAILED);
+	zassert_equal(read_word(STORAGE_OFFSET), DELTA_NEW_PATCH_MAGIC);
+	zassert_equal(read_word(STEP_LOG_OFFSET), sizeof(patch));
+	zassert_equal(read_word(STEP_LOG_OFFSET + 8), 2);
+
+	/* as at the next boot, only the segments are left */
+	slot1_erases = 0;
+	fail_erase = 0;
+	upgrade_requested = false;
+	zassert_equal(delta_resume_in_place(&flash), -1);
+	zassert_true(upgrade_requested);
+	zassert_equal(slot1_erases, 2);
+
+	for (i = 0; i < IMAGE_SIZE; i += sizeof(buf)) {
+		zassert_ok(flash_read(sim, SECONDARY_OFFSET + i, buf, sizeof(buf)));
+		for (j = 0; j < sizeof(buf); j++) {
+			zassert_equal(buf[j], to_byte(i + j), "at %zu", i + j);
+		}
+	}
+	zassert_equal(read_word(STORAGE_OFFSET), 0);
+	zassert_equal(read_word(STEP_LOG_OFFSET), 0xffffffffU);
+}
+
+ZTEST_SUITE(in_place, NULL, in_place_setup, NULL, NULL, NULL);
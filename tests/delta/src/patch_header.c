@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/ztest.h>
+#include "delta/delta.h"
+
+static const struct device *const flash_device =
+	DEVICE_DT_GET(DT_CHOSEN(zephyr_flash_controller));
+
+static struct flash_mem flash;
+
+static void write_header(uint32_t size, uint32_t spill_offset,
+						 uint32_t spill_size)
+{
+	struct delta_patch_header header = {
+		.magic = DELTA_NEW_PATCH_MAGIC,
+		.size = size,
+		.spill_offset = spill_offset,
+		.spill_size = spill_size,
+	};
+
+	zassert_ok(flash_erase(flash_device, STORAGE_OFFSET, PAGE_SIZE));
+	zassert_ok(flash_write(flash_device, STORAGE_OFFSET, &header,
+						   sizeof(header)));
+}
+
+static int read_header(void)
+{
+	struct delta_patch_header header;
+
+	return delta_read_patch_header(&flash, &header);
+}
+
+static void *patch_header_setup(void)
+{
+	zassert_true(device_is_ready(flash_device));
+	flash.device = flash_device;
+
+	return NULL;
+}
+
+ZTEST(patch_header, test_valid)
+{
+	write_header(0x1000, 0, 0);
+	zassert_equal(read_header(), DELTA_OK);
+
+	write_header(0x3000, 0x10000, 0x2000);
+	zassert_equal(read_header(), DELTA_OK);
+}
+
+ZTEST(patch_header, test_too_large)
+{
+	write_header(WEAR_OFFSET - STORAGE_OFFSET, 0, 0);
+	zassert_equal(read_header(), -DELTA_PATCH_HEADER_ERROR);
+
+	write_header(0x3000, SECONDARY_SIZE - SLOT1_TRAILER_SIZE - PAGE_SIZE,
+				 0x2000);
+	zassert_equal(read_header(), -DELTA_PATCH_HEADER_ERROR);
+}
+
+/* Sizes whose sums wrap to small values must not pass. */
+ZTEST(patch_header, test_wrapping_size)
+{
+	write_header(0xfffffff8U, 0, 0x8);
+	zassert_equal(read_header(), -DELTA_PATCH_HEADER_ERROR);
+
+	write_header(0xfffffff8U, 0, 0);
+	zassert_equal(read_header(), -DELTA_PATCH_HEADER_ERROR);
+}
+
+ZTEST(patch_header, test_wrapping_spill)
+{
+	write_header(0x11000, 0xfffff000U, 0x10000);
+	zassert_equal(read_header(), -DELTA_PATCH_HEADER_ERROR);
+
+	write_header(0xfffff000U, 0x3000, 0xffffe000U);
+	zassert_equal(read_header(), -DELTA_PATCH_HEADER_ERROR);
+}
+
+ZTEST_SUITE(patch_header, NULL, patch_header_setup, NULL, NULL, NULL);